@@ -0,0 +1,571 @@
+#include "Cluster.h"
+#include "Lc3Analysis.h"
+#include "Lc3Image.h"
+#include "Scheduler.h"
+#include "VmPool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#if defined(_WIN32)
+    using SocketHandle = SOCKET;
+    const SocketHandle NO_SOCKET = INVALID_SOCKET;
+
+    void CloseSocket(SocketHandle socket) { closesocket(socket); }
+
+    bool Interrupted() { return false; }
+#else
+    using SocketHandle = int;
+    constexpr SocketHandle NO_SOCKET = -1;
+
+    void CloseSocket(SocketHandle socket) { close(socket); }
+
+    bool Interrupted() { return errno == EINTR; }
+#endif
+
+    constexpr size_t JOBS_PER_WORKER = 4;       // Jobs that a node asks for per worker thread, to keep them all busy.
+    constexpr uint32_t MAX_PAYLOAD = 64u << 20; // The largest payload accepted, so a bad header can't allocate much.
+    constexpr size_t MAX_CACHED_IMAGES = 256;   // Distinct images that a node keeps between batches.
+
+    /// \brief A connected or listening TCP socket, closed when it is destroyed.
+    class Socket
+    {
+    public:
+        explicit Socket(SocketHandle handle = NO_SOCKET) : handle_{handle} {}
+        Socket(Socket&& other) noexcept : handle_{other.handle_} { other.handle_ = NO_SOCKET; }
+        Socket(const Socket&) = delete;
+        Socket& operator=(const Socket&) = delete;
+        Socket& operator=(Socket&& other) noexcept
+        {
+            std::swap(handle_, other.handle_);
+            return *this;
+        }
+        ~Socket()
+        {
+            if (handle_ != NO_SOCKET)
+            {
+                CloseSocket(handle_);
+            }
+        }
+
+        bool IsOpen() const { return handle_ != NO_SOCKET; }
+        SocketHandle Handle() const { return handle_; }
+
+        bool Send(const void* data, size_t size)
+        {
+            const char* next = static_cast<const char*>(data);
+            while (size != 0)
+            {
+                const auto chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+                const auto sent = send(handle_, next, chunk, 0);
+                if (sent < 0 && Interrupted())
+                {
+                    continue;
+                }
+                if (sent <= 0)
+                {
+                    return false;
+                }
+                next += sent;
+                size -= static_cast<size_t>(sent);
+            }
+            return true;
+        }
+
+        bool Receive(void* data, size_t size)
+        {
+            char* next = static_cast<char*>(data);
+            while (size != 0)
+            {
+                const auto chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+                const auto received = recv(handle_, next, chunk, 0);
+                if (received < 0 && Interrupted())
+                {
+                    continue;
+                }
+                if (received <= 0)
+                {
+                    return false;
+                }
+                next += received;
+                size -= static_cast<size_t>(received);
+            }
+            return true;
+        }
+
+    private:
+        SocketHandle handle_;
+    };
+
+    /// \brief Gets the host ready to use sockets.
+    bool StartNetworking()
+    {
+#if defined(_WIN32)
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+        // A peer that goes away would otherwise kill the process the next time it is sent something.
+        signal(SIGPIPE, SIG_IGN);
+        return true;
+#endif
+    }
+
+    void SetNoDelay(const Socket& socket)
+    {
+        // Messages go back and forth in turn, so don't hold the last part of one back waiting for more.
+        int on = 1;
+        setsockopt(socket.Handle(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+    }
+
+    Socket Listen(const char* port)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_INET6;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(nullptr, port, &hints, &addresses) != 0)
+        {
+            // The host may not do IPv6 at all.
+            hints.ai_family = AF_INET;
+            if (getaddrinfo(nullptr, port, &hints, &addresses) != 0)
+            {
+                return Socket();
+            }
+        }
+
+        Socket result;
+        for (const addrinfo* address = addresses; address && !result.IsOpen(); address = address->ai_next)
+        {
+            Socket socket(::socket(address->ai_family, address->ai_socktype, address->ai_protocol));
+            if (!socket.IsOpen())
+            {
+                continue;
+            }
+
+            // Take IPv4 connections too, and let a node be restarted straight away on the same port.
+            int off = 0;
+            int on = 1;
+            setsockopt(socket.Handle(), IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&off), sizeof(off));
+            setsockopt(socket.Handle(), SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+            if (bind(socket.Handle(), address->ai_addr, static_cast<int>(address->ai_addrlen)) == 0
+                && listen(socket.Handle(), SOMAXCONN) == 0)
+            {
+                result = std::move(socket);
+            }
+        }
+        freeaddrinfo(addresses);
+        return result;
+    }
+
+    Socket Connect(const std::string& node)
+    {
+        // The port follows the last colon, so that the host can be an IPv6 address in brackets.
+        const size_t colon = node.rfind(':');
+        if (colon == std::string::npos)
+        {
+            return Socket();
+        }
+        std::string host = node.substr(0, colon);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        {
+            host = host.substr(1, host.size() - 2);
+        }
+        const std::string port = node.substr(colon + 1);
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+        {
+            return Socket();
+        }
+        Socket result;
+        for (const addrinfo* address = addresses; address && !result.IsOpen(); address = address->ai_next)
+        {
+            Socket socket(::socket(address->ai_family, address->ai_socktype, address->ai_protocol));
+            if (socket.IsOpen() && connect(socket.Handle(), address->ai_addr, static_cast<int>(address->ai_addrlen)) == 0)
+            {
+                result = std::move(socket);
+            }
+        }
+        freeaddrinfo(addresses);
+        if (result.IsOpen())
+        {
+            SetNoDelay(result);
+        }
+        return result;
+    }
+
+    bool SendMessage(Socket& socket, uint16_t type, uint32_t id, const std::string& payload = std::string())
+    {
+        // Send the header and payload together, so that a small message goes in a single packet.
+        const MessageHeader header{CLUSTER_MAGIC, CLUSTER_VERSION, type, id, static_cast<uint32_t>(payload.size())};
+        std::string message(reinterpret_cast<const char*>(&header), sizeof(header));
+        message += payload;
+        return socket.Send(message.data(), message.size());
+    }
+
+    bool ReceiveMessage(Socket& socket, uint16_t& type, uint32_t& id, std::string& payload)
+    {
+        MessageHeader header;
+        if (!socket.Receive(&header, sizeof(header)) || header.magic != CLUSTER_MAGIC || header.version != CLUSTER_VERSION
+            || header.size > MAX_PAYLOAD)
+        {
+            return false;
+        }
+        type = header.type;
+        id = header.id;
+        payload.resize(header.size);
+        return socket.Receive(&payload[0], payload.size());
+    }
+
+    /// \brief Appends the bytes of a value to a payload.
+    template<typename T>
+    void Append(std::string& payload, const T& value)
+    {
+        payload.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    /// \brief An image that a node has been sent, kept so that jobs with the same image share its pages and analysis.
+    struct Image
+    {
+        lc3::Snapshot snapshot;
+        lc3::Analysis analysis;
+    };
+
+    /// \brief A job that a node has been sent.
+    struct NodeJob
+    {
+        uint32_t id;          // The queue's name for the job.
+        const Image* image;   // The job's image, or nullptr if it couldn't be read.
+        std::string input;    // The keys to feed the VM.
+        VmState* vm{nullptr}; // The VM running the job, owned by the scheduler.
+    };
+
+    /// \brief Reads a MSG_JOB's payload.
+    /// \return false if the payload is malformed, rather than just holding a bad snapshot.
+    bool ReadJob(const std::string& payload, std::map<uint64_t, Image>& images, NodeJob& job)
+    {
+        JobHeader header;
+        if (payload.size() < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, payload.data(), sizeof(header));
+        if (payload.size() != sizeof(header) + uint64_t{header.snapshotSize} + header.inputSize)
+        {
+            return false;
+        }
+        const char* snapshot = payload.data() + sizeof(header);
+        job.input.assign(snapshot + header.snapshotSize, header.inputSize);
+
+        // Jobs are mostly many runs of a few images, so only decode and analyse each image once.
+        const uint64_t key = lc3::Fnv1a(snapshot, header.snapshotSize);
+        auto image = images.find(key);
+        if (image == images.end())
+        {
+            Image decoded;
+            if (!lc3::DecodeSnapshot(snapshot, header.snapshotSize, decoded.snapshot))
+            {
+                job.image = nullptr;
+                return true;
+            }
+            decoded.analysis = lc3::Analyse(decoded.snapshot.mem, decoded.snapshot.regs.pc);
+            image = images.emplace(key, std::move(decoded)).first;
+        }
+        job.image = &image->second;
+        return true;
+    }
+
+    /// \brief Runs jobs for a queue until it has no more of them.
+    /// \return true if the queue said that it was done, false if the connection failed.
+    bool ServeQueue(Socket& queue, size_t workers, const SliceLimits& limits)
+    {
+        const uint32_t wanted = static_cast<uint32_t>(workers * JOBS_PER_WORKER);
+        std::map<uint64_t, Image> images;
+        for (;;)
+        {
+            std::string ready;
+            Append(ready, wanted);
+            if (!SendMessage(queue, MSG_READY, 0, ready))
+            {
+                return false;
+            }
+
+            // Jobs in a batch may share images with each other and with earlier batches, so the cache is only cleared
+            // between batches.
+            if (images.size() > MAX_CACHED_IMAGES)
+            {
+                images.clear();
+            }
+            std::vector<NodeJob> jobs;
+            for (;;)
+            {
+                uint16_t type;
+                uint32_t id;
+                std::string payload;
+                if (!ReceiveMessage(queue, type, id, payload))
+                {
+                    return false;
+                }
+                if (type == MSG_DONE)
+                {
+                    return true;
+                }
+                if (type == MSG_RUN)
+                {
+                    break;
+                }
+                NodeJob job{id, nullptr, {}};
+                if (type != MSG_JOB || !ReadJob(payload, images, job))
+                {
+                    return false;
+                }
+                jobs.push_back(std::move(job));
+            }
+
+            // Run the batch as though it had been given to --headless, each VM with its own input and output.
+            VmPool vms(jobs.size());
+            for (auto& job : jobs)
+            {
+                if (!job.image)
+                {
+                    continue;
+                }
+                VmState& vm = vms.Emplace();
+                vm.SetInput(std::move(job.input));
+                vm.CaptureOutput();
+                vm.Restore(job.image->snapshot);
+                vm.Prepare(job.image->analysis);
+                job.vm = &vm;
+            }
+            Scheduler::HeadlessConsole console;
+            Scheduler scheduler(std::move(vms), workers, limits);
+            scheduler.Run(console);
+
+            for (const auto& job : jobs)
+            {
+                ResultHeader header{};
+                std::string output;
+                if (job.vm)
+                {
+                    header.status = job.vm->Starved() ? JOB_STARVED : JOB_HALTED;
+                    header.retired = job.vm->Retired();
+                    output = job.vm->CapturedOutput();
+                }
+                else
+                {
+                    header.status = JOB_BAD_IMAGE;
+                }
+                header.outputSize = static_cast<uint32_t>(output.size());
+                std::string payload;
+                Append(payload, header);
+                payload += output;
+                if (!SendMessage(queue, MSG_RESULT, job.id, payload))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+
+    /// \brief The jobs that haven't been run yet, shared by the threads that talk to the nodes.
+    struct WorkQueue
+    {
+        WorkQueue(const std::vector<ClusterJob>& jobs, std::vector<ClusterResult>& results, size_t nodes)
+            : jobs{jobs}, results{results}, unfinished{jobs.size()}, nodes{nodes}
+        {
+            for (size_t job = 0; job < jobs.size(); ++job)
+            {
+                pending.push_back(job);
+            }
+        }
+
+        const std::vector<ClusterJob>& jobs;
+        std::vector<ClusterResult>& results;
+
+        std::mutex mutex;                // Guards everything below.
+        std::condition_variable changed; // Signalled when jobs are put back or finish.
+        std::deque<size_t> pending;      // Jobs that no node has, in the order that they should be handed out.
+        size_t unfinished;               // Jobs without a result.
+        size_t nodes;                    // Nodes still connected, or still being connected to.
+    };
+
+    /// \brief Hands jobs to a node until there are none left or the node goes away.
+    void FeedNode(const std::string& node, WorkQueue& queue)
+    {
+        std::vector<size_t> batch; // The jobs that the node has and hasn't finished.
+        Socket socket = Connect(node);
+        if (!socket.IsOpen())
+        {
+            fprintf(stderr, "failed to connect to %s\n", node.c_str());
+        }
+        while (socket.IsOpen())
+        {
+            uint16_t type;
+            uint32_t id;
+            std::string payload;
+            uint32_t wanted = 0;
+            if (!ReceiveMessage(socket, type, id, payload) || type != MSG_READY || payload.size() != sizeof(wanted))
+            {
+                break;
+            }
+            memcpy(&wanted, payload.data(), sizeof(wanted));
+
+            // Wait for jobs to turn up, which they can if another node goes away, or for them all to be finished.
+            // Share what is left out between the nodes, so that the first to ask doesn't take the lot.
+            {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                queue.changed.wait(lock, [&]() { return !queue.pending.empty() || queue.unfinished == 0; });
+                const size_t share = (queue.pending.size() + queue.nodes - 1) / queue.nodes;
+                for (size_t i = 0; i < std::max<size_t>(1, std::min<size_t>(wanted, share)) && !queue.pending.empty(); ++i)
+                {
+                    batch.push_back(queue.pending.front());
+                    queue.pending.pop_front();
+                }
+            }
+            if (batch.empty())
+            {
+                SendMessage(socket, MSG_DONE, 0);
+                break;
+            }
+
+            bool sent = true;
+            for (size_t i = 0; i < batch.size() && sent; ++i)
+            {
+                const ClusterJob& job = queue.jobs[batch[i]];
+                const std::string snapshot = lc3::EncodeSnapshot(job.snapshot);
+                std::string message;
+                Append(message, JobHeader{static_cast<uint32_t>(snapshot.size()), static_cast<uint32_t>(job.input.size())});
+                message += snapshot;
+                message += job.input;
+                sent = SendMessage(socket, MSG_JOB, static_cast<uint32_t>(batch[i]), message);
+            }
+            if (!sent || !SendMessage(socket, MSG_RUN, 0))
+            {
+                break;
+            }
+
+            while (!batch.empty())
+            {
+                ResultHeader header;
+                if (!ReceiveMessage(socket, type, id, payload) || type != MSG_RESULT || payload.size() < sizeof(header))
+                {
+                    break;
+                }
+                memcpy(&header, payload.data(), sizeof(header));
+                const auto job = std::find(batch.begin(), batch.end(), id);
+                if (job == batch.end() || payload.size() != sizeof(header) + header.outputSize)
+                {
+                    break;
+                }
+                batch.erase(job);
+
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                ClusterResult& result = queue.results[id];
+                result.status = header.status;
+                result.retired = header.retired;
+                result.output = payload.substr(sizeof(header));
+                result.node = node;
+                if (--queue.unfinished == 0)
+                {
+                    queue.changed.notify_all();
+                }
+            }
+            if (!batch.empty())
+            {
+                break;
+            }
+        }
+
+        // Whatever the node didn't finish goes back on the front of the queue for the nodes that are left.
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!batch.empty())
+        {
+            fprintf(stderr, "lost %s with %zu jobs unfinished\n", node.c_str(), batch.size());
+            queue.pending.insert(queue.pending.begin(), batch.begin(), batch.end());
+        }
+        --queue.nodes;
+        queue.changed.notify_all();
+    }
+} // namespace
+
+bool ServeJobs(const char* port, size_t workers, const SliceLimits& limits)
+{
+    if (!StartNetworking())
+    {
+        return false;
+    }
+    Socket listener = Listen(port);
+    if (!listener.IsOpen())
+    {
+        return false;
+    }
+    if (workers == 0)
+    {
+        workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    fprintf(stderr, "serving jobs on port %s with %zu workers\n", port, workers);
+
+    // Queues are served one at a time. Any others wait to be accepted until the one before has finished.
+    for (;;)
+    {
+        Socket queue(accept(listener.Handle(), nullptr, nullptr));
+        if (!queue.IsOpen())
+        {
+            continue;
+        }
+        SetNoDelay(queue);
+        if (!ServeQueue(queue, workers, limits))
+        {
+            fprintf(stderr, "lost the connection to a queue\n");
+        }
+    }
+}
+
+std::vector<ClusterResult> RunJobs(const std::vector<std::string>& nodes, const std::vector<ClusterJob>& jobs)
+{
+    std::vector<ClusterResult> results(jobs.size());
+    if (nodes.empty() || !StartNetworking())
+    {
+        return results;
+    }
+
+    WorkQueue queue(jobs, results, nodes.size());
+
+    std::vector<std::thread> feeders;
+    for (const auto& node : nodes)
+    {
+        feeders.emplace_back(FeedNode, std::cref(node), std::ref(queue));
+    }
+    for (auto& feeder : feeders)
+    {
+        feeder.join();
+    }
+    return results;
+}
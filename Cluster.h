@@ -0,0 +1,107 @@
+/// Running batches of VMs across several hosts.
+///
+/// A node is a host running `0x35_LC3 --serve port`. It runs jobs, each an image to boot or a snapshot to carry on
+/// from together with the keys to feed it, as headless VMs on its Scheduler, and sends back each VM's output, how it
+/// stopped and how many instructions it executed. The host that has the jobs connects to every node and acts as the
+/// work queue: a node asks for as many jobs as it has room for, runs them, sends their results and asks for more, so
+/// faster nodes and nodes with more cores end up doing more of the work. If a node goes away, the jobs that it was
+/// running go back on the queue for the others.
+///
+/// A job's image always travels as a snapshot, so a VM that has been booted and snapshotted on one host carries on from
+/// where it left off on another without running its boot code again.
+///
+/// Messages are a MessageHeader followed by its payload. A session goes:
+///
+///     node:  MSG_READY (the number of jobs it wants, as a uint32_t)
+///     queue: MSG_JOB for each job given to the node, then MSG_RUN, or MSG_DONE once there are no jobs left
+///     node:  MSG_RESULT for each job, in any order, then MSG_READY again
+///
+/// Everything is in host byte order, like an image cache, so nodes must share the byte order of the queue, as every
+/// host that the JIT supports does. A node that is sent something else drops the connection.
+
+#pragma once
+
+#include "Lc3Snapshot.h"
+#include "VmState.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+constexpr uint32_t CLUSTER_MAGIC = 0x4E33434C; // "LC3N" when written by a little-endian host.
+constexpr uint16_t CLUSTER_VERSION = 1;
+
+/// \brief The kinds of message.
+enum : uint16_t
+{
+    MSG_READY = 1,  // From a node: it wants more jobs.
+    MSG_JOB = 2,    // From the queue: a JobHeader, the job's snapshot and its input.
+    MSG_RUN = 3,    // From the queue: run the jobs sent since the last MSG_READY.
+    MSG_RESULT = 4, // From a node: a ResultHeader and the job's output.
+    MSG_DONE = 5    // From the queue: there are no more jobs, so the node can drop the connection.
+};
+
+/// \brief How a job ended.
+enum : uint16_t
+{
+    JOB_HALTED = 0,    // The VM halted of its own accord.
+    JOB_STARVED = 1,   // The VM was halted because it waited for input after its own had run out.
+    JOB_BAD_IMAGE = 2, // The node couldn't read the job's snapshot.
+    JOB_NOT_RUN = 3    // No node ran the job, e.g., because none could be reached. Never sent.
+};
+
+/// \brief The header at the start of every message.
+struct MessageHeader
+{
+    uint32_t magic;   // CLUSTER_MAGIC.
+    uint16_t version; // CLUSTER_VERSION.
+    uint16_t type;    // MSG_READY, MSG_JOB, etc.
+    uint32_t id;      // The job that a MSG_JOB or MSG_RESULT is about, otherwise zero.
+    uint32_t size;    // The number of bytes of payload that follow.
+};
+
+/// \brief The start of a MSG_JOB's payload, which goes on with the snapshot's bytes and then the input.
+struct JobHeader
+{
+    uint32_t snapshotSize; // Bytes of snapshot, in the format of a snapshot file.
+    uint32_t inputSize;    // Bytes of input.
+};
+
+/// \brief The start of a MSG_RESULT's payload, which goes on with the VM's output.
+struct ResultHeader
+{
+    uint16_t status;     // JOB_HALTED, etc.
+    uint16_t reserved;   // Zero.
+    uint32_t outputSize; // Bytes of output.
+    uint64_t retired;    // Instructions executed by the VM while it ran on the node.
+};
+
+/// \brief A VM to run on a cluster.
+struct ClusterJob
+{
+    lc3::Snapshot snapshot; // Where the VM starts. A snapshot of a freshly loaded image boots it.
+    std::string input;      // The keys to feed the VM, which is halted if it wants any more.
+};
+
+/// \brief What became of a ClusterJob.
+struct ClusterResult
+{
+    uint16_t status{JOB_NOT_RUN}; // JOB_HALTED, etc.
+    uint64_t retired{0};          // Instructions executed.
+    std::string output;           // Everything that the VM wrote.
+    std::string node;             // The node that ran the job.
+};
+
+/// \brief Serves jobs to whichever queue connects, one queue at a time, until the process is killed.
+/// \param port the TCP port to listen on.
+/// \param workers the number of worker threads, or 0 to use one per hardware thread.
+/// \param limits how long the VMs' time slices can be.
+/// \return false if the port couldn't be listened on. Otherwise it never returns.
+bool ServeJobs(const char* port, size_t workers, const SliceLimits& limits);
+
+/// \brief Runs jobs on a cluster and waits for them all to finish.
+/// \param nodes the nodes, each as host:port.
+/// \param jobs the jobs.
+/// \return a result for each job, in the same order. Jobs are only JOB_NOT_RUN if no node could run them.
+std::vector<ClusterResult> RunJobs(const std::vector<std::string>& nodes, const std::vector<ClusterJob>& jobs);
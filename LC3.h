@@ -2,8 +2,41 @@
 
 #pragma once
 
+#include "Lc3Decode.h"
+#include "Lc3Jit.h"
+#include "Lc3MemoryMonitor.h"
+#include "Lc3Profiler.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <type_traits>
 #include <variant>
+#include <vector>
+
+// Use computed goto for threaded dispatch where the compiler supports it. Define LC3_NO_COMPUTED_GOTO to fall back to a
+// table of member function pointers.
+#if !defined(LC3_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define LC3_COMPUTED_GOTO
+#endif
+
+// GCC's cross-jumping merges the identical dispatch sequences at the end of each handler back into one, which undoes
+// the point of threaded dispatch.
+#if defined(LC3_COMPUTED_GOTO) && !defined(__clang__)
+#define LC3_THREADED_DISPATCH __attribute__((optimize("no-crossjumping")))
+#else
+#define LC3_THREADED_DISPATCH
+#endif
+
+// Keeps rarely used paths, such as device access, out of the hot loops that would otherwise inline them.
+#if defined(__GNUC__) || defined(__clang__)
+#define LC3_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define LC3_NOINLINE __declspec(noinline)
+#else
+#define LC3_NOINLINE
+#endif
 
 namespace lc3
 {
@@ -20,22 +53,183 @@ namespace lc3
 
     using State = std::variant<Stopped, Running, Trapped>;
 
+    /// \brief The state of a VM packed into one word, which is what the core keeps and Run() returns, so that the
+    /// engines and the runner test an integer rather than a std::variant. It converts to a State for code that would
+    /// rather have that.
+    class Status
+    {
+    public:
+        /// \brief What the VM is doing, or why Run() returned. In the same order as the alternatives of State.
+        enum Reason : uint8_t
+        {
+            STOPPED = 0, // The VM has stopped, e.g., at a HALT.
+            RUNNING = 1, // The VM can carry on running, e.g., because Run() used up its ticks.
+            TRAPPED = 2  // The VM is waiting for the runner to fulfil a trap.
+        };
+
+        /// \brief Makes a status.
+        /// \param reason what the VM is doing.
+        /// \param trap the trap instruction if the VM is trapped, otherwise 0.
+        constexpr Status(Reason reason = RUNNING, uint16_t trap = 0) : word_{static_cast<uint32_t>(reason) << 16 | trap} {}
+
+        /// \brief Converts from a State.
+        explicit Status(const State& state)
+            : Status(static_cast<Reason>(state.index()),
+                     std::holds_alternative<Trapped>(state) ? static_cast<uint16_t>(std::get<Trapped>(state).trap) : 0)
+        {
+        }
+
+        /// \brief Converts to a State, for callers that use the variant.
+        operator State() const
+        {
+            switch (GetReason())
+            {
+            case STOPPED:
+                return Stopped();
+            case TRAPPED:
+                return Trapped{GetTrap()};
+            default:
+                return Running();
+            }
+        }
+
+        constexpr Reason GetReason() const { return static_cast<Reason>(word_ >> 16); }
+
+        /// \brief Returns the trap instruction. Only meaningful if the VM is trapped.
+        constexpr uint16_t GetTrap() const { return static_cast<uint16_t>(word_); }
+
+        constexpr bool IsRunning() const { return word_ == RUNNING << 16; }
+        constexpr bool IsStopped() const { return word_ == STOPPED << 16; }
+        constexpr bool IsTrapped() const { return GetReason() == TRAPPED; }
+
+    private:
+        uint32_t word_; // The reason in the high half, and the trap instruction in the low half.
+    };
+
+    /// \brief The VM's registers as seen from outside, e.g., by a debugger.
+    struct Registers
+    {
+        uint16_t reg[8]; // General registers.
+        uint16_t pc;     // Program counter.
+        uint16_t cond;   // Condition flags.
+    };
+
+    /// \brief Selects how Lc3Core::Run fetches and dispatches instructions.
+    enum class Engine
+    {
+        Switch,    // Decode each instruction as it is fetched and dispatch on its opcode.
+        Predecode, // Decode each address once into a micro-op and dispatch on the cached micro-op.
+        Threaded,  // Dispatch predecoded micro-ops through a handler table, checking ticks per basic block.
+        Jit        // Compile hot basic blocks to host code, interpreting the rest. Threaded if the host isn't supported.
+    };
+
+    /// \brief The compile-time configuration of an Lc3Core: each member selects something that would otherwise cost a
+    /// check at run time, or a field in every VM.
+    ///
+    /// A configuration derives from DefaultConfig and hides whichever members it changes, e.g.,
+    ///
+    ///   struct TracingConfig : lc3::DefaultConfig
+    ///   {
+    ///       static constexpr lc3::Engine engine = lc3::Engine::Predecode;
+    ///       using Profiler = lc3::Profiler;
+    ///   };
+    ///
+    /// Everything that a configuration leaves out is compiled out of the core, rather than switched off.
+    struct DefaultConfig
+    {
+        static constexpr Engine engine = Engine::Switch; // The execution engine used by Run.
+        using Profiler = NoProfiler;                     // Told about every instruction executed. See Lc3Profiler.h.
+        using Monitor = NoMemoryMonitor;                 // Told about every access to memory. See Lc3MemoryMonitor.h.
+        static constexpr uint16_t pcStart = 0x3000;      // Where Reset() starts execution.
+        static constexpr uint16_t ioBase = IO_BASE;      // The start of the I/O region, which ends with memory.
+    };
+
+    /// \brief The default configuration with the given engine.
+    template<Engine configEngine>
+    struct EngineConfig : DefaultConfig
+    {
+        static constexpr Engine engine = configEngine;
+    };
+
+    /// \brief For running many VMs flat out: hot code is compiled, and nothing watches what it does.
+    struct BatchConfig : DefaultConfig
+    {
+        static constexpr Engine engine = Engine::Jit;
+    };
+
+    /// \brief For VMs that spend much of their time waiting on a console: fast to start, as nothing is compiled.
+    struct InteractiveConfig : DefaultConfig
+    {
+        static constexpr Engine engine = Engine::Threaded;
+    };
+
+    /// \brief For finding out what a guest program does: every instruction is profiled and every access monitored, so
+    /// address ranges can be watched.
+    struct DebugConfig : DefaultConfig
+    {
+        static constexpr Engine engine = Engine::Predecode;
+        using Profiler = lc3::Profiler;
+        using Monitor = MemoryMonitor;
+    };
+
     /// \brief The core of an LC3 virtual machine.
     /// \tparam External a CRTP derived class that provides external access, such as memory and traps.
+    /// \tparam Config the core's compile-time configuration, e.g., its execution engine. See DefaultConfig.
     ///
     /// Use CRTP to supply the ReadMem, WriteMem and Trap methods in the derived class.
-    template<typename External>
+    ///
+    /// A TRAP normally makes Run() return with the VM trapped, so that the runner can fulfil it, e.g., once input has
+    /// arrived. The derived class can also supply TrapInline(instr), which is called first, to fulfil traps that don't
+    /// have to wait for anything without leaving Run(). It returns false to leave the trap to the runner as before.
+    ///
+    /// Device registers in the I/O region are mapped with MapDevice(), which routes accesses to those addresses to the
+    /// derived class's handlers. All other accesses, including every instruction fetch below the I/O region, go straight
+    /// to ReadMem and WriteMem, which should do nothing but access memory.
+    ///
+    /// With Engine::Predecode the core keeps a per-address table of decoded micro-ops that is filled lazily on first
+    /// execution and invalidated by WriteMem. A derived class that writes to its memory without going through WriteMem
+    /// must call InvalidateDecoded() afterwards.
+    ///
+    /// The predecoding engines fuse common pairs of instructions, such as a push or a pop through a stack pointer, into
+    /// superinstructions that they dispatch once. Engine::Predecode still retires exactly the number of ticks it is
+    /// given, running the first instruction of a pair on its own when there is only one tick left.
+    ///
+    /// Engine::Jit interprets basic blocks until they have been entered often enough to be worth compiling. Compiled
+    /// blocks exit back to the interpreter before a TRAP, after accessing the I/O region, and after writing to an
+    /// address that holds compiled code, which discards the code.
+    ///
+    /// With a profiler that is enabled, Engine::Threaded and Engine::Jit run the predecoded instructions one at a time
+    /// like Engine::Predecode, so that the profiler sees every instruction.
+    ///
+    /// The core can tell when the VM is spinning in a loop that polls devices which have nothing for it, e.g., a loop
+    /// that reads KBSR until a key arrives. Device handlers report such polls with NotePoll(), and anything that a
+    /// spinning VM couldn't keep repeating, such as a write to memory, with NoteActivity(). If the VM polls from exactly
+    /// the same registers as an earlier poll, with no activity in between, then nothing but a device can change what it
+    /// does next, and IsIdle() becomes true.
+    template<typename External, typename Config = DefaultConfig>
     class Lc3Core
     {
+    public:
+        static constexpr Engine engine = Config::engine;
+        using Profiler = typename Config::Profiler;
+        using Monitor = typename Config::Monitor;
+
     protected:
-        // VM state. Note that memory access is implemented externally.
-        const uint16_t PC_START = 0x3000;
+        static constexpr uint16_t PC_START = Config::pcStart;
+        static constexpr uint16_t IO_BASE = Config::ioBase;
+        static_assert(PC_START < IO_BASE, "execution must start below the I/O region");
 
-        State state_;
+        // VM state. Note that memory access is implemented externally.
+        Status status_;
 
         uint16_t reg_[8];       // General registers.
         uint16_t pc_{PC_START}; // Program counter.
-        uint16_t cond_{0};      // Condition flags.
+
+        // Condition flags are evaluated lazily from the last value written by a flag-setting instruction, so only BR
+        // and anything inspecting the flags from outside pays for working out N, Z and P.
+        uint32_t flags_{NO_FLAGS}; // The last flag-setting result, or NO_FLAGS.
+
+        uint64_t retired_{0}; // Instructions retired by Run() since the VM was created.
 
     public:
         Lc3Core() : reg_{0}
@@ -47,31 +241,308 @@ namespace lc3
         void Reset()
         {
             pc_ = PC_START;
-            cond_ = 0;
+            flags_ = NO_FLAGS;
             for (auto& reg : reg_)
             {
                 reg = 0;
             }
-            state_ = lc3::Running();
+            status_ = Status::RUNNING;
         }
 
-        State GetState() const { return state_; }
+        /// \brief Returns the state of the VM as a variant. GetStatus() is cheaper.
+        State GetState() const { return status_; }
+
+        /// \brief Returns the state of the VM.
+        Status GetStatus() const { return status_; }
+
+        /// \brief Returns the condition flags as a combination of N (4), Z (2) and P (1).
+        uint16_t GetCond() const { return CondOf(flags_); }
+
+        /// \brief Returns a copy of the VM's registers, including the condition flags.
+        Registers GetRegisters() const
+        {
+            Registers regs{};
+            for (int i = 0; i < 8; ++i)
+            {
+                regs.reg[i] = reg_[i];
+            }
+            regs.pc = pc_;
+            regs.cond = GetCond();
+            return regs;
+        }
+
+        /// \brief Sets the VM's registers, including the condition flags.
+        void SetRegisters(const Registers& regs)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                reg_[i] = regs.reg[i];
+            }
+            pc_ = regs.pc;
+            SetCond(regs.cond);
+        }
 
         /// \brief Runs the VM for the given number of ticks.
         /// \param ticks the number of ticks to run for. Runs forever if negative.
         ///
-        /// Ticks and instructions are currently synonymous.
-        State Run(int ticks = -1)
+        /// Ticks and instructions are currently synonymous. Engine::Threaded only checks ticks at the end of each basic
+        /// block, so it may overrun by up to the length of the block it was in when the ticks ran out.
+        Status Run(int ticks = -1)
+        {
+            if constexpr (observes && engine != Engine::Switch)
+            {
+                return RunPredecoded(ticks);
+            }
+            else if constexpr (engine == Engine::Jit)
+            {
+                if constexpr (Jit::supported)
+                {
+                    return RunJit(ticks);
+                }
+                else
+                {
+                    return RunThreaded(ticks);
+                }
+            }
+            else if constexpr (engine == Engine::Threaded)
+            {
+                return RunThreaded(ticks);
+            }
+            else if constexpr (engine == Engine::Predecode)
+            {
+                return RunPredecoded(ticks);
+            }
+            else
+            {
+                return RunSwitch(ticks);
+            }
+        }
+
+        /// \brief Returns the number of instructions that Run() has retired since the VM was created. Both halves of a
+        /// superinstruction count, as does a TRAP that the VM stops for. Engines keep their own count while they run
+        /// and add it in when Run() returns, so this costs nothing per instruction.
+        uint64_t Retired() const { return retired_; }
+
+        /// \brief Decodes a basic block ahead of time, e.g., one found by analysing the image, so that the first run
+        /// through it doesn't pay for decoding and fusing it. Does nothing for Engine::Switch, which never predecodes.
+        /// \param start the address of the first instruction of the block.
+        /// \param end the address after the last instruction of the block.
+        /// \param compile true to compile the block straight away for Engine::Jit, as it is expected to become hot.
+        void Prepare(const uint16_t start, const uint16_t end, const bool compile)
+        {
+            if constexpr (predecodes)
+            {
+                for (uint32_t address = start; address < end && address < IO_BASE; ++address)
+                {
+                    DecodeAt(static_cast<uint16_t>(address));
+                }
+            }
+            if constexpr (compiles)
+            {
+                if (compile && !jit_.Lookup(start))
+                {
+                    CompileBlock(start);
+                }
+            }
+        }
+
+        /// \brief Returns the profiler.
+        Profiler& GetProfiler() { return profiler_; }
+
+        /// \brief Returns the memory monitor.
+        Monitor& GetMonitor() { return monitor_; }
+
+        /// \brief Returns true if the VM has been found to be spinning, waiting for a device.
+        bool IsIdle() const { return idle_; }
+
+        /// \brief Forgets that the VM was spinning, e.g., because something that it was waiting for has happened.
+        void ClearIdle() { idle_ = false; }
+
+        /// \brief Handles a read from a device register.
+        using DeviceRead = uint16_t (External::*)(uint16_t address);
+
+        /// \brief Handles a write to a device register.
+        using DeviceWrite = void (External::*)(uint16_t address, uint16_t val);
+
+        /// \brief Maps a device register into the I/O region.
+        /// \param address the address of the register. Must be in the I/O region.
+        /// \param read handles reads from the register, or nullptr if reads go to memory.
+        /// \param write handles writes to the register, or nullptr if writes go to memory.
+        void MapDevice(uint16_t address, DeviceRead read, DeviceWrite write = nullptr)
+        {
+            uint8_t& slot = deviceSlots_[address - IO_BASE];
+            if (slot == 0)
+            {
+                slot = static_cast<uint8_t>(devices_.size());
+                devices_.push_back({});
+            }
+            devices_[slot] = {read, write};
+        }
+
+    protected:
+        /// \brief Stops the VM, e.g., when it executes a HALT trap.
+        void Stop()
+        {
+            status_ = Status::STOPPED;
+            profiler_.OnStop();
+            monitor_.OnStop();
+        }
+
+        /// \brief Called by a device handler when the VM polls the device and it has nothing to report, e.g., no key.
+        void NotePoll()
+        {
+            // Compiled code only writes the registers back when it exits, which it does straight after touching a
+            // device, so wait until then to look at them.
+            if constexpr (compiles)
+            {
+                pollPending_ = true;
+            }
+            else
+            {
+                CheckIdle();
+            }
+        }
+
+        /// \brief Called when the VM does something that it couldn't repeat forever without making progress.
+        void NoteActivity() { ++activity_; }
+
+        /// \brief Sets the condition flags.
+        /// \param cond N (4), Z (2), P (1), or 0 for none.
+        void SetCond(uint16_t cond)
+        {
+            switch (cond)
+            {
+            case static_cast<uint16_t>(Flags::NEG):
+                flags_ = 0x8000;
+                break;
+            case static_cast<uint16_t>(Flags::ZERO):
+                flags_ = 0;
+                break;
+            case static_cast<uint16_t>(Flags::POS):
+                flags_ = 1;
+                break;
+            default:
+                flags_ = NO_FLAGS;
+                break;
+            }
+        }
+
+        /// \brief Discards all predecoded instructions, e.g., after loading an image directly into memory.
+        void InvalidateDecoded()
+        {
+            // Nothing can have been compiled without first being decoded, so if nothing has been decoded then there's
+            // nothing to discard. This makes loading a fresh VM, e.g., from a snapshot, much cheaper.
+            if (decodedNothing_)
+            {
+                return;
+            }
+            if constexpr (predecodes)
+            {
+                decoded_.InvalidateAll();
+            }
+            if constexpr (engine == Engine::Jit)
+            {
+                jit_.Clear();
+            }
+            decodedNothing_ = true;
+        }
+
+    private:
+        enum class Flags
+        {
+            POS = 1 << 0,  // P
+            ZERO = 1 << 1, // Z
+            NEG = 1 << 2,  // N
+        };
+
+        // Handlers used by the threaded engine when computed goto isn't available. They return true at the end of a
+        // basic block.
+        using Handler = bool (Lc3Core::*)(const Decoded&);
+
+        static constexpr bool predecodes = engine != Engine::Switch;
+        // A profiler or a memory monitor has to see every instruction, and every access that it makes.
+        static constexpr bool observes = Profiler::enabled || Monitor::enabled;
+        static constexpr bool compiles = engine == Engine::Jit && Jit::supported && !observes;
+        static constexpr bool fuses = predecodes && !observes;
+
+        struct NoJit
+        {
+        };
+
+        DecodedTable decoded_;      // Predecoded instructions, indexed by address. Untouched unless predecoding.
+        Decoded uncached_{};        // The most recent instruction fetched from the I/O region.
+        bool decodedNothing_{true}; // True if nothing has been decoded since decoded_ was last invalidated.
+        std::conditional_t<engine == Engine::Jit, Jit, NoJit> jit_; // Compiled blocks, only used by Engine::Jit.
+        Profiler profiler_;                                         // Told about every instruction executed.
+        Monitor monitor_;                                           // Told about every access to memory.
+
+        struct Device
+        {
+            DeviceRead read;   // Handles reads, or nullptr.
+            DeviceWrite write; // Handles writes, or nullptr.
+        };
+
+        std::vector<Device> devices_{Device{}};                 // Mapped device registers. The first is unused.
+        std::array<uint8_t, 0x10000 - IO_BASE> deviceSlots_{}; // Index into devices_ by I/O address, or 0 if unmapped.
+
+        /// \brief What the VM looked like when it polled a device.
+        struct Poll
         {
-            while (std::holds_alternative<Running>(state_) && ticks != 0)
+            uint16_t reg[8];   // General registers.
+            uint16_t pc;       // Program counter.
+            uint32_t flags;    // Condition flags.
+            uint64_t activity; // The activity count.
+
+            bool operator==(const Poll& other) const
+            {
+                return std::equal(std::begin(reg), std::end(reg), std::begin(other.reg)) && pc == other.pc
+                       && flags == other.flags && activity == other.activity;
+            }
+        };
+
+        static constexpr size_t POLL_HISTORY = 4; // Enough for a loop that polls a few devices in turn.
+
+        std::array<Poll, POLL_HISTORY> polls_{}; // The most recent polls.
+        size_t pollCount_{0};                    // The number of polls recorded, up to POLL_HISTORY.
+        size_t nextPoll_{0};                     // Where the next poll is recorded.
+        uint64_t activity_{0};                   // Counts writes and other side effects.
+        bool pollPending_{false};                // True if compiled code polled a device and CheckIdle() hasn't run yet.
+        bool idle_{false};                       // True if the VM has been found to be spinning.
+
+        /// \brief Records a poll, and decides whether the VM is spinning.
+        void CheckIdle()
+        {
+            pollPending_ = false;
+            Poll poll{};
+            std::copy(std::begin(reg_), std::end(reg_), std::begin(poll.reg));
+            poll.pc = pc_;
+            poll.flags = flags_;
+            poll.activity = activity_;
+            if (std::find(polls_.begin(), polls_.begin() + pollCount_, poll) != polls_.begin() + pollCount_)
+            {
+                idle_ = true;
+                return;
+            }
+            polls_[nextPoll_] = poll;
+            nextPoll_ = (nextPoll_ + 1) % POLL_HISTORY;
+            pollCount_ = pollCount_ < POLL_HISTORY ? pollCount_ + 1 : POLL_HISTORY;
+        }
+
+        Status RunSwitch(int ticks)
+        {
+            uint64_t retired = 0;
+            while (status_.IsRunning() && ticks != 0)
             {
                 if (ticks > 0)
                 {
                     --ticks;
                 }
+                ++retired;
 
-                const uint16_t instr = ReadMem(pc_++);
+                const uint16_t instr = FetchMem(pc_++);
                 const uint16_t op = instr >> 12;
+                profiler_.OnInstruction(pc_ - 1, op);
+                monitor_.OnExecute(pc_ - 1, reg_[6]);
 
                 switch (op)
                 {
@@ -128,59 +599,560 @@ namespace lc3
                     break;
 
                 case OP_TRAP:
-                    state_ = Trapped{instr};
+                    EnterTrap(instr);
                     break;
 
                 case OP_RES:
                 case OP_RTI:
                 default:
-                    state_ = Stopped();
+                    Stop();
                     break;
                 }
             }
 
-            return state_;
+            retired_ += retired;
+            return status_;
         }
 
-    private:
-        enum class Flags
+        Status RunPredecoded(int ticks)
         {
-            POS = 1 << 0,  // P
-            ZERO = 1 << 1, // Z
-            NEG = 1 << 2,  // N
-        };
+            uint64_t retired = 0;
+            Decoded split;
+            while (status_.IsRunning() && ticks != 0)
+            {
+                const uint16_t pc = pc_;
+                const Decoded* d = &Fetch();
+                if (ticks > 0)
+                {
+                    ticks -= Retires(d->uop);
+                    if (ticks < 0)
+                    {
+                        // A superinstruction would overrun the budget, so run the first instruction of its pair alone.
+                        split = Decode(pc, FetchMem(pc));
+                        d = &split;
+                        ticks = 0;
+                    }
+                }
+                retired += Retires(d->uop);
+                profiler_.OnInstruction(pc, OPCODES[d->uop]);
+                monitor_.OnExecute(pc, reg_[6]);
+                Execute(*d);
+            }
 
-        enum Opcodes
-        {
-            OP_BR = 0, // Branch.
-            OP_ADD,    // Add.
-            OP_LD,     // Load.
-            OP_ST,     // Store.
-            OP_JSR,    // Jump to subroutine.
-            OP_AND,    // Bitwise and.
-            OP_LDR,    // Load register.
-            OP_STR,    // Store register.
-            OP_RTI,    // Return from interrupt (not currently implemented).
-            OP_NOT,    // Bitwise not.
-            OP_LDI,    // Load indirect.
-            OP_STI,    // Store indirect.
-            OP_JMP,    // Jump.
-            OP_RES,    // Reserved (unused).
-            OP_LEA,    // Load effective address.
-            OP_TRAP    // Invoke a trap.
-        };
+            retired_ += retired;
+            return status_;
+        }
+
+        /// \brief Executes a single micro-op.
+        /// \param d the decoded instruction.
+        /// \return true if the micro-op ends a basic block.
+        bool Execute(const Decoded& d)
+        {
+            switch (d.uop)
+            {
+            case UOP_ADD_REG:
+                UopAddReg(d);
+                return false;
+
+            case UOP_ADD_IMM:
+                UopAddImm(d);
+                return false;
+
+            case UOP_AND_REG:
+                UopAndReg(d);
+                return false;
+
+            case UOP_AND_IMM:
+                UopAndImm(d);
+                return false;
+
+            case UOP_NOT:
+                UopNot(d);
+                return false;
+
+            case UOP_BR:
+                UopBr(d);
+                return true;
+
+            case UOP_BRA:
+                UopBra(d);
+                return true;
+
+            case UOP_JMP:
+                UopJmp(d);
+                return true;
+
+            case UOP_JSR:
+                UopJsr(d);
+                return true;
+
+            case UOP_JSRR:
+                UopJsrr(d);
+                return true;
+
+            case UOP_LD:
+                UopLd(d);
+                return false;
+
+            case UOP_LDI:
+                UopLdi(d);
+                return false;
+
+            case UOP_LDR:
+                UopLdr(d);
+                return false;
+
+            case UOP_LEA:
+                UopLea(d);
+                return false;
+
+            case UOP_ST:
+                UopSt(d);
+                return false;
+
+            case UOP_STI:
+                UopSti(d);
+                return false;
+
+            case UOP_STR:
+                UopStr(d);
+                return false;
+
+            case UOP_TRAP:
+                UopTrap(d);
+                return true;
+
+            case UOP_CONST:
+                UopConst(d);
+                return false;
+
+            case UOP_PUSH:
+                UopPush(d);
+                return false;
+
+            case UOP_POP:
+                UopPop(d);
+                return false;
+
+            case UOP_ADD_IMM_BR:
+                UopAddImmBr(d);
+                return true;
+
+            case UOP_ADD_REG_BR:
+                UopAddRegBr(d);
+                return true;
+
+            case UOP_STOP:
+            default:
+                UopStop(d);
+                return true;
+            }
+        }
+
+        /// \brief Runs predecoded micro-ops with threaded dispatch, checking the tick budget once per basic block.
+        ///
+        /// Only control transfers end a block, so Run may retire a few more instructions than it was asked to.
+        LC3_THREADED_DISPATCH Status RunThreaded(int ticks)
+        {
+            if (!status_.IsRunning() || ticks == 0)
+            {
+                return status_;
+            }
+
+            // Running forever means a budget that can't be exhausted in practice.
+            const uint64_t budget = ticks > 0 ? static_cast<uint64_t>(ticks) : UINT64_MAX;
+            uint64_t retired = 0;
+
+#if defined(LC3_COMPUTED_GOTO)
+            // Every handler ends with its own indirect jump to the next handler, so the branch predictor sees one
+            // branch site per micro-op rather than the single shared site of a switch.
+            static const void* const handlers[] = {
+                    &&decode, &&add_reg, &&add_imm, &&and_reg, &&and_imm, &&op_not, &&br, &&bra, &&jmp, &&jsr,
+                    &&jsrr, &&ld, &&ldi, &&ldr, &&lea, &&st, &&sti, &&str, &&trap, &&stop, &&op_const, &&push, &&pop,
+                    &&add_imm_br, &&add_reg_br};
+            static_assert(sizeof(handlers) / sizeof(handlers[0]) == UOP_COUNT, "handler table does not match micro-ops");
+
+            const Decoded* d;
+
+#define LC3_NEXT()                  \
+    do                              \
+    {                               \
+        ++retired;                  \
+        d = &decoded_[pc_++];       \
+        goto* handlers[d->uop];     \
+    } while (false)
+#define LC3_END_BLOCK()             \
+    do                              \
+    {                               \
+        if (retired >= budget)      \
+        {                           \
+            goto done;              \
+        }                           \
+        LC3_NEXT();                 \
+    } while (false)
+
+            LC3_NEXT();
+
+        decode:
+            d = &DecodeAt(static_cast<uint16_t>(pc_ - 1));
+            goto* handlers[d->uop];
+        add_reg:
+            UopAddReg(*d);
+            LC3_NEXT();
+        add_imm:
+            UopAddImm(*d);
+            LC3_NEXT();
+        and_reg:
+            UopAndReg(*d);
+            LC3_NEXT();
+        and_imm:
+            UopAndImm(*d);
+            LC3_NEXT();
+        op_not:
+            UopNot(*d);
+            LC3_NEXT();
+        br:
+            UopBr(*d);
+            LC3_END_BLOCK();
+        bra:
+            UopBra(*d);
+            LC3_END_BLOCK();
+        jmp:
+            UopJmp(*d);
+            LC3_END_BLOCK();
+        jsr:
+            UopJsr(*d);
+            LC3_END_BLOCK();
+        jsrr:
+            UopJsrr(*d);
+            LC3_END_BLOCK();
+        ld:
+            UopLd(*d);
+            LC3_NEXT();
+        ldi:
+            UopLdi(*d);
+            LC3_NEXT();
+        ldr:
+            UopLdr(*d);
+            LC3_NEXT();
+        lea:
+            UopLea(*d);
+            LC3_NEXT();
+        st:
+            UopSt(*d);
+            LC3_NEXT();
+        sti:
+            UopSti(*d);
+            LC3_NEXT();
+        str:
+            UopStr(*d);
+            LC3_NEXT();
+        trap:
+            UopTrap(*d);
+            if (status_.IsRunning())
+            {
+                LC3_END_BLOCK();
+            }
+            goto done;
+        stop:
+            UopStop(*d);
+            goto done;
+        op_const:
+            ++retired;
+            UopConst(*d);
+            LC3_NEXT();
+        push:
+            ++retired;
+            UopPush(*d);
+            LC3_NEXT();
+        pop:
+            ++retired;
+            UopPop(*d);
+            LC3_NEXT();
+        add_imm_br:
+            ++retired;
+            UopAddImmBr(*d);
+            LC3_END_BLOCK();
+        add_reg_br:
+            ++retired;
+            UopAddRegBr(*d);
+            LC3_END_BLOCK();
+        done:
+#undef LC3_END_BLOCK
+#undef LC3_NEXT
+#else
+            // Without computed goto, call through a table of handlers that report whether they end a basic block.
+            static constexpr Handler handlers[] = {
+                    nullptr, // Fetch() never returns an undecoded instruction.
+                    &Lc3Core::Step<&Lc3Core::UopAddReg, false>,
+                    &Lc3Core::Step<&Lc3Core::UopAddImm, false>,
+                    &Lc3Core::Step<&Lc3Core::UopAndReg, false>,
+                    &Lc3Core::Step<&Lc3Core::UopAndImm, false>,
+                    &Lc3Core::Step<&Lc3Core::UopNot, false>,
+                    &Lc3Core::Step<&Lc3Core::UopBr, true>,
+                    &Lc3Core::Step<&Lc3Core::UopBra, true>,
+                    &Lc3Core::Step<&Lc3Core::UopJmp, true>,
+                    &Lc3Core::Step<&Lc3Core::UopJsr, true>,
+                    &Lc3Core::Step<&Lc3Core::UopJsrr, true>,
+                    &Lc3Core::Step<&Lc3Core::UopLd, false>,
+                    &Lc3Core::Step<&Lc3Core::UopLdi, false>,
+                    &Lc3Core::Step<&Lc3Core::UopLdr, false>,
+                    &Lc3Core::Step<&Lc3Core::UopLea, false>,
+                    &Lc3Core::Step<&Lc3Core::UopSt, false>,
+                    &Lc3Core::Step<&Lc3Core::UopSti, false>,
+                    &Lc3Core::Step<&Lc3Core::UopStr, false>,
+                    &Lc3Core::Step<&Lc3Core::UopTrap, true>,
+                    &Lc3Core::Step<&Lc3Core::UopStop, true>,
+                    &Lc3Core::Step<&Lc3Core::UopConst, false>,
+                    &Lc3Core::Step<&Lc3Core::UopPush, false>,
+                    &Lc3Core::Step<&Lc3Core::UopPop, false>,
+                    &Lc3Core::Step<&Lc3Core::UopAddImmBr, true>,
+                    &Lc3Core::Step<&Lc3Core::UopAddRegBr, true>};
+            static_assert(sizeof(handlers) / sizeof(handlers[0]) == UOP_COUNT, "handler table does not match micro-ops");
+
+            for (;;)
+            {
+                const Decoded& d = Fetch();
+                retired += Retires(d.uop);
+                if ((this->*handlers[d.uop])(d) && (retired >= budget || !status_.IsRunning()))
+                {
+                    break;
+                }
+            }
+#endif
+
+            retired_ += retired;
+            return status_;
+        }
+
+        /// \brief Runs compiled blocks where there are any, and interprets basic blocks until they become hot.
+        ///
+        /// Like Engine::Threaded, the tick budget is checked at the end of each basic block.
+        Status RunJit(int ticks)
+        {
+            if (!status_.IsRunning() || ticks == 0)
+            {
+                return status_;
+            }
+
+            // Leave some headroom because compiled blocks only check their 32-bit budget when they loop.
+            constexpr uint64_t maxBlockBudget = UINT32_MAX - 2 * Jit::MAX_BLOCK;
+            const uint64_t budget = ticks > 0 ? static_cast<uint64_t>(ticks) : UINT64_MAX;
+            uint64_t retired = 0;
+
+            while (retired < budget)
+            {
+                if (auto block = jit_.Lookup(pc_))
+                {
+                    const uint64_t left = budget - retired;
+                    retired += block(this, static_cast<uint32_t>(left < maxBlockBudget ? left : maxBlockBudget));
+                    if (pollPending_)
+                    {
+                        CheckIdle();
+                    }
+                    continue;
+                }
+
+                if (jit_.IsHot(pc_) && CompileBlock(pc_))
+                {
+                    continue;
+                }
+
+                // Interpret up to the end of the basic block.
+                bool endsBlock;
+                do
+                {
+                    const Decoded& d = Fetch();
+                    retired += Retires(d.uop);
+                    endsBlock = Execute(d);
+                } while (!endsBlock);
+                if (pollPending_)
+                {
+                    CheckIdle();
+                }
+
+                if (!status_.IsRunning())
+                {
+                    break;
+                }
+            }
+
+            retired_ += retired;
+            return status_;
+        }
+
+        /// \brief Compiles the basic block that starts at the given address.
+        /// \return true if the block was compiled.
+        bool CompileBlock(const uint16_t start)
+        {
+            // Blocks end after a control transfer, before a TRAP or RTI, or before reaching the I/O region.
+            Decoded code[Jit::MAX_BLOCK];
+            size_t count = 0;
+            for (uint32_t address = start; count < Jit::MAX_BLOCK && address < IO_BASE; ++address)
+            {
+                Decoded d = decoded_[address].uop != UOP_DECODE ? decoded_[address] : DecodeAt(address);
+                if (IsFused(d.uop))
+                {
+                    // The compiler works on single instructions, and gains nothing from fusing them.
+                    d = Decode(static_cast<uint16_t>(address), FetchMem(static_cast<uint16_t>(address)));
+                }
+                if (d.uop == UOP_TRAP || d.uop == UOP_STOP)
+                {
+                    break;
+                }
+                code[count++] = d;
+                if (EndsBlock(d.uop))
+                {
+                    break;
+                }
+            }
+
+            const auto base = reinterpret_cast<const char*>(this);
+            const Jit::Layout layout{reinterpret_cast<const char*>(&reg_[0]) - base,
+                                     reinterpret_cast<const char*>(&pc_) - base,
+                                     reinterpret_cast<const char*>(&flags_) - base,
+                                     &Lc3Core::JitReadMem,
+                                     &Lc3Core::JitWriteMem};
+            return jit_.Compile(start, code, count, layout) != nullptr;
+        }
+
+        /// \brief Called by compiled code to read from memory. Asks the block to exit if it read from the I/O region.
+        static uint32_t JitReadMem(void* core, uint32_t address)
+        {
+            auto& self = *static_cast<Lc3Core*>(core);
+            const uint32_t exit = address >= IO_BASE ? Jit::JIT_EXIT : 0;
+            return self.ReadMem(static_cast<uint16_t>(address)) | exit;
+        }
+
+        /// \brief Called by compiled code to write to memory. Asks the block to exit if it wrote to the I/O region or
+        /// overwrote compiled code.
+        static uint32_t JitWriteMem(void* core, uint32_t address, uint32_t val)
+        {
+            auto& self = *static_cast<Lc3Core*>(core);
+            const auto addr = static_cast<uint16_t>(address);
+            const bool exit = addr >= IO_BASE || self.jit_.Covers(addr);
+            self.WriteMem(addr, static_cast<uint16_t>(val));
+            return exit ? 1 : 0;
+        }
+
+        /// \brief Fetches the instruction at PC, decoding it if necessary, and advances PC.
+        /// \return the decoded instruction.
+        const Decoded& Fetch()
+        {
+            const uint16_t address = pc_++;
+            const Decoded& decoded = decoded_[address];
+            return decoded.uop != UOP_DECODE ? decoded : DecodeAt(address);
+        }
+
+        /// \brief Decodes the instruction at the given address into the predecode table.
+        /// \param address the address of the instruction.
+        /// \return the decoded instruction.
+        const Decoded& DecodeAt(const uint16_t address)
+        {
+            // Device registers can change underneath us, so instructions fetched from them are never cached.
+            Decoded& target = address < IO_BASE ? decoded_.Writable(address) : uncached_;
+            target = Decode(address, FetchMem(address));
+            if constexpr (fuses)
+            {
+                if (address + 1 < IO_BASE)
+                {
+                    Fuse(target, Decode(address + 1, FetchMem(address + 1)));
+                }
+            }
+            decodedNothing_ = false;
+            return target;
+        }
+
+        /// \brief Fuses an instruction with the one after it into a superinstruction if the pair is a common idiom.
+        /// \param first the first instruction, replaced by the superinstruction if there is one.
+        /// \param second the instruction at the next address.
+        static void Fuse(Decoded& first, const Decoded& second)
+        {
+            // Immediates are at most 5 bits, so the low byte of one is enough to sign-extend it back again.
+            const auto imm = static_cast<uint8_t>(first.imm);
+            switch (first.uop)
+            {
+            case UOP_AND_IMM:
+                // AND Rx, Ry, #0 then ADD Rx, Rx, #n loads a constant.
+                if (first.imm == 0 && second.uop == UOP_ADD_IMM && second.a == first.a && second.b == first.a)
+                {
+                    first = Decoded{UOP_CONST, first.a, 0, 0, second.imm};
+                }
+                break;
+
+            case UOP_ADD_IMM:
+                // ADD R6, R6, #-1 then STR Rx, R6, #0 pushes Rx.
+                if (first.a == first.b && second.uop == UOP_STR && second.b == first.a)
+                {
+                    first = Decoded{UOP_PUSH, second.a, first.a, imm, second.imm};
+                }
+                else if (second.uop == UOP_BR)
+                {
+                    first = Decoded{UOP_ADD_IMM_BR, static_cast<uint8_t>(first.a | second.a << 3), first.b, imm, second.imm};
+                }
+                break;
+
+            case UOP_ADD_REG:
+                if (second.uop == UOP_BR)
+                {
+                    first = Decoded{UOP_ADD_REG_BR, static_cast<uint8_t>(first.a | second.a << 3), first.b, first.c, second.imm};
+                }
+                break;
+
+            case UOP_LDR:
+                // LDR Rx, R6, #0 then ADD R6, R6, #1 pops into Rx.
+                if (second.uop == UOP_ADD_IMM && second.a == first.b && second.b == first.b)
+                {
+                    first = Decoded{UOP_POP, first.a, first.b, static_cast<uint8_t>(second.imm), first.imm};
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
 
         // Helpers to invoke "underlying" methods.
 
         /// \brief Casts to the underlying External type.
         External& AsExternal() { return static_cast<External&>(*this); }
 
-        /// \brief Reads from memory at the given address.
+        /// \brief Invoked on the external class to fulfil a trap without returning from Run(). The derived class hides
+        /// this with its own version to fulfil the traps that it can, without waiting, straight away.
+        /// \param instr the trap instruction.
+        /// \return true if the trap was fulfilled, false if Run() should return with the VM trapped.
+        bool TrapInline(uint16_t /*instr*/) { return false; }
+
+        /// \brief Executes a TRAP, fulfilling it straight away if the external class can, and otherwise leaving the VM
+        /// trapped so that Run() returns.
+        /// \param instr the trap instruction.
+        void EnterTrap(const uint16_t instr)
+        {
+            profiler_.OnTrap(pc_ - 1, instr & 0xff);
+            if (!AsExternal().TrapInline(instr))
+            {
+                status_ = Status(Status::TRAPPED, instr);
+            }
+        }
+
+        /// \brief Reads from memory at the given address for an instruction.
         /// \param address the address to read from.
         /// \return the word at the given address.
         uint16_t ReadMem(uint16_t address)
         {
-            return AsExternal().ReadMem(address);
+            const uint16_t val = FetchMem(address);
+            monitor_.OnRead(pc_ - 1, address, val);
+            return val;
+        }
+
+        /// \brief Reads from memory at the given address for fetching or decoding an instruction, which the memory
+        /// monitor doesn't count as a read.
+        /// \param address the address to read from.
+        /// \return the word at the given address.
+        uint16_t FetchMem(uint16_t address)
+        {
+            // Only the I/O region has to look for a device. Everything else, which is nearly everything, is memory.
+            return address < IO_BASE ? AsExternal().ReadMem(address) : ReadIo(address);
         }
 
         /// \brief Writes to memory at the given address.
@@ -188,50 +1160,72 @@ namespace lc3
         /// \param val the value to write to the addres.
         void WriteMem(uint16_t address, uint16_t val)
         {
-            AsExternal().WriteMem(address, val);
+            NoteActivity();
+            monitor_.OnWrite(pc_ - 1, address, val);
+            if constexpr (predecodes)
+            {
+                decoded_.Invalidate(address);
+            }
+            if constexpr (fuses)
+            {
+                // The instruction before may have been fused with this one.
+                const auto previous = static_cast<uint16_t>(address - 1);
+                if (IsFused(decoded_[previous].uop))
+                {
+                    decoded_.Invalidate(previous);
+                }
+            }
+            if constexpr (engine == Engine::Jit)
+            {
+                jit_.Invalidate(address);
+            }
+            if (address < IO_BASE)
+            {
+                AsExternal().WriteMem(address, val);
+            }
+            else
+            {
+                WriteIo(address, val);
+            }
         }
 
-        // Ancillary methods.
-
-        static uint16_t SignExtend(uint16_t x, int bitCount)
+        /// \brief Reads from the I/O region, from a device if one is mapped at the address and from memory if not.
+        LC3_NOINLINE uint16_t ReadIo(uint16_t address)
         {
-            if ((x >> (bitCount - 1)) & 1)
-            {
-                x |= (0xffff << bitCount);
-            }
-            return x;
+            const Device& device = devices_[deviceSlots_[address - IO_BASE]];
+            return device.read ? (AsExternal().*device.read)(address) : AsExternal().ReadMem(address);
         }
 
-        void UpdateFlags(uint16_t r)
+        /// \brief Writes to the I/O region, to a device if one is mapped at the address and to memory if not.
+        LC3_NOINLINE void WriteIo(uint16_t address, uint16_t val)
         {
-            if (reg_[r] == 0)
+            const Device& device = devices_[deviceSlots_[address - IO_BASE]];
+            if (device.write)
             {
-                cond_ = static_cast<uint16_t>(Flags::ZERO);
-            }
-            else if (reg_[r] >> 15)
-            {
-                cond_ = static_cast<uint16_t>(Flags::NEG);
+                (AsExternal().*device.write)(address, val);
             }
             else
             {
-                cond_ = static_cast<uint16_t>(Flags::POS);
+                AsExternal().WriteMem(address, val);
             }
         }
 
-        // Instruction decoding.
+        // Ancillary methods.
 
-        static bool IsImmediate(const uint16_t instr) { return (instr >> 5) & 0x1; }
-        static bool IsLong(const uint16_t instr) { return (instr >> 11) & 1; }
-        static uint16_t Cond(const uint16_t instr) { return (instr >> 9) & 0x7; }
-        static uint16_t Dr(const uint16_t instr) { return (instr >> 9) & 0x7; }
-        static uint16_t Sr1(const uint16_t instr) { return (instr >> 6) & 0x7; }
-        static uint16_t Sr2(const uint16_t instr) { return instr & 0x7; }
-        static uint16_t Sr(const uint16_t instr) { return (instr >> 9) & 0x7; }
-        static uint16_t BaseR(const uint16_t instr) { return (instr >> 6) & 0x7; }
-        static uint16_t Imm5(const uint16_t instr) { return SignExtend(instr & 0x1F, 5); }
-        static uint16_t Offset6(const uint16_t instr) { return SignExtend(instr & 0x3F, 6); }
-        static uint16_t PcOffset9(const uint16_t instr) { return SignExtend(instr & 0x1FF, 9); }
-        static uint16_t PcOffset11(const uint16_t instr) { return SignExtend(instr & 0x7FF, 11); }
+        void UpdateFlags(uint16_t r) { flags_ = reg_[r]; }
+
+        /// \brief Works out the condition flags from the last flag-setting result.
+        static uint16_t CondOf(const uint32_t flags)
+        {
+            if (flags == NO_FLAGS)
+            {
+                return 0;
+            }
+            const auto neg = static_cast<uint16_t>((flags >> 15) << 2);
+            const auto zero = static_cast<uint16_t>((flags == 0) << 1);
+            const auto pos = static_cast<uint16_t>(neg == 0 && zero == 0);
+            return neg | zero | pos;
+        }
 
         // Opcodes.
 
@@ -273,7 +1267,9 @@ namespace lc3
         {
             const uint16_t pcOffset9 = PcOffset9(instr);
             const uint16_t cond = Cond(instr);
-            if (cond == 0 || (cond & cond_))
+            const bool taken = cond == 0 || (cond & CondOf(flags_));
+            profiler_.OnBranch(pc_ - 1, taken);
+            if (taken)
             {
                 pc_ += pcOffset9;
             }
@@ -282,11 +1278,16 @@ namespace lc3
         void OpJmp(const uint16_t instr)
         {
             const uint16_t baser = BaseR(instr);
+            if (baser == 7)
+            {
+                profiler_.OnReturn(pc_ - 1); // RET.
+            }
             pc_ = reg_[baser];
         }
 
         void OpJsr(const uint16_t instr)
         {
+            const uint16_t from = pc_ - 1;
             reg_[7] = pc_;
             if (IsLong(instr))
             {
@@ -298,6 +1299,7 @@ namespace lc3
                 const uint16_t baser = BaseR(instr);
                 pc_ = reg_[baser]; // JSRR.
             }
+            profiler_.OnCall(from, pc_);
         }
 
         void OpLd(const uint16_t instr)
@@ -362,5 +1364,167 @@ namespace lc3
             const uint16_t offset6 = Offset6(instr);
             WriteMem(reg_[baser] + offset6, reg_[sr]);
         }
+
+        // Micro-ops.
+
+        void UopAddReg(const Decoded& d)
+        {
+            reg_[d.a] = reg_[d.b] + reg_[d.c];
+            UpdateFlags(d.a);
+        }
+
+        void UopAddImm(const Decoded& d)
+        {
+            reg_[d.a] = reg_[d.b] + d.imm;
+            UpdateFlags(d.a);
+        }
+
+        void UopAndReg(const Decoded& d)
+        {
+            reg_[d.a] = reg_[d.b] & reg_[d.c];
+            UpdateFlags(d.a);
+        }
+
+        void UopAndImm(const Decoded& d)
+        {
+            reg_[d.a] = reg_[d.b] & d.imm;
+            UpdateFlags(d.a);
+        }
+
+        void UopNot(const Decoded& d)
+        {
+            reg_[d.a] = ~reg_[d.b];
+            UpdateFlags(d.a);
+        }
+
+        void UopBr(const Decoded& d)
+        {
+            const bool taken = d.a & CondOf(flags_);
+            profiler_.OnBranch(pc_ - 1, taken);
+            if (taken)
+            {
+                pc_ = d.imm;
+            }
+        }
+
+        void UopBra(const Decoded& d)
+        {
+            profiler_.OnBranch(pc_ - 1, true);
+            pc_ = d.imm;
+        }
+
+        void UopJmp(const Decoded& d)
+        {
+            if (d.b == 7)
+            {
+                profiler_.OnReturn(pc_ - 1); // RET.
+            }
+            pc_ = reg_[d.b];
+        }
+
+        void UopJsr(const Decoded& d)
+        {
+            reg_[7] = pc_;
+            pc_ = d.imm;
+            profiler_.OnCall(reg_[7] - 1, pc_);
+        }
+
+        void UopJsrr(const Decoded& d)
+        {
+            reg_[7] = pc_;
+            pc_ = reg_[d.b];
+            profiler_.OnCall(reg_[7] - 1, pc_);
+        }
+
+        void UopLd(const Decoded& d)
+        {
+            reg_[d.a] = ReadMem(d.imm);
+            UpdateFlags(d.a);
+        }
+
+        void UopLdi(const Decoded& d)
+        {
+            reg_[d.a] = ReadMem(ReadMem(d.imm));
+            UpdateFlags(d.a);
+        }
+
+        void UopLdr(const Decoded& d)
+        {
+            reg_[d.a] = ReadMem(reg_[d.b] + d.imm);
+            UpdateFlags(d.a);
+        }
+
+        void UopLea(const Decoded& d)
+        {
+            reg_[d.a] = d.imm;
+            UpdateFlags(d.a);
+        }
+
+        void UopSt(const Decoded& d) { WriteMem(d.imm, reg_[d.a]); }
+
+        void UopSti(const Decoded& d) { WriteMem(ReadMem(d.imm), reg_[d.a]); }
+
+        void UopStr(const Decoded& d) { WriteMem(reg_[d.b] + d.imm, reg_[d.a]); }
+
+        void UopTrap(const Decoded& d) { EnterTrap(d.imm); }
+
+        void UopStop(const Decoded&) { Stop(); }
+
+        // Superinstructions. Each one steps PC over the second instruction of its pair at the point where running the
+        // pair one instruction at a time would have, so that device handlers see the same PC either way.
+
+        void UopConst(const Decoded& d)
+        {
+            reg_[d.a] = d.imm;
+            UpdateFlags(d.a);
+            ++pc_;
+        }
+
+        void UopPush(const Decoded& d)
+        {
+            reg_[d.b] += SignExtend(d.c, 8);
+            UpdateFlags(d.b);
+            ++pc_;
+            WriteMem(reg_[d.b] + d.imm, reg_[d.a]);
+        }
+
+        void UopPop(const Decoded& d)
+        {
+            reg_[d.a] = ReadMem(reg_[d.b] + d.imm);
+            ++pc_;
+            reg_[d.b] += SignExtend(d.c, 8);
+            UpdateFlags(d.b);
+        }
+
+        void UopAddImmBr(const Decoded& d)
+        {
+            const int dr = d.a & 7;
+            reg_[dr] = reg_[d.b] + SignExtend(d.c, 8);
+            UpdateFlags(dr);
+            ++pc_;
+            if ((d.a >> 3) & CondOf(flags_))
+            {
+                pc_ = d.imm;
+            }
+        }
+
+        void UopAddRegBr(const Decoded& d)
+        {
+            const int dr = d.a & 7;
+            reg_[dr] = reg_[d.b] + reg_[d.c];
+            UpdateFlags(dr);
+            ++pc_;
+            if ((d.a >> 3) & CondOf(flags_))
+            {
+                pc_ = d.imm;
+            }
+        }
+
+        template<void (Lc3Core::*op)(const Decoded&), bool endsBlock>
+        bool Step(const Decoded& d)
+        {
+            (this->*op)(d);
+            return endsBlock;
+        }
     };
 } // namespace lc3
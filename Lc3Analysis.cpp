@@ -0,0 +1,250 @@
+#include "Lc3Analysis.h"
+#include "Lc3Decode.h"
+#include "Lc3Image.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+namespace lc3
+{
+    namespace
+    {
+        enum : uint8_t
+        {
+            CODE = 1 << 0,   // Reachable, so holds an instruction.
+            LEADER = 1 << 1, // Starts a basic block.
+            TARGET = 1 << 2, // The target of a BR or JSR.
+            HOT = 1 << 3,    // Branched back to or called.
+            ENDS = 1 << 4,   // Ends a basic block.
+            TRAP = 1 << 5    // A TRAP instruction.
+        };
+
+        constexpr uint16_t TRAP_HALT = 0x25; // The VM stops at a HALT, so nothing after it is reached that way.
+
+        template<typename T>
+        bool Put(FILE* file, const std::vector<T>& items)
+        {
+            // An empty vector's data() may be null, which fwrite() mustn't be given even for no items.
+            if (items.empty())
+            {
+                return true;
+            }
+            return fwrite(items.data(), sizeof(T), items.size(), file) == items.size();
+        }
+
+        template<typename T>
+        bool Get(FILE* file, uint32_t count, std::vector<T>& items)
+        {
+            items.resize(count);
+            if (items.empty())
+            {
+                return true;
+            }
+            return fread(items.data(), sizeof(T), count, file) == count;
+        }
+    } // namespace
+
+    Analysis Analyse(const PagedMemory& mem, uint16_t entry)
+    {
+        // Follow each path from the entry point until it leaves the code that is already known about.
+        std::vector<uint8_t> flags(IO_BASE);
+        std::vector<uint16_t> pending;
+        const auto branchTo = [&](uint16_t target, uint8_t how) {
+            if (target < IO_BASE)
+            {
+                flags[target] |= LEADER | TARGET | how;
+                pending.push_back(target);
+            }
+        };
+        if (entry < IO_BASE)
+        {
+            flags[entry] |= LEADER;
+            pending.push_back(entry);
+        }
+        while (!pending.empty())
+        {
+            const uint16_t start = pending.back();
+            pending.pop_back();
+            bool fallsThrough = true;
+            for (uint32_t address = start; fallsThrough && address < IO_BASE && !(flags[address] & CODE); ++address)
+            {
+                const auto pc = static_cast<uint16_t>(address);
+                const uint16_t instr = mem.Read(pc);
+                if (instr == 0)
+                {
+                    // A path that runs into empty memory has run off the end of the program, e.g., past a loop that
+                    // never exits, and doesn't lead to any more code.
+                    break;
+                }
+                flags[address] |= CODE;
+                const Decoded d = Decode(pc, instr);
+                switch (d.uop)
+                {
+                case UOP_BR:
+                    // Once anything has set the flags, exactly one of N, Z and P is set, so BRnzp is as good as always
+                    // taken. Only a program that branches before it has computed anything could fall through one.
+                    branchTo(d.imm, d.imm <= pc ? HOT : 0);
+                    fallsThrough = d.a != 7;
+                    break;
+                case UOP_BRA:
+                    branchTo(d.imm, d.imm <= pc ? HOT : 0);
+                    fallsThrough = false;
+                    break;
+                case UOP_JSR:
+                    branchTo(d.imm, HOT);
+                    break;
+                case UOP_JMP:
+                case UOP_STOP:
+                    fallsThrough = false;
+                    break;
+                case UOP_TRAP:
+                    flags[address] |= TRAP;
+                    fallsThrough = (d.imm & 0xff) != TRAP_HALT;
+                    break;
+                default:
+                    break;
+                }
+                if (!EndsBlock(d.uop))
+                {
+                    continue;
+                }
+                flags[address] |= ENDS;
+                if (fallsThrough && address + 1 < IO_BASE)
+                {
+                    // Control comes back here after a call or a trap, or after a branch that isn't taken.
+                    flags[address + 1] |= LEADER;
+                }
+            }
+        }
+
+        // A block runs from a leader, or from the start of a stretch of code, to the next control transfer or the next
+        // block. Whatever lies between the stretches of code is data if it isn't just zeros.
+        Analysis analysis;
+        analysis.entry = entry;
+        for (uint32_t address = 0; address < IO_BASE;)
+        {
+            const auto start = static_cast<uint16_t>(address);
+            if (flags[address] & CODE)
+            {
+                for (bool ends = false; !ends;)
+                {
+                    if (flags[address] & TRAP)
+                    {
+                        analysis.traps.push_back(static_cast<uint16_t>(address));
+                    }
+                    ends = flags[address++] & ENDS || address == IO_BASE || (flags[address] & (CODE | LEADER)) != CODE;
+                }
+                analysis.blocks.push_back({start, static_cast<uint16_t>(address)});
+                if (flags[start] & TARGET)
+                {
+                    analysis.targets.push_back(start);
+                }
+                if (flags[start] & HOT)
+                {
+                    analysis.hot.push_back(start);
+                }
+                continue;
+            }
+
+            uint32_t first = IO_BASE;
+            uint32_t last = 0;
+            for (; address < IO_BASE && !(flags[address] & CODE); ++address)
+            {
+                if (mem.Read(static_cast<uint16_t>(address)) != 0)
+                {
+                    first = first == IO_BASE ? address : first;
+                    last = address;
+                }
+            }
+            if (first <= last)
+            {
+                analysis.data.push_back({static_cast<uint16_t>(first), static_cast<uint16_t>(last + 1)});
+            }
+        }
+        return analysis;
+    }
+
+    uint64_t AnalysisKey(const PagedMemory& mem, uint16_t entry)
+    {
+        std::vector<uint64_t> hashes{entry};
+        for (size_t page = 0; page < PagedMemory::PAGE_COUNT; ++page)
+        {
+            const auto& contents = mem.GetPage(page);
+            hashes.push_back(Fnv1a(contents.data(), contents.size() * sizeof(uint16_t)));
+        }
+        return Fnv1a(hashes.data(), hashes.size() * sizeof(uint64_t));
+    }
+
+    bool ReadAnalysis(const char* filename, uint64_t key, Analysis& analysis)
+    {
+        std::unique_ptr<FILE, int (*)(FILE*)> file{fopen(filename, "rb"), &fclose};
+        if (!file)
+        {
+            return false;
+        }
+
+        AnalysisHeader header;
+        if (fread(&header, sizeof(header), 1, file.get()) != 1 || header.magic != ANALYSIS_MAGIC
+            || header.version != ANALYSIS_VERSION || header.key != key)
+        {
+            return false;
+        }
+
+        // Counts can't be larger than the address space, so a damaged header can't make us allocate much.
+        constexpr uint32_t maxCount = 65536;
+        if (header.blockCount > maxCount || header.targetCount > maxCount || header.hotCount > maxCount
+            || header.trapCount > maxCount || header.dataCount > maxCount)
+        {
+            return false;
+        }
+        Analysis result;
+        result.entry = header.entry;
+        if (!Get(file.get(), header.blockCount, result.blocks) || !Get(file.get(), header.targetCount, result.targets)
+            || !Get(file.get(), header.hotCount, result.hot) || !Get(file.get(), header.trapCount, result.traps)
+            || !Get(file.get(), header.dataCount, result.data) || fgetc(file.get()) != EOF)
+        {
+            return false;
+        }
+        analysis = std::move(result);
+        return true;
+    }
+
+    bool WriteAnalysis(const Analysis& analysis, uint64_t key, const char* filename)
+    {
+        AnalysisHeader header{};
+        header.magic = ANALYSIS_MAGIC;
+        header.version = ANALYSIS_VERSION;
+        header.entry = analysis.entry;
+        header.key = key;
+        header.blockCount = static_cast<uint32_t>(analysis.blocks.size());
+        header.targetCount = static_cast<uint32_t>(analysis.targets.size());
+        header.hotCount = static_cast<uint32_t>(analysis.hot.size());
+        header.trapCount = static_cast<uint32_t>(analysis.traps.size());
+        header.dataCount = static_cast<uint32_t>(analysis.data.size());
+
+        FILE* file = fopen(filename, "wb");
+        if (!file)
+        {
+            return false;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && Put(file, analysis.blocks) && Put(file, analysis.targets) && Put(file, analysis.hot);
+        ok = ok && Put(file, analysis.traps) && Put(file, analysis.data);
+        ok = fclose(file) == 0 && ok;
+        return ok;
+    }
+
+    Analysis AnalyseImage(const char* imageFilename, const PagedMemory& mem, uint16_t entry)
+    {
+        const std::string filename = std::string(imageFilename) + ANALYSIS_EXTENSION;
+        const uint64_t key = AnalysisKey(mem, entry);
+        Analysis analysis;
+        if (!ReadAnalysis(filename.c_str(), key, analysis))
+        {
+            analysis = Analyse(mem, entry);
+            WriteAnalysis(analysis, key, filename.c_str());
+        }
+        return analysis;
+    }
+} // namespace lc3
@@ -0,0 +1,90 @@
+/// Static analysis of program images: where the basic blocks are, where branches and calls go, where the traps are and
+/// which words look like data rather than code.
+///
+/// The analysis follows control flow from the entry point, down both sides of every conditional branch and into every
+/// subroutine called with JSR. Jumps through registers, i.e., JMP, RET and JSRR, can't be followed, so code that is
+/// only ever reached through one is missed and may be taken for data. That is safe for what the analysis is for, which
+/// is decoding and compiling code before it first runs: anything that it misses is decoded when it runs, as before.
+///
+/// An analysis can be cached in a file next to the image that it came from. The file is an AnalysisHeader followed by
+/// the blocks, targets, hot blocks, trap sites and data ranges in that order, each block or range as two words. It is
+/// keyed by a hash of the memory that was analysed, so a stale cache is made again rather than used.
+
+#pragma once
+
+#include "Lc3Memory.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace lc3
+{
+    constexpr uint32_t ANALYSIS_MAGIC = 0x4133434C; // "LC3A" when written by a little-endian host.
+    constexpr uint16_t ANALYSIS_VERSION = 1;
+    constexpr const char* ANALYSIS_EXTENSION = ".blocks"; // Appended to an image's filename to name its cache.
+
+    /// \brief The header at the start of an analysis cache file. Everything is in host byte order, like an image cache.
+    struct AnalysisHeader
+    {
+        uint32_t magic;       // ANALYSIS_MAGIC.
+        uint16_t version;     // ANALYSIS_VERSION.
+        uint16_t entry;       // The address that the analysis started from.
+        uint64_t key;         // AnalysisKey() of the memory and entry point that were analysed.
+        uint32_t blockCount;  // The number of basic blocks.
+        uint32_t targetCount; // The number of branch and call targets.
+        uint32_t hotCount;    // The number of hot blocks.
+        uint32_t trapCount;   // The number of trap sites.
+        uint32_t dataCount;   // The number of data ranges.
+        uint32_t reserved;    // Zero.
+    };
+
+    /// \brief A range of addresses, from start up to but not including end.
+    struct AddressRange
+    {
+        uint16_t start;
+        uint16_t end;
+    };
+
+    /// \brief What was found by analysing an image. Everything is in ascending order of address.
+    struct Analysis
+    {
+        uint16_t entry{0};                // The address that the analysis started from.
+        std::vector<AddressRange> blocks; // The basic blocks that can be reached from the entry point.
+        std::vector<uint16_t> targets;    // The addresses that a BR or JSR can transfer control to.
+        std::vector<uint16_t> hot;        // Blocks that are branched back to or called, where time is likely spent.
+        std::vector<uint16_t> traps;      // The addresses of reachable TRAP instructions.
+        std::vector<AddressRange> data;   // Ranges of words that aren't reachable code but aren't all zero either.
+    };
+
+    /// \brief Analyses the code in memory that can be reached from an entry point.
+    /// \param mem the memory holding the image.
+    /// \param entry where the VM starts running, e.g., its PC after loading a snapshot.
+    /// \return the analysis.
+    Analysis Analyse(const PagedMemory& mem, uint16_t entry);
+
+    /// \brief Returns the hash that an analysis of the given memory and entry point is cached under.
+    uint64_t AnalysisKey(const PagedMemory& mem, uint16_t entry);
+
+    /// \brief Reads an analysis cache.
+    /// \param filename the name of the cache file.
+    /// \param key AnalysisKey() of what is being analysed.
+    /// \param analysis receives the analysis.
+    /// \return false if the file couldn't be read, isn't an analysis cache or was made from something else.
+    bool ReadAnalysis(const char* filename, uint64_t key, Analysis& analysis);
+
+    /// \brief Writes an analysis cache.
+    /// \param analysis the analysis.
+    /// \param key AnalysisKey() of what was analysed.
+    /// \param filename the name of the cache file.
+    /// \return true if the cache was written.
+    bool WriteAnalysis(const Analysis& analysis, uint64_t key, const char* filename);
+
+    /// \brief Analyses an image that was loaded from a file, reading the analysis from the cache next to the file if it
+    /// is up to date, and otherwise making it and writing the cache. A cache that can't be written, e.g., because the
+    /// image is in a read-only directory, is silently done without.
+    /// \param imageFilename the name of the file that the image was loaded from.
+    /// \param mem the memory holding the image.
+    /// \param entry where the VM starts running.
+    /// \return the analysis.
+    Analysis AnalyseImage(const char* imageFilename, const PagedMemory& mem, uint16_t entry);
+} // namespace lc3
@@ -0,0 +1,492 @@
+/// A batch of LC3 virtual machines that run side by side, as the lanes of one struct-of-arrays machine.
+
+#pragma once
+
+#include "LC3.h"
+#include "Lc3Decode.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lc3
+{
+    /// \brief Runs a batch of LC3 VMs in lockstep, with each register of every VM held side by side.
+    /// \tparam External a CRTP derived class that provides each lane's memory and traps.
+    /// \tparam laneCount the number of VMs in the batch.
+    ///
+    /// Use CRTP to supply ReadMem(lane, address), WriteMem(lane, address, val) and Trap(lane, instr) in the derived
+    /// class. Trap fulfils the trap there and then, getting at the lane's registers with Reg(), and returns false if
+    /// the lane should stop, e.g., for HALT. There are no device registers, so every access goes to the derived class.
+    ///
+    /// Each step executes the instruction at the lowest PC of the lanes that can run, for every lane at that PC. While
+    /// the lanes' PCs agree that is all of them, and each register operation is a loop over the lanes that the compiler
+    /// turns into vector instructions for whatever the target supports, e.g., AVX2 or NEON. The lanes at the lowest PC
+    /// run as a group, only looking for the lowest PC again when they go different ways. When the lanes diverge, on a
+    /// branch that depends on a lane's own data for example, the lanes that are behind run on their own until they
+    /// catch up, which for most branches is where the paths join again.
+    ///
+    /// Instructions are decoded once into a table shared by every lane, but only where every lane holds the same
+    /// instruction, and writes discard them as they do in Lc3Core. A derived class that writes to a lane's memory
+    /// without going through WriteMem must call InvalidateDecoded() afterwards.
+    template<typename External, size_t laneCount = 16>
+    class Lc3Batch
+    {
+    public:
+        static constexpr size_t LANES = laneCount;
+
+        Lc3Batch() : decoded_(MEMORY_SIZE) { Reset(); }
+
+        /// \brief Performs a warm reset of every lane. See Lc3Core::Reset().
+        void Reset()
+        {
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                Reset(lane);
+            }
+        }
+
+        /// \brief Performs a warm reset of one lane.
+        void Reset(size_t lane)
+        {
+            for (auto& reg : reg_)
+            {
+                reg[lane] = 0;
+            }
+            pc_[lane] = PC_START;
+            cond_[lane] = 0;
+            running_[lane] = ALL;
+        }
+
+        State GetState(size_t lane) const { return running_[lane] ? State{Running()} : State{Stopped()}; }
+
+        /// \brief Returns a copy of a lane's registers, including the condition flags.
+        Registers GetRegisters(size_t lane) const
+        {
+            Registers regs{};
+            for (int i = 0; i < 8; ++i)
+            {
+                regs.reg[i] = reg_[i][lane];
+            }
+            regs.pc = pc_[lane];
+            regs.cond = cond_[lane];
+            return regs;
+        }
+
+        /// \brief Sets a lane's registers, including the condition flags.
+        void SetRegisters(size_t lane, const Registers& regs)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                reg_[i][lane] = regs.reg[i];
+            }
+            pc_[lane] = regs.pc;
+            cond_[lane] = regs.cond;
+        }
+
+        /// \brief Runs every lane for the given number of ticks, or until it stops.
+        /// \param ticks the number of ticks that each lane runs for. Runs until every lane stops if negative.
+        /// \return the number of lanes that haven't stopped.
+        size_t Run(int ticks = -1)
+        {
+            if (ticks >= 0)
+            {
+                return RunSlice(static_cast<uint32_t>(ticks));
+            }
+
+            // A lane that spins forever at a low address would keep the others waiting forever, so run in slices that
+            // give every lane its turn.
+            constexpr uint32_t slice = 65536;
+            while (RunSlice(slice) != 0)
+            {
+            }
+            return 0;
+        }
+
+    protected:
+        /// \brief Returns one of a lane's general registers.
+        uint16_t& Reg(size_t lane, int r) { return reg_[r][lane]; }
+
+        /// \brief Discards all decoded instructions, e.g., after loading an image directly into a lane's memory.
+        void InvalidateDecoded()
+        {
+            for (auto& decoded : decoded_)
+            {
+                decoded.uop = UOP_DECODE;
+            }
+        }
+
+    private:
+        static constexpr uint32_t MEMORY_SIZE = 65536;
+        static constexpr uint16_t PC_START = 0x3000;
+        static constexpr uint16_t ALL = 0xffff; // A mask that selects a lane.
+
+        // Each row holds one register for every lane, so an operation on a register is a loop along its row.
+        alignas(64) uint16_t reg_[8][LANES];
+        alignas(64) uint16_t pc_[LANES];
+        alignas(64) uint16_t cond_[LANES];    // N (4), Z (2) or P (1), or 0 before the first flag-setting result.
+        alignas(64) uint16_t running_[LANES]; // ALL for each lane that hasn't stopped.
+
+        std::vector<Decoded> decoded_; // Instructions that every lane holds, indexed by address.
+        Decoded uncached_{};           // An instruction that not every lane holds.
+
+        /// \brief Runs every lane for up to the given number of ticks.
+        size_t RunSlice(const uint32_t ticks)
+        {
+            alignas(64) uint32_t left[LANES]; // Ticks left for each lane.
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                left[lane] = ticks;
+            }
+
+            for (;;)
+            {
+                // Find the lowest PC of the lanes that can run. Lanes that are ahead wait for the others to catch up.
+                alignas(64) uint32_t key[LANES]; // A lane's PC, or MEMORY_SIZE if it can't run.
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    key[lane] = (running_[lane] != 0) & (left[lane] != 0) ? pc_[lane] : MEMORY_SIZE;
+                }
+                uint32_t lowest = MEMORY_SIZE;
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    lowest = key[lane] < lowest ? key[lane] : lowest;
+                }
+                if (lowest == MEMORY_SIZE)
+                {
+                    break;
+                }
+
+                // The lanes at the lowest PC run together as a group, for as long as none of them runs out of ticks
+                // and the group doesn't catch up with a lane that is waiting.
+                alignas(64) uint16_t mask[LANES]; // ALL for each lane in the group.
+                uint32_t budget = ticks;          // The fewest ticks that any lane in the group has left.
+                uint32_t waiting = MEMORY_SIZE;   // The lowest PC of the lanes that are waiting.
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    const bool inGroup = key[lane] == lowest;
+                    mask[lane] = inGroup ? ALL : 0;
+                    budget = inGroup && left[lane] < budget ? left[lane] : budget;
+                    waiting = !inGroup && key[lane] < waiting ? key[lane] : waiting;
+                }
+
+                const uint32_t steps = RunGroup(static_cast<uint16_t>(lowest), mask, budget, waiting);
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    left[lane] -= mask[lane] ? steps : 0;
+                }
+            }
+
+            size_t running = 0;
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                running += running_[lane] & 1;
+            }
+            return running;
+        }
+
+        /// \brief Runs a group of lanes that are at the same PC until they need to be scheduled again.
+        /// \param pc the lanes' PC.
+        /// \param mask the lanes in the group. Lanes that drop out of the group part way are removed from it.
+        /// \param budget the most steps to run for.
+        /// \param waiting the lowest PC of the lanes that aren't in the group.
+        /// \return the number of steps that the lanes left in the group ran for.
+        uint32_t RunGroup(uint16_t pc, uint16_t (&mask)[LANES], const uint32_t budget, const uint32_t waiting)
+        {
+            // Only the first step can split the group, if not every lane holds its instruction, so that every lane
+            // left in the group runs every step.
+            Decoded d = Fetch(pc, mask);
+            uint32_t steps = 0;
+            for (;;)
+            {
+                Execute(d, static_cast<uint16_t>(pc + 1), mask);
+                ++steps;
+                if (EndsBlock(d.uop))
+                {
+                    // Carry on as long as every lane that is still running went the same way.
+                    for (size_t lane = 0; lane < LANES; ++lane)
+                    {
+                        mask[lane] &= running_[lane];
+                    }
+                    if (!SamePc(mask, pc))
+                    {
+                        break;
+                    }
+                }
+                else
+                {
+                    ++pc;
+                }
+                if (steps == budget || pc >= waiting)
+                {
+                    break;
+                }
+
+                // An instruction that hasn't been decoded goes back through Fetch.
+                d = decoded_[pc];
+                if (d.uop == UOP_DECODE)
+                {
+                    break;
+                }
+            }
+            return steps;
+        }
+
+        /// \brief Finds whether the lanes in the mask are all at the same PC.
+        /// \param mask the lanes to check.
+        /// \param pc receives the lanes' PC.
+        /// \return true if there is at least one lane in the mask and they are all at the same PC.
+        bool SamePc(const uint16_t (&mask)[LANES], uint16_t& pc) const
+        {
+            size_t first = 0;
+            while (first < LANES && !mask[first])
+            {
+                ++first;
+            }
+            if (first == LANES)
+            {
+                return false;
+            }
+            pc = pc_[first];
+            uint16_t differ = 0;
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                differ |= (pc_[lane] ^ pc) & mask[lane];
+            }
+            return differ == 0;
+        }
+
+        /// \brief Fetches the instruction at the given address for the lanes in the mask.
+        /// \param pc the address of the instruction.
+        /// \param mask the lanes at that address. Lanes that hold a different instruction from the first are dropped,
+        /// and run their own instruction on a later step.
+        /// \return the decoded instruction.
+        const Decoded& Fetch(const uint16_t pc, uint16_t (&mask)[LANES])
+        {
+            Decoded& decoded = decoded_[pc];
+            if (decoded.uop != UOP_DECODE)
+            {
+                return decoded;
+            }
+
+            size_t first = 0;
+            while (!mask[first])
+            {
+                ++first;
+            }
+            const uint16_t instr = AsExternal().ReadMem(first, pc);
+            bool shared = true;
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                if (AsExternal().ReadMem(lane, pc) != instr)
+                {
+                    shared = false;
+                    mask[lane] = 0;
+                }
+            }
+
+            // Only cache instructions that every lane holds. Like Lc3Core, never cache anything from the I/O region.
+            Decoded& target = shared && pc < IO_BASE ? decoded : uncached_;
+            target = Decode(pc, instr);
+            return target;
+        }
+
+        /// \brief Executes a micro-op for the lanes in the mask.
+        /// \param d the decoded instruction. It is passed by value so that the compiler knows that writes to the
+        /// registers don't change it, which would otherwise stop it vectorizing the loops over the lanes.
+        /// \param next the address of the next instruction.
+        /// \param mask the lanes to execute it for.
+        ///
+        /// This is kept out of line: inlined into the scheduling loops, along with the derived class's memory and
+        /// traps, it leaves the compiler too little room to keep the lane loops in vector registers.
+        LC3_NOINLINE void Execute(const Decoded d, const uint16_t next, const uint16_t (&mask)[LANES])
+        {
+            switch (d.uop)
+            {
+            case UOP_ADD_REG:
+                Alu(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(reg_[d.b][lane] + reg_[d.c][lane]); });
+                Advance(next, mask);
+                break;
+
+            case UOP_ADD_IMM:
+                Alu(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(reg_[d.b][lane] + d.imm); });
+                Advance(next, mask);
+                break;
+
+            case UOP_AND_REG:
+                Alu(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(reg_[d.b][lane] & reg_[d.c][lane]); });
+                Advance(next, mask);
+                break;
+
+            case UOP_AND_IMM:
+                Alu(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(reg_[d.b][lane] & d.imm); });
+                Advance(next, mask);
+                break;
+
+            case UOP_NOT:
+                Alu(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(~reg_[d.b][lane]); });
+                Advance(next, mask);
+                break;
+
+            case UOP_LEA:
+                Alu(d.a, mask, [&](size_t) { return d.imm; });
+                Advance(next, mask);
+                break;
+
+            case UOP_BR:
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    const uint16_t target = (cond_[lane] & d.a) ? d.imm : next;
+                    pc_[lane] = Blend(mask[lane], target, pc_[lane]);
+                }
+                break;
+
+            case UOP_BRA:
+                Advance(d.imm, mask);
+                break;
+
+            case UOP_JMP:
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    pc_[lane] = Blend(mask[lane], reg_[d.b][lane], pc_[lane]);
+                }
+                break;
+
+            case UOP_JSR:
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    reg_[7][lane] = Blend(mask[lane], next, reg_[7][lane]);
+                }
+                Advance(d.imm, mask);
+                break;
+
+            case UOP_JSRR:
+                // R7 is written first, as in Lc3Core, so JSRR R7 jumps to the return address.
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    reg_[7][lane] = Blend(mask[lane], next, reg_[7][lane]);
+                    pc_[lane] = Blend(mask[lane], reg_[d.b][lane], pc_[lane]);
+                }
+                break;
+
+            case UOP_LD:
+                Load(d.a, mask, [&](size_t) { return d.imm; });
+                Advance(next, mask);
+                break;
+
+            case UOP_LDI:
+                Load(d.a, mask, [&](size_t lane) { return AsExternal().ReadMem(lane, d.imm); });
+                Advance(next, mask);
+                break;
+
+            case UOP_LDR:
+                Load(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(reg_[d.b][lane] + d.imm); });
+                Advance(next, mask);
+                break;
+
+            case UOP_ST:
+                Store(d.a, mask, [&](size_t) { return d.imm; });
+                Advance(next, mask);
+                break;
+
+            case UOP_STI:
+                Store(d.a, mask, [&](size_t lane) { return AsExternal().ReadMem(lane, d.imm); });
+                Advance(next, mask);
+                break;
+
+            case UOP_STR:
+                Store(d.a, mask, [&](size_t lane) { return static_cast<uint16_t>(reg_[d.b][lane] + d.imm); });
+                Advance(next, mask);
+                break;
+
+            case UOP_TRAP:
+            {
+                Advance(next, mask);
+                const uint16_t instr = d.imm;
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    if (mask[lane] && !AsExternal().Trap(lane, instr))
+                    {
+                        running_[lane] = 0;
+                    }
+                }
+                break;
+            }
+
+            case UOP_STOP:
+            default:
+                Advance(next, mask);
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    running_[lane] &= ~mask[lane];
+                }
+                break;
+            }
+        }
+
+        /// \brief Selects a if the mask is set and b if it isn't.
+        static uint16_t Blend(const uint16_t mask, const uint16_t a, const uint16_t b) { return (a & mask) | (b & ~mask); }
+
+        /// \brief Returns the condition flags for a result.
+        static uint16_t CondOf(const uint16_t val) { return val == 0 ? 2 : (val & 0x8000) ? 4 : 1; }
+
+        /// \brief Sets PC for the lanes in the mask.
+        void Advance(const uint16_t pc, const uint16_t (&mask)[LANES])
+        {
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                pc_[lane] = Blend(mask[lane], pc, pc_[lane]);
+            }
+        }
+
+        /// \brief Writes a result to a register, and sets the condition flags from it, for the lanes in the mask.
+        template<typename Result>
+        void Alu(const uint8_t dr, const uint16_t (&mask)[LANES], Result result)
+        {
+            // The results are worked out first, as the destination may also be a source.
+            alignas(64) uint16_t val[LANES];
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                val[lane] = result(lane);
+            }
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                reg_[dr][lane] = Blend(mask[lane], val[lane], reg_[dr][lane]);
+                cond_[lane] = Blend(mask[lane], CondOf(val[lane]), cond_[lane]);
+            }
+        }
+
+        /// \brief Loads a register from memory, and sets the condition flags from it, for the lanes in the mask.
+        template<typename Address>
+        void Load(const uint8_t dr, const uint16_t (&mask)[LANES], Address address)
+        {
+            // Each lane has its own memory, so loads and stores are one lane at a time.
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                if (mask[lane])
+                {
+                    const uint16_t val = AsExternal().ReadMem(lane, address(lane));
+                    reg_[dr][lane] = val;
+                    cond_[lane] = CondOf(val);
+                }
+            }
+        }
+
+        /// \brief Stores a register to memory for the lanes in the mask.
+        template<typename Address>
+        void Store(const uint8_t sr, const uint16_t (&mask)[LANES], Address address)
+        {
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                if (mask[lane])
+                {
+                    const uint16_t addr = address(lane);
+                    decoded_[addr].uop = UOP_DECODE;
+                    AsExternal().WriteMem(lane, addr, reg_[sr][lane]);
+                }
+            }
+        }
+
+        External& AsExternal() { return static_cast<External&>(*this); }
+    };
+} // namespace lc3
@@ -0,0 +1,687 @@
+/// lc3bench - measures the LC3 execution engines and the multi-VM scheduler.
+///
+/// Every benchmark is a small LC3 program, assembled here when the benchmark starts. The programs end with RTI,
+/// which stops the VM without any output, so the only cost being measured is the VM's.
+
+#include "LC3.h"
+#include "Lc3Batch.h"
+#include "Lc3Memory.h"
+#include "Scheduler.h"
+#include "VmPool.h"
+#include "VmState.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    FILE* report = stdout; // Where the human-readable report goes.
+
+    /// \brief Assembles LC3 instructions into an image, with labels for branch and load targets.
+    class Assembler
+    {
+    public:
+        using Label = size_t;
+
+        explicit Assembler(uint16_t origin = 0x3000) : origin_{origin} {}
+
+        /// \brief Creates a label that is placed later with Bind().
+        Label NewLabel()
+        {
+            labels_.push_back(UNBOUND);
+            return labels_.size() - 1;
+        }
+
+        /// \brief Places the given label at the current address.
+        void Bind(Label label) { labels_[label] = static_cast<uint16_t>(origin_ + code_.size()); }
+
+        void Add(int dr, int sr1, int sr2) { Emit(0x1000 | dr << 9 | sr1 << 6 | sr2); }
+        void AddI(int dr, int sr1, int imm5) { Emit(0x1000 | dr << 9 | sr1 << 6 | 0x20 | (imm5 & 0x1f)); }
+        void And(int dr, int sr1, int sr2) { Emit(0x5000 | dr << 9 | sr1 << 6 | sr2); }
+        void AndI(int dr, int sr1, int imm5) { Emit(0x5000 | dr << 9 | sr1 << 6 | 0x20 | (imm5 & 0x1f)); }
+        void Not(int dr, int sr) { Emit(0x903f | dr << 9 | sr << 6); }
+        void Ldr(int dr, int base, int offset6) { Emit(0x6000 | dr << 9 | base << 6 | (offset6 & 0x3f)); }
+        void Str(int sr, int base, int offset6) { Emit(0x7000 | sr << 9 | base << 6 | (offset6 & 0x3f)); }
+        void Ld(int dr, Label label) { EmitPcRelative(0x2000 | dr << 9, label); }
+        void St(int sr, Label label) { EmitPcRelative(0x3000 | sr << 9, label); }
+        void Lea(int dr, Label label) { EmitPcRelative(0xe000 | dr << 9, label); }
+        void Jsr(Label label) { EmitPcRelative(0x4800, label, 0x7ff); }
+        void Ret() { Emit(0xc1c0); }
+        void Trap(int vector) { Emit(0xf000 | vector); }
+        void Rti() { Emit(0x8000); }
+        void Word(uint16_t word) { Emit(word); }
+
+        /// \brief Branches to the label if any of the given condition flags are set.
+        /// \param nzp the condition flags, N (4), Z (2) and P (1).
+        void Br(int nzp, Label label) { EmitPcRelative(0x0000 | nzp << 9, label); }
+
+        /// \brief Resolves all labels and returns the assembled program as VM memory.
+        lc3::PagedMemory Image()
+        {
+            for (const auto& fixup : fixups_)
+            {
+                const uint16_t pc = static_cast<uint16_t>(origin_ + fixup.index + 1);
+                const uint16_t offset = static_cast<uint16_t>(labels_[fixup.label] - pc) & fixup.mask;
+                code_[fixup.index] |= offset;
+            }
+            lc3::PagedMemory mem;
+            for (size_t i = 0; i < code_.size(); ++i)
+            {
+                mem.Write(static_cast<uint16_t>(origin_ + i), code_[i]);
+            }
+            return mem;
+        }
+
+    private:
+        static constexpr uint16_t UNBOUND = 0;
+
+        struct Fixup
+        {
+            size_t index;  // The instruction to patch.
+            Label label;   // The label that it refers to.
+            uint16_t mask; // The bits of the instruction that hold the offset.
+        };
+
+        void Emit(int word) { code_.push_back(static_cast<uint16_t>(word)); }
+
+        void EmitPcRelative(int word, Label label, uint16_t mask = 0x1ff)
+        {
+            fixups_.push_back({code_.size(), label, mask});
+            Emit(word);
+        }
+
+        uint16_t origin_;
+        std::vector<uint16_t> code_;
+        std::vector<uint16_t> labels_;
+        std::vector<Fixup> fixups_;
+    };
+
+    // Integer arithmetic: 6 instructions per iteration, 64K iterations per outer loop.
+    lc3::PagedMemory Arithmetic(uint16_t outer)
+    {
+        Assembler as;
+        auto count = as.NewLabel();
+        auto outerLoop = as.NewLabel();
+        auto innerLoop = as.NewLabel();
+        as.Ld(6, count);
+        as.Bind(outerLoop);
+        as.AndI(5, 5, 0);
+        as.Bind(innerLoop);
+        as.Add(0, 0, 1);
+        as.AndI(2, 0, 7);
+        as.Not(3, 2);
+        as.AddI(1, 3, 5);
+        as.AddI(5, 5, -1);
+        as.Br(5, innerLoop);
+        as.AddI(6, 6, -1);
+        as.Br(1, outerLoop);
+        as.Rti();
+        as.Bind(count);
+        as.Word(outer);
+        return as.Image();
+    }
+
+    // A read-modify-write stream over a 4K word array with LDR and STR.
+    lc3::PagedMemory Memory(uint16_t outer)
+    {
+        Assembler as;
+        auto count = as.NewLabel();
+        auto base = as.NewLabel();
+        auto length = as.NewLabel();
+        auto outerLoop = as.NewLabel();
+        auto innerLoop = as.NewLabel();
+        as.Ld(6, count);
+        as.Bind(outerLoop);
+        as.Ld(1, base);
+        as.Ld(5, length);
+        as.Bind(innerLoop);
+        as.Ldr(2, 1, 0);
+        as.AddI(2, 2, 1);
+        as.Str(2, 1, 0);
+        as.Ldr(3, 1, 1);
+        as.AddI(1, 1, 1);
+        as.AddI(5, 5, -1);
+        as.Br(1, innerLoop);
+        as.AddI(6, 6, -1);
+        as.Br(1, outerLoop);
+        as.Rti();
+        as.Bind(count);
+        as.Word(outer);
+        as.Bind(base);
+        as.Word(0x4000);
+        as.Bind(length);
+        as.Word(0x1000);
+        return as.Image();
+    }
+
+    // Data-dependent branches on the bits of a linear congruential generator, x = 5x + 1.
+    lc3::PagedMemory Branchy(uint16_t outer)
+    {
+        Assembler as;
+        auto count = as.NewLabel();
+        auto mask = as.NewLabel();
+        auto outerLoop = as.NewLabel();
+        auto innerLoop = as.NewLabel();
+        auto skipA = as.NewLabel();
+        auto skipB = as.NewLabel();
+        as.Ld(4, mask);
+        as.Ld(6, count);
+        as.Bind(outerLoop);
+        as.AndI(5, 5, 0);
+        as.Bind(innerLoop);
+        as.Add(1, 0, 0);
+        as.Add(1, 1, 1);
+        as.Add(0, 1, 0);
+        as.AddI(0, 0, 1);
+        as.And(2, 0, 4);
+        as.Br(2, skipA);
+        as.AddI(3, 3, 1);
+        as.Bind(skipA);
+        as.AddI(0, 0, 0);
+        as.Br(4, skipB);
+        as.AddI(7, 7, 1);
+        as.Bind(skipB);
+        as.AddI(5, 5, -1);
+        as.Br(5, innerLoop);
+        as.AddI(6, 6, -1);
+        as.Br(1, outerLoop);
+        as.Rti();
+        as.Bind(count);
+        as.Word(outer);
+        as.Bind(mask);
+        as.Word(0x2000);
+        return as.Image();
+    }
+
+    // Calls to a subroutine that saves and restores registers on a stack, like compiled C: 16 instructions per call.
+    lc3::PagedMemory Stack(uint16_t outer)
+    {
+        Assembler as;
+        auto count = as.NewLabel();
+        auto stackTop = as.NewLabel();
+        auto outerLoop = as.NewLabel();
+        auto innerLoop = as.NewLabel();
+        auto function = as.NewLabel();
+        as.Ld(6, stackTop);
+        as.Ld(4, count);
+        as.Bind(outerLoop);
+        as.AndI(5, 5, 0);
+        as.Bind(innerLoop);
+        as.AndI(0, 0, 0);
+        as.AddI(0, 0, 5);
+        as.Jsr(function);
+        as.AddI(5, 5, -1);
+        as.Br(5, innerLoop);
+        as.AddI(4, 4, -1);
+        as.Br(1, outerLoop);
+        as.Rti();
+        as.Bind(function);
+        as.AddI(6, 6, -1);
+        as.Str(7, 6, 0);
+        as.AddI(6, 6, -1);
+        as.Str(1, 6, 0);
+        as.Add(1, 0, 0);
+        as.Str(1, 6, -1);
+        as.Ldr(1, 6, 0);
+        as.AddI(6, 6, 1);
+        as.Ldr(7, 6, 0);
+        as.AddI(6, 6, 1);
+        as.Ret();
+        as.Bind(count);
+        as.Word(outer);
+        as.Bind(stackTop);
+        as.Word(0xf000);
+        return as.Image();
+    }
+
+    // PUTS in a loop, so that the time goes on trap round trips and string output.
+    lc3::PagedMemory Puts(uint16_t count)
+    {
+        Assembler as;
+        auto countLabel = as.NewLabel();
+        auto text = as.NewLabel();
+        auto loop = as.NewLabel();
+        as.Ld(6, countLabel);
+        as.Bind(loop);
+        as.Lea(0, text);
+        as.Trap(0x22);
+        as.AddI(6, 6, -1);
+        as.Br(1, loop);
+        as.Rti();
+        as.Bind(countLabel);
+        as.Word(count);
+        as.Bind(text);
+        for (const char* c = "Hello, World!\n"; *c; ++c)
+        {
+            as.Word(static_cast<uint16_t>(*c));
+        }
+        as.Word(0);
+        return as.Image();
+    }
+
+    // A loop that overwrites its own branch back with a HALT, so it stops after one pass: LD, ST, then the HALT.
+    lc3::PagedMemory SelfModifying()
+    {
+        Assembler as;
+        auto loop = as.NewLabel();
+        auto branch = as.NewLabel();
+        auto halt = as.NewLabel();
+        as.Bind(loop);
+        as.Ld(1, halt);
+        as.St(1, branch);
+        as.Bind(branch);
+        as.Br(7, loop);
+        as.Bind(halt);
+        as.Trap(0x25);
+        return as.Image();
+    }
+
+    /// \brief A VM for benchmarking the engines. Output goes to a buffer rather than to the console.
+    template<lc3::Engine engine>
+    class BenchVm : public lc3::Lc3Core<BenchVm<engine>, lc3::EngineConfig<engine>>
+    {
+    public:
+        explicit BenchVm(const lc3::PagedMemory& image) : mem_{image}
+        {
+            constexpr uint16_t MR_KBSR = 0xFE00;
+            this->MapDevice(MR_KBSR, &BenchVm::ReadKbsr);
+        }
+
+        uint16_t ReadMem(uint16_t address) { return mem_.Read(address); }
+
+        void WriteMem(uint16_t address, uint16_t val) { mem_.Write(address, val); }
+
+        lc3::Status Trap(const uint16_t instr)
+        {
+            this->status_ = lc3::Status::RUNNING;
+            ++traps_;
+            switch (instr & 0xff)
+            {
+            case 0x21: // OUT
+                Out(static_cast<char>(this->reg_[0]));
+                break;
+
+            case 0x22: // PUTS
+                for (uint16_t address = this->reg_[0], c = mem_.Read(address); c; c = mem_.Read(++address))
+                {
+                    Out(static_cast<char>(c));
+                }
+                break;
+
+            case 0x25: // HALT
+                this->status_ = lc3::Status::STOPPED;
+                break;
+
+            default:
+                break;
+            }
+            return this->status_;
+        }
+
+        /// \brief Fulfils every trap without leaving Run(), as none of them has anything to wait for.
+        bool TrapInline(const uint16_t instr)
+        {
+            Trap(instr);
+            return true;
+        }
+
+        uint64_t Traps() const { return traps_; }
+        uint64_t Written() const { return written_; }
+
+    private:
+        // There is never a key.
+        uint16_t ReadKbsr(uint16_t /*address*/) { return 0; }
+
+        void Out(char c)
+        {
+            output_.push_back(c);
+            if (output_.size() >= 4096)
+            {
+                written_ += output_.size();
+                output_.clear();
+            }
+        }
+
+        lc3::PagedMemory mem_;
+        std::string output_;
+        uint64_t traps_{0};
+        uint64_t written_{0};
+    };
+
+    /// \brief A batch of VMs for benchmarking the batch engine, with every lane running the same image.
+    class BenchBatch : public lc3::Lc3Batch<BenchBatch>
+    {
+    public:
+        explicit BenchBatch(const lc3::PagedMemory& image)
+        {
+            for (auto& mem : mem_)
+            {
+                mem = image;
+            }
+        }
+
+        uint16_t ReadMem(size_t lane, uint16_t address) { return mem_[lane].Read(address); }
+
+        void WriteMem(size_t lane, uint16_t address, uint16_t val) { mem_[lane].Write(address, val); }
+
+        bool Trap(size_t lane, const uint16_t instr)
+        {
+            ++traps_;
+            switch (instr & 0xff)
+            {
+            case 0x21: // OUT
+                ++written_;
+                break;
+
+            case 0x22: // PUTS
+                for (uint16_t address = Reg(lane, 0); mem_[lane].Read(address); ++address)
+                {
+                    ++written_;
+                }
+                break;
+
+            case 0x25: // HALT
+                return false;
+
+            default:
+                break;
+            }
+            return true;
+        }
+
+        uint64_t Traps() const { return traps_; }
+
+    private:
+        std::array<lc3::PagedMemory, LANES> mem_;
+        uint64_t traps_{0};
+        uint64_t written_{0};
+    };
+
+    /// \brief Runs a VM until it stops.
+    template<typename Vm>
+    void RunToCompletion(Vm& vm)
+    {
+        lc3::Status status = vm.GetStatus();
+        while (!status.IsStopped())
+        {
+            status = status.IsTrapped() ? vm.Trap(status.GetTrap()) : vm.Run();
+        }
+    }
+
+    /// \brief Checks that an engine discards code that the program overwrites, even code that was decoded and compiled
+    /// before the program first ran it, as it is when an image's analysis is prepared.
+    /// \return false, after reporting it, if the engine ran the old code.
+    template<lc3::Engine engine>
+    bool CheckSelfModifying(const char* engineName)
+    {
+        auto vm = std::make_unique<BenchVm<engine>>(SelfModifying());
+        vm->Prepare(0x3000, 0x3003, true);
+        RunToCompletion(*vm);
+        if (vm->Retired() == 3 && vm->Traps() == 1)
+        {
+            return true;
+        }
+        fprintf(stderr, "%s ran code that the program had overwritten\n", engineName);
+        return false;
+    }
+
+    /// \brief Counts the instructions that a program retires by single-stepping it.
+    uint64_t CountInstructions(const lc3::PagedMemory& image)
+    {
+        BenchVm<lc3::Engine::Switch> vm(image);
+        uint64_t count = 0;
+        lc3::Status status = vm.GetStatus();
+        while (!status.IsStopped())
+        {
+            if (status.IsTrapped())
+            {
+                status = vm.Trap(status.GetTrap());
+            }
+            else
+            {
+                status = vm.Run(1);
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    double Seconds(std::chrono::steady_clock::duration d) { return std::chrono::duration<double>(d).count(); }
+
+    struct Options
+    {
+        int repeat{3};             // Runs of each benchmark. The fastest is reported.
+        size_t maxThreads{0};      // The most worker threads to scale to, or 0 for one per hardware thread.
+        size_t maxVms{256};        // The most VMs to scale to.
+        const char* json{nullptr}; // Where to write JSON results, or "-" for stdout.
+    };
+
+    struct EngineResult
+    {
+        std::string benchmark;
+        std::string engine;
+        uint64_t instructions;
+        uint64_t traps;
+        double seconds;
+    };
+
+    struct ScalingResult
+    {
+        size_t vms;
+        size_t threads;
+        uint64_t instructions;
+        double seconds;
+    };
+
+    double Mips(uint64_t instructions, double seconds) { return seconds > 0 ? instructions / seconds / 1e6 : 0; }
+    double NsPerInstruction(uint64_t instructions, double seconds) { return instructions > 0 ? seconds * 1e9 / instructions : 0; }
+
+    template<lc3::Engine engine>
+    EngineResult BenchEngine(const char* benchmark, const char* engineName, const lc3::PagedMemory& image, uint64_t instructions, const Options& options)
+    {
+        double best = 0;
+        uint64_t traps = 0;
+        for (int i = 0; i < options.repeat; ++i)
+        {
+            auto vm = std::make_unique<BenchVm<engine>>(image);
+            const auto start = std::chrono::steady_clock::now();
+            RunToCompletion(*vm);
+            const double seconds = Seconds(std::chrono::steady_clock::now() - start);
+            best = (i == 0) ? seconds : std::min(best, seconds);
+            traps = vm->Traps();
+        }
+        const EngineResult result{benchmark, engineName, instructions, traps, best};
+        fprintf(report, "%-12s %-10s %12.1f MIPS %8.2f ns/instr\n", benchmark, engineName, Mips(instructions, best), NsPerInstruction(instructions, best));
+        fflush(report);
+        return result;
+    }
+
+    /// \brief Benchmarks the batch engine, reporting the instructions retired by all of its lanes together.
+    EngineResult BenchBatchEngine(const char* benchmark, const lc3::PagedMemory& image, uint64_t instructions, const Options& options)
+    {
+        constexpr const char* engineName = "Batch";
+        instructions *= BenchBatch::LANES;
+        double best = 0;
+        uint64_t traps = 0;
+        for (int i = 0; i < options.repeat; ++i)
+        {
+            auto batch = std::make_unique<BenchBatch>(image);
+            const auto start = std::chrono::steady_clock::now();
+            batch->Run();
+            const double seconds = Seconds(std::chrono::steady_clock::now() - start);
+            best = (i == 0) ? seconds : std::min(best, seconds);
+            traps = batch->Traps();
+        }
+        const EngineResult result{benchmark, engineName, instructions, traps, best};
+        fprintf(report, "%-12s %-10s %12.1f MIPS %8.2f ns/instr\n", benchmark, engineName, Mips(instructions, best), NsPerInstruction(instructions, best));
+        fflush(report);
+        return result;
+    }
+
+    ScalingResult BenchScheduler(const lc3::PagedMemory& image, uint64_t instructions, size_t vmCount, size_t threads, const Options& options)
+    {
+        double best = 0;
+        for (int i = 0; i < options.repeat; ++i)
+        {
+            VmPool vms(vmCount);
+            for (size_t vm = 0; vm < vmCount; ++vm)
+            {
+                vms.Emplace().SetImage(image);
+            }
+            Scheduler scheduler(std::move(vms), threads);
+            Scheduler::HeadlessConsole console;
+            const auto start = std::chrono::steady_clock::now();
+            scheduler.Run(console);
+            const double seconds = Seconds(std::chrono::steady_clock::now() - start);
+            best = (i == 0) ? seconds : std::min(best, seconds);
+        }
+        const ScalingResult result{vmCount, threads, instructions * vmCount, best};
+        fprintf(report, "%6zu VMs %4zu threads %12.1f MIPS %8.2f ns/instr\n", vmCount, threads, Mips(result.instructions, best), NsPerInstruction(result.instructions, best));
+        fflush(report);
+        return result;
+    }
+
+    void WriteJson(FILE* out, const std::vector<EngineResult>& engines, const std::vector<ScalingResult>& scaling, const char* schedulerEngine)
+    {
+        fprintf(out, "{\n  \"engines\": [\n");
+        for (size_t i = 0; i < engines.size(); ++i)
+        {
+            const auto& r = engines[i];
+            fprintf(out, "    {\"benchmark\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, \"traps\": %llu, \"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.4f}%s\n",
+                    r.benchmark.c_str(), r.engine.c_str(), static_cast<unsigned long long>(r.instructions), static_cast<unsigned long long>(r.traps),
+                    r.seconds, Mips(r.instructions, r.seconds), NsPerInstruction(r.instructions, r.seconds), i + 1 < engines.size() ? "," : "");
+        }
+        fprintf(out, "  ],\n  \"scaling\": {\n    \"engine\": \"%s\",\n    \"results\": [\n", schedulerEngine);
+        for (size_t i = 0; i < scaling.size(); ++i)
+        {
+            const auto& r = scaling[i];
+            fprintf(out, "      {\"vms\": %zu, \"threads\": %zu, \"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.4f}%s\n",
+                    r.vms, r.threads, static_cast<unsigned long long>(r.instructions), r.seconds, Mips(r.instructions, r.seconds),
+                    NsPerInstruction(r.instructions, r.seconds), i + 1 < scaling.size() ? "," : "");
+        }
+        fprintf(out, "    ]\n  }\n}\n");
+    }
+
+    bool ParseOptions(int argc, const char* argv[], Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const bool hasValue = i + 1 < argc;
+            if (strcmp(argv[i], "--repeat") == 0 && hasValue)
+            {
+                options.repeat = std::max(1, atoi(argv[++i]));
+            }
+            else if (strcmp(argv[i], "--max-threads") == 0 && hasValue)
+            {
+                options.maxThreads = static_cast<size_t>(atoi(argv[++i]));
+            }
+            else if (strcmp(argv[i], "--max-vms") == 0 && hasValue)
+            {
+                options.maxVms = std::max<size_t>(1, static_cast<size_t>(atoi(argv[++i])));
+            }
+            else if (strcmp(argv[i], "--json") == 0 && hasValue)
+            {
+                options.json = argv[++i];
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+} // namespace
+
+// The engine that the scheduler's VMs use, as a string. Set by the build, see CMakeLists.txt.
+#define LC3_STRINGIFY(x) #x
+#define LC3_ENGINE_NAME(x) LC3_STRINGIFY(x)
+
+int main(int argc, const char* argv[])
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        printf("%s [--repeat n] [--max-threads n] [--max-vms n] [--json file|-]\n", argv[0]);
+        return 2;
+    }
+
+    // With JSON on stdout, the human-readable report goes to stderr.
+    const bool jsonToStdout = options.json && strcmp(options.json, "-") == 0;
+    if (jsonToStdout)
+    {
+        report = stderr;
+    }
+
+    // A benchmark of an engine that runs the wrong code is meaningless.
+    if (!CheckSelfModifying<lc3::Engine::Switch>("Switch") || !CheckSelfModifying<lc3::Engine::Predecode>("Predecode")
+        || !CheckSelfModifying<lc3::Engine::Threaded>("Threaded") || !CheckSelfModifying<lc3::Engine::Jit>("Jit"))
+    {
+        return 1;
+    }
+
+    struct Benchmark
+    {
+        const char* name;
+        lc3::PagedMemory image;
+    };
+    const Benchmark benchmarks[] = {
+            {"arithmetic", Arithmetic(64)},
+            {"memory", Memory(800)},
+            {"branchy", Branchy(24)},
+            {"stack", Stack(24)},
+            {"puts", Puts(20000)},
+    };
+
+    std::vector<EngineResult> engines;
+    for (const auto& benchmark : benchmarks)
+    {
+        const uint64_t instructions = CountInstructions(benchmark.image);
+        engines.push_back(BenchEngine<lc3::Engine::Switch>(benchmark.name, "Switch", benchmark.image, instructions, options));
+        engines.push_back(BenchEngine<lc3::Engine::Predecode>(benchmark.name, "Predecode", benchmark.image, instructions, options));
+        engines.push_back(BenchEngine<lc3::Engine::Threaded>(benchmark.name, "Threaded", benchmark.image, instructions, options));
+        engines.push_back(BenchEngine<lc3::Engine::Jit>(benchmark.name, lc3::Jit::supported ? "Jit" : "Jit(Threaded)", benchmark.image, instructions, options));
+        engines.push_back(BenchBatchEngine(benchmark.name, benchmark.image, instructions, options));
+    }
+
+    // Many small VMs sharing one image, scaled over VM count and worker threads.
+    fprintf(report, "scheduler engine: %s\n", LC3_ENGINE_NAME(LC3_ENGINE));
+    const lc3::PagedMemory vmImage = Arithmetic(2);
+    const uint64_t vmInstructions = CountInstructions(vmImage);
+    const size_t maxThreads = options.maxThreads > 0 ? options.maxThreads : std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<ScalingResult> scaling;
+    for (size_t vms = 1; vms <= options.maxVms; vms *= 4)
+    {
+        for (size_t threads = 1;; threads = std::min(threads * 2, maxThreads))
+        {
+            scaling.push_back(BenchScheduler(vmImage, vmInstructions, vms, threads, options));
+            if (threads >= maxThreads || threads >= vms)
+            {
+                break;
+            }
+        }
+    }
+
+    if (options.json)
+    {
+        FILE* out = jsonToStdout ? stdout : fopen(options.json, "w");
+        if (!out)
+        {
+            fprintf(stderr, "failed to open %s\n", options.json);
+            return 1;
+        }
+        WriteJson(out, engines, scaling, LC3_ENGINE_NAME(LC3_ENGINE));
+        if (!jsonToStdout)
+        {
+            fclose(out);
+        }
+    }
+}
@@ -1,67 +1,140 @@
 #include "Lc3C.h"
+#include "Lc3Image.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <vector>
 
-uint16_t Lc3C::ReadMem(uint16_t address)
+const char* Lc3C::TrapName(size_t kind)
 {
-    // Externally mapped I/O ports.
-    constexpr uint16_t MR_KBSR = 0xFE00; // Keyboard status register.
-    constexpr uint16_t MR_KBDR = 0xFE02; // Keyboard data register.
+    static const char* const names[TRAP_KINDS] = {"getc", "out", "puts", "in", "putsp", "halt", "wait", "other"};
+    return names[kind];
+}
+
+Lc3C::Lc3C()
+{
+    // The keyboard data register is plain memory that ReadKbsr() fills in, so only the status register needs a handler.
+    MapDevice(MR_KBSR, &Lc3C::ReadKbsr);
+    MapDevice(MR_DSR, &Lc3C::ReadDsr);
+    MapDevice(MR_DDR, nullptr, &Lc3C::WriteDdr);
+    MapDevice(MR_TMR, &Lc3C::ReadTmr, &Lc3C::WriteTmr);
+    MapDevice(MR_TSR, &Lc3C::ReadTsr);
+}
 
-    if (address == MR_KBSR)
+uint16_t Lc3C::ReadKbsr(uint16_t address)
+{
+    // The VM is trying to read the keyboard.
+    if (const uint16_t key = ReadKey(); key != 0)
     {
-        // The VM is trying to read the keyboard.
-        if (HasKey())
-        {
-            mem_[MR_KBSR] = (1 << 15);
-            mem_[MR_KBDR] = GetKey();
-        }
-        else
-        {
-            mem_[MR_KBSR] = 0;
-        }
+        mem_.Write(MR_KBSR, 1 << 15);
+        mem_.Write(MR_KBDR, key);
+        NoteActivity();
+    }
+    else
+    {
+        mem_.Write(MR_KBSR, 0);
+        NotePoll();
+    }
+    return mem_.Read(address);
+}
+
+uint16_t Lc3C::ReadDsr(uint16_t /*address*/)
+{
+    if (displayReady_)
+    {
+        return 1 << 15;
+    }
+    waitingForDisplay_ = true;
+    NotePoll();
+    return 0;
+}
+
+void Lc3C::WriteDdr(uint16_t /*address*/, uint16_t val)
+{
+    // Output written without checking DSR first is kept even if the display isn't ready. The runner holds it back.
+    output_.Put(static_cast<char>(val & 0xff));
+}
+
+void Lc3C::WriteTmr(uint16_t /*address*/, uint16_t val)
+{
+    timerInterval_ = val;
+    timerDeadline_ = Clock::now() + std::chrono::milliseconds(val);
+}
+
+uint16_t Lc3C::ReadTsr(uint16_t /*address*/)
+{
+    const auto now = Clock::now();
+    if (!ReadTimer(now))
+    {
+        NotePoll();
+        return 0;
+    }
+    NoteActivity();
+
+    // Keep to the timer's period, but if the program hasn't looked for a while then don't report every expiry it
+    // missed, just one.
+    const auto interval = std::chrono::milliseconds(timerInterval_);
+    timerDeadline_ += interval;
+    if (timerDeadline_ <= now)
+    {
+        timerDeadline_ = now + interval;
+    }
+    return 1 << 15;
+}
+
+bool Lc3C::ReadTimer(Clock::time_point now)
+{
+    if (replay_)
+    {
+        return replay_->Timer();
     }
-    return mem_[address];
+    const bool expired = TimerExpired(now);
+    if (trace_)
+    {
+        expired ? trace_->Record(lc3::TraceEvent::TIMER, 0) : trace_->Quiet();
+    }
+    return expired;
 }
 
-lc3::State Lc3C::Trap(const uint16_t instr)
+lc3::Status Lc3C::Trap(const uint16_t instr)
 {
-    // Default back to running.
-    state_ = lc3::Running();
+    // Default back to running. Whatever the trap does, the VM has made progress.
+    status_ = lc3::Status::RUNNING;
+    NoteActivity();
+    const size_t kind = (instr & 0xff) - static_cast<size_t>(Traps::TRAP_GETC);
+    trapCounts_[kind < TRAP_KINDS - 1 ? kind : TRAP_KINDS - 1].Add();
 
     switch (static_cast<Traps>(instr & 0xff))
     {
     case Traps::TRAP_GETC:
         // Trap GETC - read a single character.
-        reg_[0] = GetKey();
+        reg_[0] = ReadKey();
         break;
 
     case Traps::TRAP_OUT:
         // Trap OUT - write a single character.
-        putc((char)reg_[0], stdout);
-        fflush(stdout);
+        output_.Put((char)reg_[0]);
         break;
 
     case Traps::TRAP_PUTS:
         // Trap PUTS - write a character string.
         {
             /* one char per word */
-            uint16_t* c = mem_ + reg_[0];
-            while (*c)
+            uint16_t address = reg_[0];
+            for (uint16_t c = TrapReadMem(address); c; c = TrapReadMem(++address))
             {
-                putc((char)*c, stdout);
-                ++c;
+                output_.Put((char)c);
             }
-            fflush(stdout);
         }
         break;
 
     case Traps::TRAP_IN:
         // Trap IN - read a single character.
         {
-            printf("Enter a character: ");
-            char c = GetKey();
-            putc(c, stdout);
+            output_.Write("Enter a character: ");
+            char c = ReadKey();
+            output_.Put(c);
             reg_[0] = static_cast<uint16_t>(c);
         }
         break;
@@ -69,31 +142,88 @@ lc3::State Lc3C::Trap(const uint16_t instr)
     case Traps::TRAP_PUTSP:
         // Trap PUTSP - write a big-endian byte-packed character string.
         {
-            for (uint16_t* c = mem_ + reg_[0]; *c; c++)
+            uint16_t address = reg_[0];
+            for (uint16_t c = TrapReadMem(address); c; c = TrapReadMem(++address))
             {
-                char char1 = (*c) & 0xFF;
-                putc(char1, stdout);
-                char char2 = (*c) >> 8;
+                char char1 = c & 0xFF;
+                output_.Put(char1);
+                char char2 = c >> 8;
                 if (char2)
                 {
-                    putc(char2, stdout);
+                    output_.Put(char2);
                 }
             }
-            fflush(stdout);
         }
         break;
 
     case Traps::TRAP_HALT:
         // Trap HALT - and catch fire.
-        puts("HALT");
-        fflush(stdout);
-        state_ = lc3::Stopped();
+        output_.Write("HALT\n");
+        output_.Flush();
+        Stop();
+        break;
+
+    case Traps::TRAP_WAIT:
+        // Trap WAIT - the runner has already waited for a key or for the timer, so there's nothing left to do.
         break;
     }
-    return state_;
+    return status_;
+}
+
+bool Lc3C::TrapInline(const uint16_t instr)
+{
+    switch (static_cast<Traps>(instr & 0xff))
+    {
+    case Traps::TRAP_GETC:
+    case Traps::TRAP_IN:
+        // A key that is already here can be read straight away. During a replay that is up to the trace, which the
+        // runner asks once it has checked whether the VM was halted here instead.
+        if (replay_ || !HasKey())
+        {
+            return false;
+        }
+        break;
+
+    case Traps::TRAP_OUT:
+    case Traps::TRAP_PUTS:
+    case Traps::TRAP_PUTSP:
+        if (!inlineOutput_)
+        {
+            return false;
+        }
+        break;
+
+    case Traps::TRAP_HALT:
+        break;
+
+    default:
+        // WAIT has to wait by definition, and anything else is left for the runner to make sense of.
+        return false;
+    }
+    Trap(instr);
+    return true;
 }
 
 void Lc3C::ReadImage(FILE* file)
+{
+    ReadImage(file, mem_);
+
+    // The image was written straight into memory, so anything decoded from the old contents is stale.
+    InvalidateDecoded();
+    Prepare(lc3::Analyse(mem_, pc_));
+}
+
+bool Lc3C::ReadImage(const char* filename)
+{
+    if (!ReadImage(filename, mem_)) { return false; }
+
+    // The image was written straight into memory, so anything decoded from the old contents is stale.
+    InvalidateDecoded();
+    Prepare(lc3::AnalyseImage(filename, mem_, pc_));
+    return true;
+}
+
+void Lc3C::ReadImage(FILE* file, lc3::PagedMemory& mem)
 {
     // The origin tells us where in memory to place the image.
     uint16_t origin;
@@ -102,22 +232,109 @@ void Lc3C::ReadImage(FILE* file)
 
     // We know the maximum file size so we only need one fread.
     uint16_t max_read = UINT16_MAX - origin;
-    uint16_t* p = mem_ + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+    std::vector<uint16_t> words(max_read);
+    size_t read = fread(words.data(), sizeof(uint16_t), max_read, file);
 
-    // Swap to little endian.
-    while (read-- > 0)
+    // Swap to little endian, a page at a time so that each page is only made writable once.
+    constexpr size_t PAGE_SIZE = lc3::PagedMemory::PAGE_SIZE;
+    size_t address = origin;
+    for (size_t i = 0; i < read;)
     {
-        *p = Swap16(*p);
-        ++p;
+        const size_t offset = address % PAGE_SIZE;
+        const size_t n = std::min(PAGE_SIZE - offset, read - i);
+        lc3::SwapWords(mem.WritablePage(address / PAGE_SIZE).data() + offset, words.data() + i, n);
+        i += n;
+        address += n;
     }
 }
 
-bool Lc3C::ReadImage(const char* filename)
+bool Lc3C::ReadImage(const char* filename, lc3::PagedMemory& mem)
+{
+    // Map the file rather than reading it. This also accepts image caches, which need no conversion at all.
+    return lc3::LoadImage(filename, mem);
+}
+
+bool Lc3C::ReadImage(const char* filename, lc3::Snapshot& snapshot)
+{
+    snapshot = lc3::Snapshot();
+    snapshot.regs.pc = PC_START;
+    return ReadImage(filename, snapshot.mem);
+}
+
+void Lc3C::SetImage(const lc3::PagedMemory& image)
 {
-    FILE* file = fopen(filename, "rb");
-    if (!file) { return false; }
-    ReadImage(file);
-    fclose(file);
+    mem_ = image;
+    InvalidateDecoded();
+}
+
+void Lc3C::Prepare(const lc3::Analysis& analysis)
+{
+    for (const auto& block : analysis.blocks)
+    {
+        const bool hot = std::binary_search(analysis.hot.begin(), analysis.hot.end(), block.start);
+        Lc3Core::Prepare(block.start, block.end, hot);
+    }
+}
+
+void Lc3C::Halt()
+{
+    if (trace_)
+    {
+        trace_->Record(lc3::TraceEvent::HALT, TraceRetired());
+    }
+    Stop();
+}
+
+bool Lc3C::StartTrace(const char* filename)
+{
+    auto trace = std::make_unique<lc3::TraceWriter>();
+    if (!trace->Open(filename, lc3::HashState(Save())))
+    {
+        return false;
+    }
+    trace_ = std::move(trace);
+    traceStart_ = Retired();
     return true;
 }
+
+bool Lc3C::EndTrace()
+{
+    if (!trace_)
+    {
+        return false;
+    }
+    const bool ok = trace_->Close(TraceRetired(), lc3::HashState(Save()));
+    trace_.reset();
+    return ok;
+}
+
+bool Lc3C::StartReplay(const char* filename)
+{
+    auto replay = std::make_unique<lc3::TraceReader>();
+    if (!replay->Open(filename) || replay->StartHash() != lc3::HashState(Save()))
+    {
+        return false;
+    }
+    replay_ = std::move(replay);
+    traceStart_ = Retired();
+    return true;
+}
+
+lc3::Snapshot Lc3C::Save() const
+{
+    lc3::Snapshot snapshot;
+    snapshot.regs = GetRegisters();
+    snapshot.state = status_;
+    snapshot.key = key_ != 0 ? key_ : keys_.Front();
+    snapshot.mem = mem_;
+    return snapshot;
+}
+
+void Lc3C::Restore(const lc3::Snapshot& snapshot)
+{
+    SetRegisters(snapshot.regs);
+    status_ = lc3::Status(snapshot.state);
+    key_ = snapshot.key;
+    keys_.Clear();
+    SetImage(snapshot.mem);
+}
@@ -1,11 +1,65 @@
 #pragma once
 
 #include "LC3.h"
+#include "Lc3Analysis.h"
+#include "Lc3KeyQueue.h"
+#include "Lc3Memory.h"
+#include "Lc3Metrics.h"
+#include "Lc3Output.h"
+#include "Lc3Snapshot.h"
+#include "Lc3Trace.h"
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <memory>
+
+// The execution engine used by the console VM, as the name of an lc3::Engine. Set by the build, see CMakeLists.txt.
+#if !defined(LC3_ENGINE)
+#define LC3_ENGINE Threaded
+#endif
+
+// Define LC3_PROFILE to profile the console VM's guest programs. Each VM writes its profile when it stops.
+#if defined(LC3_PROFILE)
+#define LC3_PROFILER lc3::Profiler
+#else
+#define LC3_PROFILER lc3::NoProfiler
+#endif
+
+// Define LC3_MEMORY_STATS to count the console VM's memory accesses and watch address ranges. Each VM writes its
+// counts when it stops.
+#if defined(LC3_MEMORY_STATS)
+#define LC3_MONITOR lc3::MemoryMonitor
+#else
+#define LC3_MONITOR lc3::NoMemoryMonitor
+#endif
+
+/// \brief The console VM's configuration: an interactive core, with the engine and policies that the build selects.
+struct Lc3CConfig : lc3::InteractiveConfig
+{
+    static constexpr lc3::Engine engine = lc3::Engine::LC3_ENGINE;
+    using Profiler = LC3_PROFILER;
+    using Monitor = LC3_MONITOR;
+};
 
 /// \brief An LC3 VM with a console.
-class Lc3C : public lc3::Lc3Core<Lc3C>
+///
+/// Besides the keyboard, the I/O region holds a display and a timer:
+///
+///   xFE00 KBSR  keyboard status, bit 15 set when a key is waiting. Reading it moves the key into KBDR.
+///   xFE02 KBDR  keyboard data.
+///   xFE04 DSR   display status, bit 15 set when the display is ready, i.e., unless the VM is waiting for the console.
+///   xFE06 DDR   display data. Writing it outputs the low byte.
+///   xFE08 TMR   timer interval in milliseconds. Writing it restarts the timer, and writing 0 stops it.
+///   xFE0A TSR   timer status, bit 15 set if the timer has expired since TSR was last read. Reading it clears it.
+///
+/// TRAP x26 (WAIT) waits until a key is waiting or the timer has expired, so that a program can sleep instead of
+/// spinning on KBSR or TSR.
+///
+/// A VM can record a trace of everything that it reads from the keyboard and the timer, and of being halted from
+/// outside, or replay one instead of reading the real devices. See Lc3Trace.h.
+class Lc3C : public lc3::Lc3Core<Lc3C, Lc3CConfig>
 {
 public:
     enum class Traps
@@ -15,47 +69,226 @@ public:
         TRAP_PUTS = 0x22,  // Output a word string.
         TRAP_IN = 0x23,    // Get character from keyboard, echoed onto the terminal.
         TRAP_PUTSP = 0x24, // Output a byte string.
-        TRAP_HALT = 0x25   // Halt the program.
+        TRAP_HALT = 0x25,  // Halt the program.
+        TRAP_WAIT = 0x26   // Wait for a key or for the timer to expire. Not part of the standard LC-3.
     };
 
+    using Clock = std::chrono::steady_clock;
+
+    /// \brief The number of kinds of trap that are counted: one for each of Traps, in order, then one for the rest.
+    static constexpr size_t TRAP_KINDS = 8;
+
+    /// \brief Returns the name of a kind of trap, e.g., "getc", or "other" for vectors that aren't in Traps.
+    static const char* TrapName(size_t kind);
+
+    Lc3C();
+
     /// \brief Invoked by the CRTP base class to write to VM memory.
-    void WriteMem(uint16_t address, uint16_t val) { mem_[address] = val; }
+    void WriteMem(uint16_t address, uint16_t val) { mem_.Write(address, val); }
 
     /// \brief Invoked by the CRTP base class to read from VM memory.
-    uint16_t ReadMem(uint16_t address);
+    uint16_t ReadMem(uint16_t address) { return mem_.Read(address); }
 
     /// \brief Loads the given program image into VM memory.
     /// \param file the file to load.
     void ReadImage(FILE* file);
 
-    /// \brief Loads the given program image file into the VM.
-    /// \brief Loads the given program image into VM memory.
+    /// \brief Loads the given program image into the given memory.
+    /// \param file the file to load.
+    /// \param mem the memory to load it into.
+    static void ReadImage(FILE* file, lc3::PagedMemory& mem);
+
+    /// \brief Loads the given program image file, or image cache, into the given memory.
+    /// \param filename the name of the file to load.
+    /// \param mem the memory to load it into.
+    static bool ReadImage(const char* filename, lc3::PagedMemory& mem);
+
+    /// \brief Loads the given program image file, or image cache, as a snapshot of a VM that has just been reset, so
+    /// that a VM restored from it starts wherever the VM's configuration starts execution.
+    /// \param filename the name of the file to load.
+    /// \param snapshot receives the snapshot.
+    static bool ReadImage(const char* filename, lc3::Snapshot& snapshot);
+
+    /// \brief Replaces VM memory with an image that has already been loaded. Pages are shared with the image until
+    /// the VM writes to them, so many VMs can run the same image for little more than the memory that each one changes.
+    /// \param image the image.
+    void SetImage(const lc3::PagedMemory& image);
+
+    /// \brief Loads the given program image file into the VM, and prepares the code that it can reach to run, using the
+    /// analysis cached next to the file if there is one.
     /// \param filename the name of the file to load.
     bool ReadImage(const char* filename);
 
+    /// \brief Decodes the basic blocks that an analysis of the VM's memory found, and compiles the hot ones if the
+    /// engine is a JIT, so that the VM runs at full speed from its first instruction.
+    /// \param analysis the analysis, which must be of what is in memory now.
+    void Prepare(const lc3::Analysis& analysis);
+
+    /// \brief Takes a snapshot of the VM. Its memory is shared with the VM until one or the other writes to it. Only
+    /// the next key is kept, not any that are queued behind it.
+    lc3::Snapshot Save() const;
+
+    /// \brief Replaces the whole state of the VM with a snapshot, sharing the snapshot's memory until it is written.
+    /// Buffered output is kept, as it belongs to the VM's past rather than its state.
+    /// \param snapshot the snapshot to restore.
+    void Restore(const lc3::Snapshot& snapshot);
+
     /// \brief Notifies the VM that a trap can be fulfilled.
     /// \param instr the trap instruction to fulfil.
     /// \return the state of the VM after fulfilling the trap.
-    lc3::State Trap(const uint16_t instr);
+    lc3::Status Trap(const uint16_t instr);
+
+    /// \brief Invoked by the CRTP base class to fulfil a trap without leaving Run(), if it can be fulfilled without
+    /// waiting: HALT, output traps if SetInlineOutput() allows them, and GETC and IN if there is already a key.
+    /// \param instr the trap instruction.
+    /// \return true if the trap was fulfilled, false if it was left for the runner.
+    bool TrapInline(const uint16_t instr);
+
+    /// \brief Sets whether output traps are fulfilled without leaving Run(). That's only right when output never has
+    /// to wait, e.g., because it goes to a file of the VM's own rather than to a console that it has to take turns at.
+    void SetInlineOutput(bool inlineOutput) { inlineOutput_ = inlineOutput; }
+
+    /// \brief Sets whether the display is ready. A display that isn't ready, e.g., because the VM's output goes to a
+    /// console that another VM owns, clears DSR's ready bit, and holds on to anything written to DDR regardless.
+    void SetDisplayReady(bool ready)
+    {
+        displayReady_ = ready;
+        waitingForDisplay_ = false;
+    }
+
+    /// \brief Returns true if the display is ready.
+    bool DisplayReady() const { return displayReady_; }
+
+    /// \brief Returns true if the VM is waiting for the display to become ready, i.e., it has polled DSR since
+    /// SetDisplayReady() made the display not ready, or has written output since then that is being held back.
+    bool IsWaitingForDisplay() const { return waitingForDisplay_ || (!displayReady_ && !output_.Empty()); }
 
-    /// \brief Notifies the VM that a key is available for reading.
+    /// \brief Notifies the VM that a key is available for reading, ahead of any that are queued.
     void SetKey(uint16_t key) { key_ = key; }
 
+    /// \brief Queues a key for the VM to read after the ones that are already waiting. Unlike everything else, it can
+    /// be called from another thread while the VM runs, as long as no other thread queues keys for the same VM.
+    /// \return false if the queue is full and the key was dropped.
+    bool QueueKey(uint16_t key) { return keys_.Push(key); }
+
+    /// \brief Returns true if a key is queued that the VM hasn't read yet. Can be called from any thread.
+    bool HasQueuedKey() const { return !keys_.Empty(); }
+
+    /// \brief Returns true if the VM has a key that it hasn't read yet.
+    bool HasKey() const { return key_ != 0 || !keys_.Empty(); };
+
+    /// \brief Returns true if the timer is running.
+    bool TimerRunning() const { return timerInterval_ != 0; }
+
+    /// \brief Returns when the timer next expires. Only meaningful if it is running.
+    Clock::time_point TimerDeadline() const { return timerDeadline_; }
+
+    /// \brief Returns true if the timer is running and has expired since TSR was last read.
+    bool TimerExpired(Clock::time_point now) const { return TimerRunning() && now >= timerDeadline_; }
+
+    /// \brief Stops the VM from outside, e.g., because it is waiting for input that will never come.
+    void Halt();
+
+    /// \brief Starts recording a trace of the VM's nondeterministic input, from its current state.
+    /// \param filename the name of the trace file to write.
+    /// \return false if the file couldn't be created.
+    bool StartTrace(const char* filename);
+
+    /// \brief Ends the trace, if there is one, recording the state that the VM ended in.
+    /// \return false if there wasn't a trace or it couldn't be written.
+    bool EndTrace();
+
+    /// \brief Starts replaying a trace. From now on, the keyboard and the timer give what the trace says they gave.
+    /// \param filename the name of the trace file to read.
+    /// \return false if the file couldn't be read or isn't a trace, or if it was recorded from a different state.
+    bool StartReplay(const char* filename);
+
+    /// \brief Returns the trace being replayed, or nullptr if there isn't one.
+    lc3::TraceReader* Replay() { return replay_.get(); }
+
+    /// \brief Returns the number of instructions retired since the trace being recorded or replayed started.
+    uint64_t TraceRetired() const { return Retired() - traceStart_; }
+
+    /// \brief Returns the number of traps of the given kind that have been fulfilled. Can be called from any thread.
+    /// \param kind the kind of trap, from 0 for GETC to TRAP_KINDS - 1 for vectors that aren't in Traps.
+    uint64_t TrapCount(size_t kind) const { return trapCounts_[kind].Get(); }
+
+    /// \brief Returns the buffer that output traps write to. It is up to the runner to flush it.
+    lc3::OutputBuffer& Output() { return output_; }
+
 private:
+    // Externally mapped I/O ports.
+    static constexpr uint16_t MR_KBSR = 0xFE00; // Keyboard status register.
+    static constexpr uint16_t MR_KBDR = 0xFE02; // Keyboard data register.
+    static constexpr uint16_t MR_DSR = 0xFE04;  // Display status register.
+    static constexpr uint16_t MR_DDR = 0xFE06;  // Display data register.
+    static constexpr uint16_t MR_TMR = 0xFE08;  // Timer interval register.
+    static constexpr uint16_t MR_TSR = 0xFE0A;  // Timer status register.
+    static_assert(MR_KBSR >= IO_BASE, "the console's devices must be in the I/O region");
+
     static uint16_t Swap16(uint16_t x) { return (x << 8) | (x >> 8); }
 
-    /// \brief Called by the VM to detect if the execution environment has made a key available.
-    /// Does not consume the key.
-    bool HasKey() const { return key_ != 0; };
+    /// \brief Called by the VM to read the keyboard status register. Moves any waiting key into the data register.
+    uint16_t ReadKbsr(uint16_t address);
 
-    /// \brief Called by the VM to read and consume a key set by the execution environment.
-    uint16_t GetKey()
+    uint16_t ReadDsr(uint16_t address);
+    void WriteDdr(uint16_t address, uint16_t val);
+    uint16_t ReadTmr(uint16_t /*address*/) { return timerInterval_; }
+    void WriteTmr(uint16_t address, uint16_t val);
+    uint16_t ReadTsr(uint16_t address);
+
+    /// \brief Called by the VM to read a key, from the trace if one is being replayed.
+    /// \return the key, or 0 if there isn't one.
+    uint16_t ReadKey()
     {
-        auto key = key_;
-        key_ = 0;
+        if (replay_)
+        {
+            return replay_->Key();
+        }
+        const uint16_t key = GetKey();
+        if (trace_)
+        {
+            key != 0 ? trace_->Record(lc3::TraceEvent::KEY, key) : trace_->Quiet();
+        }
         return key;
     }
 
-    uint16_t mem_[65536]; // VM memory - 65536 x 16-bit locations (i.e., not bytes).
-    uint16_t key_{0};     // The current key being input to the VM, or 0 if no key is available.
+    /// \brief Reads memory for a trap, telling the memory monitor as if the TRAP instruction had read it.
+    uint16_t TrapReadMem(uint16_t address)
+    {
+        const uint16_t val = mem_.Read(address);
+        GetMonitor().OnRead(pc_ - 1, address, val);
+        return val;
+    }
+
+    /// \brief Called by the VM to find whether the timer has expired, from the trace if one is being replayed.
+    bool ReadTimer(Clock::time_point now);
+
+    /// \brief Consumes a key set by the execution environment.
+    uint16_t GetKey()
+    {
+        if (const auto key = key_; key != 0)
+        {
+            key_ = 0;
+            return key;
+        }
+        return keys_.Pop();
+    }
+
+    lc3::PagedMemory mem_;          // VM memory - 65536 x 16-bit locations (i.e., not bytes).
+    uint16_t key_{0};               // A key set directly, read before any that are queued, or 0 if there isn't one.
+    lc3::KeyQueue keys_;            // Keys queued by another thread, e.g., from the console.
+    lc3::OutputBuffer output_;      // Output waiting to be written.
+    bool inlineOutput_{false};      // True if output traps are fulfilled without leaving Run().
+    bool displayReady_{true};       // True if DSR reports that the display is ready.
+    bool waitingForDisplay_{false}; // True if the VM has polled DSR while the display wasn't ready.
+
+    uint16_t timerInterval_{0};         // The timer's interval in milliseconds, or 0 if it isn't running.
+    Clock::time_point timerDeadline_{}; // When the timer next expires.
+
+    std::unique_ptr<lc3::TraceWriter> trace_;  // The trace being recorded, if there is one.
+    std::unique_ptr<lc3::TraceReader> replay_; // The trace being replayed, if there is one.
+    uint64_t traceStart_{0};                   // Retired() when the trace started.
+
+    lc3::Counter trapCounts_[TRAP_KINDS]; // Traps fulfilled, by kind.
 };
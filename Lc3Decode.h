@@ -0,0 +1,319 @@
+/// Decoding of LC3 instructions, shared by the execution engines: instruction fields, and the micro-ops that the
+/// predecoding engines run.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace lc3
+{
+    /// \brief Micro-ops used by the predecoding engines.
+    ///
+    /// Variants of an opcode get their own micro-op and PC-relative offsets are resolved to absolute addresses when the
+    /// instruction is decoded.
+    ///
+    /// The micro-ops after UOP_STOP are superinstructions, each fused from a common pair of instructions at consecutive
+    /// addresses. A superinstruction is held at the address of the first instruction of its pair, and the second keeps
+    /// its own entry, so a branch to the second instruction runs it on its own. sext(c) is c sign-extended from 8 bits.
+    enum MicroOps : uint8_t
+    {
+        UOP_DECODE = 0, // Not decoded yet.
+        UOP_ADD_REG,    // reg[a] = reg[b] + reg[c]
+        UOP_ADD_IMM,    // reg[a] = reg[b] + imm
+        UOP_AND_REG,    // reg[a] = reg[b] & reg[c]
+        UOP_AND_IMM,    // reg[a] = reg[b] & imm
+        UOP_NOT,        // reg[a] = ~reg[b]
+        UOP_BR,         // if (a & cond) pc = imm
+        UOP_BRA,        // pc = imm (a BR with no condition bits set)
+        UOP_JMP,        // pc = reg[b]
+        UOP_JSR,        // r7 = pc, pc = imm
+        UOP_JSRR,       // r7 = pc, pc = reg[b]
+        UOP_LD,         // reg[a] = mem[imm]
+        UOP_LDI,        // reg[a] = mem[mem[imm]]
+        UOP_LDR,        // reg[a] = mem[reg[b] + imm]
+        UOP_LEA,        // reg[a] = imm
+        UOP_ST,         // mem[imm] = reg[a]
+        UOP_STI,        // mem[mem[imm]] = reg[a]
+        UOP_STR,        // mem[reg[b] + imm] = reg[a]
+        UOP_TRAP,       // Trap with the instruction in imm.
+        UOP_STOP,       // RTI and reserved opcodes.
+        UOP_CONST,      // reg[a] = imm (AND with #0, then ADD an immediate)
+        UOP_PUSH,       // reg[b] += sext(c), mem[reg[b] + imm] = reg[a] (ADD to the stack pointer, then STR through it)
+        UOP_POP,        // reg[a] = mem[reg[b] + imm], reg[b] += sext(c) (LDR through the stack pointer, then ADD to it)
+        UOP_ADD_IMM_BR, // reg[a & 7] = reg[b] + sext(c), if ((a >> 3) & cond) pc = imm (ADD, then BR)
+        UOP_ADD_REG_BR, // reg[a & 7] = reg[b] + reg[c], if ((a >> 3) & cond) pc = imm (ADD, then BR)
+        UOP_COUNT
+    };
+
+    /// \brief An instruction decoded into a micro-op with its fields already extracted.
+    struct alignas(8) Decoded
+    {
+        uint8_t uop;  // The micro-op, or UOP_DECODE if the address has not been decoded.
+        uint8_t a;    // DR, SR or condition bits.
+        uint8_t b;    // SR1 or BaseR.
+        uint8_t c;    // SR2.
+        uint16_t imm; // Sign-extended immediate, offset or resolved address.
+    };
+
+    /// \brief LC3 opcodes, i.e., the top four bits of an instruction.
+    enum Opcodes
+    {
+        OP_BR = 0, // Branch.
+        OP_ADD,    // Add.
+        OP_LD,     // Load.
+        OP_ST,     // Store.
+        OP_JSR,    // Jump to subroutine.
+        OP_AND,    // Bitwise and.
+        OP_LDR,    // Load register.
+        OP_STR,    // Store register.
+        OP_RTI,    // Return from interrupt (not currently implemented).
+        OP_NOT,    // Bitwise not.
+        OP_LDI,    // Load indirect.
+        OP_STI,    // Store indirect.
+        OP_JMP,    // Jump.
+        OP_RES,    // Reserved (unused).
+        OP_LEA,    // Load effective address.
+        OP_TRAP    // Invoke a trap.
+    };
+
+    /// \brief Sign-extends the low bitCount bits of x to 16 bits.
+    constexpr uint16_t SignExtend(uint16_t x, int bitCount)
+    {
+        if ((x >> (bitCount - 1)) & 1)
+        {
+            x |= (0xffff << bitCount);
+        }
+        return x;
+    }
+
+    // Instruction fields.
+
+    constexpr bool IsImmediate(const uint16_t instr) { return (instr >> 5) & 0x1; }
+    constexpr bool IsLong(const uint16_t instr) { return (instr >> 11) & 1; }
+    constexpr uint16_t Cond(const uint16_t instr) { return (instr >> 9) & 0x7; }
+    constexpr uint16_t Dr(const uint16_t instr) { return (instr >> 9) & 0x7; }
+    constexpr uint16_t Sr1(const uint16_t instr) { return (instr >> 6) & 0x7; }
+    constexpr uint16_t Sr2(const uint16_t instr) { return instr & 0x7; }
+    constexpr uint16_t Sr(const uint16_t instr) { return (instr >> 9) & 0x7; }
+    constexpr uint16_t BaseR(const uint16_t instr) { return (instr >> 6) & 0x7; }
+    constexpr uint16_t Imm5(const uint16_t instr) { return SignExtend(instr & 0x1F, 5); }
+    constexpr uint16_t Offset6(const uint16_t instr) { return SignExtend(instr & 0x3F, 6); }
+    constexpr uint16_t PcOffset9(const uint16_t instr) { return SignExtend(instr & 0x1FF, 9); }
+    constexpr uint16_t PcOffset11(const uint16_t instr) { return SignExtend(instr & 0x7FF, 11); }
+
+    /// \brief Decodes an instruction into a micro-op.
+    /// \param address the address that the instruction was fetched from.
+    /// \param instr the instruction to decode.
+    /// \return the decoded instruction.
+    constexpr Decoded Decode(const uint16_t address, const uint16_t instr)
+    {
+        const uint16_t pc = address + 1;
+        const auto dr = static_cast<uint8_t>(Dr(instr));
+        const auto sr1 = static_cast<uint8_t>(Sr1(instr));
+        const auto sr2 = static_cast<uint8_t>(Sr2(instr));
+
+        switch (instr >> 12)
+        {
+        case OP_ADD:
+            return IsImmediate(instr) ? Decoded{UOP_ADD_IMM, dr, sr1, 0, Imm5(instr)}
+                                      : Decoded{UOP_ADD_REG, dr, sr1, sr2, 0};
+
+        case OP_AND:
+            return IsImmediate(instr) ? Decoded{UOP_AND_IMM, dr, sr1, 0, Imm5(instr)}
+                                      : Decoded{UOP_AND_REG, dr, sr1, sr2, 0};
+
+        case OP_NOT:
+            return Decoded{UOP_NOT, dr, sr1, 0, 0};
+
+        case OP_BR:
+        {
+            const auto cond = static_cast<uint8_t>(Cond(instr));
+            const auto target = static_cast<uint16_t>(pc + PcOffset9(instr));
+            return cond == 0 ? Decoded{UOP_BRA, 0, 0, 0, target} : Decoded{UOP_BR, cond, 0, 0, target};
+        }
+
+        case OP_JMP:
+            return Decoded{UOP_JMP, 0, static_cast<uint8_t>(BaseR(instr)), 0, 0};
+
+        case OP_JSR:
+            return IsLong(instr) ? Decoded{UOP_JSR, 0, 0, 0, static_cast<uint16_t>(pc + PcOffset11(instr))}
+                                 : Decoded{UOP_JSRR, 0, static_cast<uint8_t>(BaseR(instr)), 0, 0};
+
+        case OP_LD:
+            return Decoded{UOP_LD, dr, 0, 0, static_cast<uint16_t>(pc + PcOffset9(instr))};
+
+        case OP_LDI:
+            return Decoded{UOP_LDI, dr, 0, 0, static_cast<uint16_t>(pc + PcOffset9(instr))};
+
+        case OP_LDR:
+            return Decoded{UOP_LDR, dr, static_cast<uint8_t>(BaseR(instr)), 0, Offset6(instr)};
+
+        case OP_LEA:
+            return Decoded{UOP_LEA, dr, 0, 0, static_cast<uint16_t>(pc + PcOffset9(instr))};
+
+        case OP_ST:
+            return Decoded{UOP_ST, static_cast<uint8_t>(Sr(instr)), 0, 0, static_cast<uint16_t>(pc + PcOffset9(instr))};
+
+        case OP_STI:
+            return Decoded{UOP_STI, static_cast<uint8_t>(Sr(instr)), 0, 0, static_cast<uint16_t>(pc + PcOffset9(instr))};
+
+        case OP_STR:
+            return Decoded{UOP_STR, static_cast<uint8_t>(Sr(instr)), static_cast<uint8_t>(BaseR(instr)), 0, Offset6(instr)};
+
+        case OP_TRAP:
+            return Decoded{UOP_TRAP, 0, 0, 0, instr};
+
+        case OP_RES:
+        case OP_RTI:
+        default:
+            return Decoded{UOP_STOP, 0, 0, 0, 0};
+        }
+    }
+
+    /// \brief The LC3 opcode that each micro-op was decoded from, indexed by micro-op.
+    constexpr uint8_t OPCODES[UOP_COUNT] = {
+            0,  // UOP_DECODE
+            1,  // UOP_ADD_REG
+            1,  // UOP_ADD_IMM
+            5,  // UOP_AND_REG
+            5,  // UOP_AND_IMM
+            9,  // UOP_NOT
+            0,  // UOP_BR
+            0,  // UOP_BRA
+            12, // UOP_JMP
+            4,  // UOP_JSR
+            4,  // UOP_JSRR
+            2,  // UOP_LD
+            10, // UOP_LDI
+            6,  // UOP_LDR
+            14, // UOP_LEA
+            3,  // UOP_ST
+            11, // UOP_STI
+            7,  // UOP_STR
+            15, // UOP_TRAP
+            8,  // UOP_STOP, which is RTI or the reserved opcode.
+            5,  // UOP_CONST, from the opcode of the first instruction of the pair.
+            1,  // UOP_PUSH
+            6,  // UOP_POP
+            1,  // UOP_ADD_IMM_BR
+            1,  // UOP_ADD_REG_BR
+    };
+
+    /// \brief Predecoded instructions for the whole address space, indexed by address, in memory that is only mapped
+    /// once something is decoded.
+    ///
+    /// The table is mapped straight from the host, whose zero pages are already UOP_DECODE, so the host only gives it
+    /// memory a page at a time as instructions on that page are decoded, and a VM only pays for the code that it runs
+    /// rather than for 65536 entries up front. Until something is decoded, the table reads from a blank table that
+    /// every VM shares, so looking up an instruction never has to check.
+    class DecodedTable
+    {
+    public:
+        static constexpr size_t SIZE = 65536; // Entries in the table, one for each address.
+
+        DecodedTable() = default;
+        DecodedTable(const DecodedTable& other) { *this = other; }
+        DecodedTable& operator=(const DecodedTable& other)
+        {
+            if (this != &other)
+            {
+                Release();
+                if (other.data_ && Allocate())
+                {
+                    std::memcpy(data_, other.data_, BYTES);
+                }
+            }
+            return *this;
+        }
+        ~DecodedTable() { Release(); }
+
+        /// \brief Returns the entry for the given address, whose micro-op is UOP_DECODE if it hasn't been decoded.
+        const Decoded& operator[](const uint16_t address) const { return table_[address]; }
+
+        /// \brief Returns the entry for the given address for writing, mapping the table if it hasn't been. If the host
+        /// has no memory to give, the entry is a scratch one that the next lookup won't see, so nothing is cached.
+        Decoded& Writable(const uint16_t address) { return data_ || Allocate() ? data_[address] : scratch_; }
+
+        /// \brief Forgets the instruction decoded at the given address, if there is one.
+        void Invalidate(const uint16_t address)
+        {
+            if (data_)
+            {
+                data_[address].uop = UOP_DECODE;
+            }
+        }
+
+        /// \brief Forgets every instruction that has been decoded, giving the table's memory back to the host.
+        void InvalidateAll() { Release(); }
+
+    private:
+        static constexpr size_t BYTES = SIZE * sizeof(Decoded);
+
+        static const Decoded* Blank()
+        {
+            // Zero-initialized, so it costs no space in the executable, and the host maps it lazily like the rest.
+            static Decoded blank[SIZE];
+            return blank;
+        }
+
+        bool Allocate()
+        {
+#if defined(_WIN32)
+            data_ = static_cast<Decoded*>(VirtualAlloc(nullptr, BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+            void* p = mmap(nullptr, BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            data_ = p == MAP_FAILED ? nullptr : static_cast<Decoded*>(p);
+#endif
+            table_ = data_ ? data_ : Blank();
+            return data_ != nullptr;
+        }
+
+        void Release()
+        {
+            if (data_)
+            {
+#if defined(_WIN32)
+                VirtualFree(data_, 0, MEM_RELEASE);
+#else
+                munmap(data_, BYTES);
+#endif
+                data_ = nullptr;
+            }
+            table_ = Blank();
+        }
+
+        const Decoded* table_{Blank()}; // The entries that lookups read: data_, or Blank() if it isn't mapped.
+        Decoded* data_{nullptr};        // The table's own entries, once they are mapped.
+        Decoded scratch_{};             // Written instead of the table if it couldn't be mapped.
+    };
+
+    /// \brief Returns true if the micro-op transfers control, i.e., it ends a basic block.
+    constexpr bool EndsBlock(const uint8_t uop)
+    {
+        return uop == UOP_BR || uop == UOP_BRA || uop == UOP_JMP || uop == UOP_JSR || uop == UOP_JSRR
+                || uop == UOP_TRAP || uop == UOP_STOP || uop == UOP_ADD_IMM_BR || uop == UOP_ADD_REG_BR;
+    }
+
+    /// \brief Returns true if the micro-op is a superinstruction, fused from two instructions.
+    constexpr bool IsFused(const uint8_t uop) { return uop > UOP_STOP; }
+
+    /// \brief Returns the number of instructions that the micro-op retires.
+    constexpr int Retires(const uint8_t uop) { return IsFused(uop) ? 2 : 1; }
+
+    constexpr uint16_t IO_BASE = 0xFE00; // Start of the memory-mapped I/O region.
+
+    // The value held in place of the last flag-setting result when there hasn't been one since reset. It is outside
+    // the 16-bit range so that it can't be confused with a real result.
+    constexpr uint32_t NO_FLAGS = 0x10000;
+} // namespace lc3
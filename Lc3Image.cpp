@@ -0,0 +1,281 @@
+#include "Lc3Image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LC3_SWAP_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define LC3_SWAP_NEON
+#endif
+
+namespace lc3
+{
+    namespace
+    {
+        /// \brief A file mapped into memory copy-on-write, so that writes to the mapping never reach the file.
+        class MappedFile
+        {
+        public:
+            MappedFile() = default;
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+            ~MappedFile() { Unmap(); }
+
+            bool Map(const char* filename);
+
+            uint8_t* Data() const { return data_; }
+            size_t Size() const { return size_; }
+
+        private:
+            void Unmap();
+
+            uint8_t* data_{nullptr};
+            size_t size_{0};
+        };
+
+#if defined(_WIN32)
+        bool MappedFile::Map(const char* filename)
+        {
+            HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                return false;
+            }
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+            {
+                CloseHandle(file);
+                return false;
+            }
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (!mapping)
+            {
+                return false;
+            }
+            data_ = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+            CloseHandle(mapping);
+            if (!data_)
+            {
+                return false;
+            }
+            size_ = static_cast<size_t>(size.QuadPart);
+            return true;
+        }
+
+        void MappedFile::Unmap()
+        {
+            if (data_)
+            {
+                UnmapViewOfFile(data_);
+            }
+        }
+#else
+        bool MappedFile::Map(const char* filename)
+        {
+            const int fd = open(filename, O_RDONLY);
+            if (fd < 0)
+            {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0)
+            {
+                close(fd);
+                return false;
+            }
+            void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED)
+            {
+                return false;
+            }
+            data_ = static_cast<uint8_t*>(data);
+            size_ = static_cast<size_t>(st.st_size);
+            return true;
+        }
+
+        void MappedFile::Unmap()
+        {
+            if (data_)
+            {
+                munmap(data_, size_);
+            }
+        }
+#endif
+
+        uint16_t Swap16(uint16_t x) { return static_cast<uint16_t>((x << 8) | (x >> 8)); }
+
+        /// \brief Loads an image cache, sharing its pages with the mapping.
+        bool LoadImageCache(const std::shared_ptr<MappedFile>& file, PagedMemory& mem)
+        {
+            ImageCacheHeader header;
+            std::memcpy(&header, file->Data(), sizeof(header));
+            constexpr size_t pageBytes = sizeof(PagedMemory::Page);
+            if (header.version != IMAGE_CACHE_VERSION
+                || header.firstPage + size_t{header.pageCount} > PagedMemory::PAGE_COUNT
+                || file->Size() != IMAGE_CACHE_DATA_OFFSET + header.pageCount * pageBytes)
+            {
+                return false;
+            }
+            uint8_t* data = file->Data() + IMAGE_CACHE_DATA_OFFSET;
+            if (Fnv1a(data, header.pageCount * pageBytes) != header.dataHash)
+            {
+                return false;
+            }
+
+            // Each page shares ownership of the mapping, so it stays mapped for as long as any VM uses one of its pages.
+            for (size_t i = 0; i < header.pageCount; ++i)
+            {
+                auto page = reinterpret_cast<PagedMemory::Page*>(data + i * pageBytes);
+                mem.SetPage(header.firstPage + i, std::shared_ptr<PagedMemory::Page>(file, page));
+            }
+            return true;
+        }
+
+        /// \brief Loads an object file, converting it to host byte order as it is copied into memory.
+        bool LoadObject(const MappedFile& file, PagedMemory& mem)
+        {
+            if (file.Size() < sizeof(uint16_t))
+            {
+                return false;
+            }
+            const auto words = reinterpret_cast<const uint16_t*>(file.Data());
+            const uint16_t origin = Swap16(words[0]);
+
+            // Read no more than fits above the origin, as the stdio loader does.
+            const size_t count = std::min<size_t>(file.Size() / sizeof(uint16_t) - 1, UINT16_MAX - origin);
+            constexpr size_t PAGE_SIZE = PagedMemory::PAGE_SIZE;
+            size_t address = origin;
+            for (size_t i = 0; i < count;)
+            {
+                const size_t offset = address % PAGE_SIZE;
+                const size_t n = std::min(PAGE_SIZE - offset, count - i);
+                SwapWords(mem.WritablePage(address / PAGE_SIZE).data() + offset, words + 1 + i, n);
+                i += n;
+                address += n;
+            }
+            return true;
+        }
+    } // namespace
+
+    void SwapWords(uint16_t* dst, const uint16_t* src, size_t count)
+    {
+        size_t i = 0;
+#if defined(LC3_SWAP_SSE2)
+        // SSE2 has no byte shuffle, but swapping the bytes of every 16-bit lane is just two shifts and an or.
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+        }
+#elif defined(LC3_SWAP_NEON)
+        for (; i + 8 <= count; i += 8)
+        {
+            const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(src + i));
+            vst1q_u8(reinterpret_cast<uint8_t*>(dst + i), vrev16q_u8(v));
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            dst[i] = Swap16(src[i]);
+        }
+    }
+
+    uint64_t Fnv1a(const void* data, size_t size)
+    {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (auto p = static_cast<const uint8_t*>(data), end = p + size; p != end; ++p)
+        {
+            hash = (hash ^ *p) * 0x100000001b3;
+        }
+        return hash;
+    }
+
+    bool LoadImage(const char* filename, PagedMemory& mem)
+    {
+        auto file = std::make_shared<MappedFile>();
+        if (!file->Map(filename))
+        {
+            return false;
+        }
+
+        // An image cache is told apart by its magic number. An object file could start with the same four bytes, but
+        // it won't also pass the cache's checks, so anything that fails them is loaded as an object file instead.
+        if (file->Size() >= IMAGE_CACHE_DATA_OFFSET)
+        {
+            uint32_t magic;
+            std::memcpy(&magic, file->Data(), sizeof(magic));
+            if (magic == IMAGE_CACHE_MAGIC && LoadImageCache(file, mem))
+            {
+                return true;
+            }
+        }
+        return LoadObject(*file, mem);
+    }
+
+    bool WriteImageCache(const char* objFilename, const char* cacheFilename)
+    {
+        MappedFile obj;
+        if (!obj.Map(objFilename))
+        {
+            return false;
+        }
+        PagedMemory mem;
+        if (!LoadObject(obj, mem))
+        {
+            return false;
+        }
+
+        ImageCacheHeader header{};
+        header.magic = IMAGE_CACHE_MAGIC;
+        header.version = IMAGE_CACHE_VERSION;
+        header.origin = Swap16(reinterpret_cast<const uint16_t*>(obj.Data())[0]);
+        header.size = static_cast<uint32_t>(std::min<size_t>(obj.Size() / sizeof(uint16_t) - 1, UINT16_MAX - header.origin));
+
+        // Keep every page that the image touches, including any zeros either side of it in its first and last pages.
+        constexpr size_t PAGE_SIZE = PagedMemory::PAGE_SIZE;
+        const size_t end = header.origin + std::max<size_t>(header.size, 1) - 1;
+        header.firstPage = static_cast<uint16_t>(header.origin / PAGE_SIZE);
+        header.pageCount = static_cast<uint16_t>(end / PAGE_SIZE - header.firstPage + 1);
+
+        std::vector<uint16_t> data;
+        data.reserve(header.pageCount * PAGE_SIZE);
+        for (size_t i = 0; i < header.pageCount; ++i)
+        {
+            const auto& page = mem.GetPage(header.firstPage + i);
+            data.insert(data.end(), page.begin(), page.end());
+        }
+        header.dataHash = Fnv1a(data.data(), data.size() * sizeof(uint16_t));
+
+        FILE* file = fopen(cacheFilename, "wb");
+        if (!file)
+        {
+            return false;
+        }
+        std::vector<uint8_t> headerBlock(IMAGE_CACHE_DATA_OFFSET, 0);
+        std::memcpy(headerBlock.data(), &header, sizeof(header));
+        bool ok = fwrite(headerBlock.data(), 1, headerBlock.size(), file) == headerBlock.size();
+        ok = ok && fwrite(data.data(), sizeof(uint16_t), data.size(), file) == data.size();
+        ok = fclose(file) == 0 && ok;
+        return ok;
+    }
+} // namespace lc3
@@ -0,0 +1,59 @@
+/// Loading program images into paged VM memory.
+///
+/// Two formats are understood. An LC3 object file is a big-endian origin followed by big-endian words. An image cache
+/// is the same program already converted to host byte order and laid out in whole pages after a header, so that it
+/// can be mapped straight into PagedMemory with no conversion and no copy.
+
+#pragma once
+
+#include "Lc3Memory.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace lc3
+{
+    constexpr uint32_t IMAGE_CACHE_MAGIC = 0x4933434C; // "LC3I" when written by a little-endian host.
+    constexpr uint16_t IMAGE_CACHE_VERSION = 2;
+
+    /// \brief The header at the start of an image cache file. Page data follows at IMAGE_CACHE_DATA_OFFSET.
+    ///
+    /// Everything is in host byte order, so a cache written on a host of the other endianness fails the magic check.
+    struct ImageCacheHeader
+    {
+        uint32_t magic;     // IMAGE_CACHE_MAGIC.
+        uint16_t version;   // IMAGE_CACHE_VERSION.
+        uint16_t firstPage; // The first page of VM memory held in the file.
+        uint16_t pageCount; // The number of pages held in the file.
+        uint16_t origin;    // The origin of the source image.
+        uint32_t size;      // The number of words in the source image.
+        uint64_t dataHash;  // FNV-1a hash of the page data, to tell whether the cache is intact.
+    };
+
+    // Page data starts a whole page in, so that pages mapped from the file are suitably aligned.
+    constexpr size_t IMAGE_CACHE_DATA_OFFSET = PagedMemory::PAGE_SIZE * sizeof(uint16_t);
+
+    /// \brief Converts big-endian words to host order, using SIMD where it is available.
+    /// \param dst where to write the converted words.
+    /// \param src the big-endian words. Can be the same as dst.
+    /// \param count the number of words.
+    void SwapWords(uint16_t* dst, const uint16_t* src, size_t count);
+
+    /// \brief Returns the 64-bit FNV-1a hash of the given bytes.
+    uint64_t Fnv1a(const void* data, size_t size);
+
+    /// \brief Loads an object file or image cache by mapping it into memory.
+    ///
+    /// An image cache replaces whole pages of memory with pages that are mapped from the file, and shared with it until
+    /// they are written. An object file is mapped and converted into memory a page at a time.
+    /// \param filename the name of the file to load.
+    /// \param mem the memory to load it into.
+    /// \return true if the file was loaded, false if it couldn't be read or is not a valid image.
+    bool LoadImage(const char* filename, PagedMemory& mem);
+
+    /// \brief Converts an object file into an image cache.
+    /// \param objFilename the name of the object file.
+    /// \param cacheFilename the name of the image cache to write.
+    /// \return true if the cache was written.
+    bool WriteImageCache(const char* objFilename, const char* cacheFilename);
+} // namespace lc3
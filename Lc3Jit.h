@@ -0,0 +1,994 @@
+/// A basic-block JIT compiler for the LC3 virtual machine.
+///
+/// Only x86-64 hosts are supported. Elsewhere Jit::supported is false and Lc3Core falls back to its interpreter.
+
+#pragma once
+
+#include "Lc3Decode.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#if !defined(LC3_NO_JIT) && (defined(__x86_64__) || defined(_M_X64))
+#define LC3_JIT_X64
+#endif
+
+#if defined(LC3_JIT_X64)
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace lc3
+{
+#if defined(LC3_JIT_X64)
+    /// \brief A buffer of host memory that is either writable or executable, but never both at once.
+    ///
+    /// Memory is only reserved when the buffer is first written to. Copies start out empty because compiled code can
+    /// refer to its owner.
+    class CodeBuffer
+    {
+    public:
+        explicit CodeBuffer(size_t size) : size_{size} {}
+        CodeBuffer(const CodeBuffer& other) : size_{other.size_} {}
+        CodeBuffer& operator=(const CodeBuffer&) { return *this; }
+        ~CodeBuffer() { Release(); }
+
+        size_t Size() const { return size_; }
+
+        /// \brief Copies code into the buffer and makes it executable.
+        /// \param offset where to place the code.
+        /// \param code the code to copy.
+        /// \param length the length of the code in bytes.
+        /// \return the address of the code in the buffer, or nullptr if the buffer could not be written.
+        const uint8_t* Write(size_t offset, const uint8_t* code, size_t length)
+        {
+            if (offset + length > size_ || !Allocate() || !Protect(false))
+            {
+                return nullptr;
+            }
+            std::memcpy(data_ + offset, code, length);
+            return Protect(true) ? data_ + offset : nullptr;
+        }
+
+    private:
+        bool Allocate()
+        {
+            if (!data_)
+            {
+#if defined(_WIN32)
+                data_ = static_cast<uint8_t*>(VirtualAlloc(nullptr, size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+                void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                data_ = p == MAP_FAILED ? nullptr : static_cast<uint8_t*>(p);
+#endif
+            }
+            return data_ != nullptr;
+        }
+
+        bool Protect(bool executable)
+        {
+#if defined(_WIN32)
+            DWORD old;
+            const bool ok = VirtualProtect(data_, size_, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old) != 0;
+            if (ok && executable)
+            {
+                FlushInstructionCache(GetCurrentProcess(), data_, size_);
+            }
+            return ok;
+#else
+            return mprotect(data_, size_, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+#endif
+        }
+
+        void Release()
+        {
+            if (data_)
+            {
+#if defined(_WIN32)
+                VirtualFree(data_, 0, MEM_RELEASE);
+#else
+                munmap(data_, size_);
+#endif
+                data_ = nullptr;
+            }
+        }
+
+        uint8_t* data_{nullptr};
+        size_t size_;
+    };
+
+    /// \brief Just enough of an x86-64 assembler to compile LC3 basic blocks.
+    class X64Assembler
+    {
+    public:
+        enum Reg : uint8_t
+        {
+            RAX,
+            RCX,
+            RDX,
+            RBX,
+            RSP,
+            RBP,
+            RSI,
+            RDI,
+            R8,
+            R9,
+            R10,
+            R11,
+            R12,
+            R13,
+            R14,
+            R15
+        };
+
+        enum Cond : uint8_t
+        {
+            CC_B = 0x2,  // Below (unsigned).
+            CC_AE = 0x3, // Above or equal (unsigned).
+            CC_Z = 0x4,  // Zero.
+            CC_NZ = 0x5, // Not zero.
+            CC_S = 0x8   // Sign.
+        };
+
+        const std::vector<uint8_t>& Code() const { return code_; }
+        size_t Size() const { return code_.size(); }
+
+        // 16-bit operations on LC3 registers.
+
+        void Add16(Reg dst, Reg src) { Op16(0x01, src, dst); }
+        void And16(Reg dst, Reg src) { Op16(0x21, src, dst); }
+        void Mov16(Reg dst, Reg src) { Op16(0x89, src, dst); }
+        void Test16(Reg reg) { Op16(0x85, reg, reg); }
+
+        void Add16(Reg dst, uint16_t imm) { OpImm16(0, dst, imm); }
+        void And16(Reg dst, uint16_t imm) { OpImm16(4, dst, imm); }
+
+        void Not16(Reg dst)
+        {
+            Emit(0x66);
+            Rex(false, 0, dst);
+            Emit(0xF7);
+            ModRm(2, dst);
+        }
+
+        void Mov16(Reg dst, uint16_t imm)
+        {
+            Emit(0x66);
+            Rex(false, 0, dst);
+            Emit(0xB8 + (dst & 7));
+            Emit16(imm);
+        }
+
+        /// \brief movzx dst, word [base + disp]
+        void Load16(Reg dst, Reg base, int32_t disp)
+        {
+            Rex(false, dst, base);
+            Emit(0x0F);
+            Emit(0xB7);
+            Mem(dst, base, disp);
+        }
+
+        /// \brief mov word [base + disp], src
+        void Store16(Reg base, int32_t disp, Reg src)
+        {
+            Emit(0x66);
+            Rex(false, src, base);
+            Emit(0x89);
+            Mem(src, base, disp);
+        }
+
+        /// \brief mov word [base + disp], imm
+        void Store16(Reg base, int32_t disp, uint16_t imm)
+        {
+            Emit(0x66);
+            Rex(false, 0, base);
+            Emit(0xC7);
+            Mem(0, base, disp);
+            Emit16(imm);
+        }
+
+        /// \brief movzx dst, src
+        void Movzx16(Reg dst, Reg src)
+        {
+            Rex(false, dst, src);
+            Emit(0x0F);
+            Emit(0xB7);
+            ModRm(dst, src);
+        }
+
+        // 32-bit operations.
+
+        void Mov32(Reg dst, uint32_t imm)
+        {
+            Rex(false, 0, dst);
+            Emit(0xB8 + (dst & 7));
+            Emit32(imm);
+        }
+
+        void Add32(Reg dst, uint32_t imm)
+        {
+            Rex(false, 0, dst);
+            Emit(0x81);
+            ModRm(0, dst);
+            Emit32(imm);
+        }
+
+        void Cmov32(Cond cc, Reg dst, Reg src)
+        {
+            Rex(false, dst, src);
+            Emit(0x0F);
+            Emit(0x40 + cc);
+            ModRm(dst, src);
+        }
+
+        void Test32(Reg reg, Reg other)
+        {
+            Rex(false, other, reg);
+            Emit(0x85);
+            ModRm(other, reg);
+        }
+
+        void Test32(Reg reg, uint32_t imm)
+        {
+            Rex(false, 0, reg);
+            Emit(0xF7);
+            ModRm(0, reg);
+            Emit32(imm);
+        }
+
+        void Load32(Reg dst, Reg base, int32_t disp)
+        {
+            Rex(false, dst, base);
+            Emit(0x8B);
+            Mem(dst, base, disp);
+        }
+
+        void Store32(Reg base, int32_t disp, Reg src)
+        {
+            Rex(false, src, base);
+            Emit(0x89);
+            Mem(src, base, disp);
+        }
+
+        void Store32(Reg base, int32_t disp, uint32_t imm)
+        {
+            Rex(false, 0, base);
+            Emit(0xC7);
+            Mem(0, base, disp);
+            Emit32(imm);
+        }
+
+        void Add32(Reg base, int32_t disp, uint32_t imm)
+        {
+            Rex(false, 0, base);
+            Emit(0x81);
+            Mem(0, base, disp);
+            Emit32(imm);
+        }
+
+        void And32(Reg base, int32_t disp, uint32_t imm)
+        {
+            Rex(false, 0, base);
+            Emit(0x81);
+            Mem(4, base, disp);
+            Emit32(imm);
+        }
+
+        void Or32(Reg dst, Reg base, int32_t disp)
+        {
+            Rex(false, dst, base);
+            Emit(0x0B);
+            Mem(dst, base, disp);
+        }
+
+        void Cmp32(Reg reg, uint32_t imm)
+        {
+            Rex(false, 0, reg);
+            Emit(0x81);
+            ModRm(7, reg);
+            Emit32(imm);
+        }
+
+        void Cmp32(Reg reg, Reg base, int32_t disp)
+        {
+            Rex(false, reg, base);
+            Emit(0x3B);
+            Mem(reg, base, disp);
+        }
+
+        // 64-bit operations.
+
+        void Mov64(Reg dst, Reg src)
+        {
+            Rex(true, src, dst);
+            Emit(0x89);
+            ModRm(src, dst);
+        }
+
+        void Mov64(Reg dst, uint64_t imm)
+        {
+            Rex(true, 0, dst);
+            Emit(0xB8 + (dst & 7));
+            Emit32(static_cast<uint32_t>(imm));
+            Emit32(static_cast<uint32_t>(imm >> 32));
+        }
+
+        void Add64(Reg dst, int8_t imm)
+        {
+            Rex(true, 0, dst);
+            Emit(0x83);
+            ModRm(0, dst);
+            Emit(static_cast<uint8_t>(imm));
+        }
+
+        void Sub64(Reg dst, int8_t imm)
+        {
+            Rex(true, 0, dst);
+            Emit(0x83);
+            ModRm(5, dst);
+            Emit(static_cast<uint8_t>(imm));
+        }
+
+        void Push(Reg reg)
+        {
+            Rex(false, 0, reg);
+            Emit(0x50 + (reg & 7));
+        }
+
+        void Pop(Reg reg)
+        {
+            Rex(false, 0, reg);
+            Emit(0x58 + (reg & 7));
+        }
+
+        void Call(Reg reg)
+        {
+            Rex(false, 0, reg);
+            Emit(0xFF);
+            ModRm(2, reg);
+        }
+
+        void Ret() { Emit(0xC3); }
+
+        // Control flow. Forward jumps return the position of their displacement, which is patched by Bind().
+
+        size_t Jcc(Cond cc)
+        {
+            Emit(0x0F);
+            Emit(0x80 + cc);
+            return Placeholder();
+        }
+
+        void Jcc(Cond cc, size_t target)
+        {
+            Emit(0x0F);
+            Emit(0x80 + cc);
+            Emit32(static_cast<uint32_t>(target - (Size() + 4)));
+        }
+
+        size_t Jmp()
+        {
+            Emit(0xE9);
+            return Placeholder();
+        }
+
+        /// \brief Points a forward jump at the current position.
+        void Bind(size_t patch)
+        {
+            const auto rel = static_cast<uint32_t>(Size() - (patch + 4));
+            std::memcpy(&code_[patch], &rel, sizeof(rel));
+        }
+
+    private:
+        void Emit(uint8_t byte) { code_.push_back(byte); }
+        void Emit16(uint16_t word)
+        {
+            Emit(static_cast<uint8_t>(word));
+            Emit(static_cast<uint8_t>(word >> 8));
+        }
+        void Emit32(uint32_t dword)
+        {
+            Emit16(static_cast<uint16_t>(dword));
+            Emit16(static_cast<uint16_t>(dword >> 16));
+        }
+
+        size_t Placeholder()
+        {
+            Emit32(0);
+            return Size() - 4;
+        }
+
+        void Rex(bool w, uint8_t reg, uint8_t rm)
+        {
+            const uint8_t rex = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+            if (rex != 0x40)
+            {
+                Emit(rex);
+            }
+        }
+
+        void ModRm(uint8_t reg, uint8_t rm) { Emit(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+        void Mem(uint8_t reg, uint8_t base, int32_t disp)
+        {
+            const bool small = disp >= -128 && disp <= 127;
+            Emit((small ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+            if ((base & 7) == RSP)
+            {
+                Emit(0x24); // SIB with no index.
+            }
+            if (small)
+            {
+                Emit(static_cast<uint8_t>(disp));
+            }
+            else
+            {
+                Emit32(static_cast<uint32_t>(disp));
+            }
+        }
+
+        void Op16(uint8_t opcode, uint8_t reg, uint8_t rm)
+        {
+            Emit(0x66);
+            Rex(false, reg, rm);
+            Emit(opcode);
+            ModRm(reg, rm);
+        }
+
+        void OpImm16(uint8_t ext, uint8_t rm, uint16_t imm)
+        {
+            Emit(0x66);
+            Rex(false, 0, rm);
+            Emit(0x81);
+            ModRm(ext, rm);
+            Emit16(imm);
+        }
+
+        std::vector<uint8_t> code_;
+    };
+#endif
+
+    /// \brief Compiles LC3 basic blocks to host code and caches them by start address.
+    ///
+    /// A compiled block is called with the core and an instruction budget. It keeps the LC3 registers and condition
+    /// flags in host registers, writes them back along with PC when it exits, and returns the number of instructions it
+    /// retired. A block that branches back to its own start keeps looping until it has used up its budget.
+    ///
+    /// Memory is accessed through the read and write callbacks in the Layout. A read callback sets JIT_EXIT in its
+    /// result, and a write callback returns non-zero, to make the block exit after the current instruction, e.g., after
+    /// touching a device register or overwriting compiled code.
+    class Jit
+    {
+    public:
+#if defined(LC3_JIT_X64)
+        static constexpr bool supported = true;
+#else
+        static constexpr bool supported = false;
+#endif
+
+        using Block = uint32_t (*)(void* core, uint32_t budget);
+        using ReadFn = uint32_t (*)(void* core, uint32_t address);
+        using WriteFn = uint32_t (*)(void* core, uint32_t address, uint32_t val);
+
+        static constexpr uint32_t JIT_EXIT = 0x10000;
+        static constexpr size_t MAX_BLOCK = 64;   // Maximum number of instructions in a block.
+        static constexpr uint8_t HOT = 16;        // Number of times a block is entered before it is compiled.
+        static constexpr uint8_t NEVER = 0xFF;    // Marks block starts that can't be compiled.
+        static constexpr size_t CODE_SIZE = 1 << 20;
+
+        static constexpr size_t PAGE_SIZE = 256;                // Addresses per page of the tables, as in PagedMemory.
+        static constexpr size_t PAGE_COUNT = 65536 / PAGE_SIZE; // Pages in the address space.
+
+        Jit() = default;
+
+        // Compiled code belongs to the core that it was compiled for, so copies start with an empty cache.
+        Jit(const Jit&) {}
+        Jit& operator=(const Jit&)
+        {
+            Clear();
+            return *this;
+        }
+
+        /// \brief Where the compiled code finds the VM state, as byte offsets from the core pointer.
+        struct Layout
+        {
+            ptrdiff_t reg;
+            ptrdiff_t pc;
+            ptrdiff_t cond;
+            ReadFn read;
+            WriteFn write;
+        };
+
+        /// \brief Returns the compiled block that starts at the given address, or nullptr if there isn't one.
+        Block Lookup(uint16_t address) const
+        {
+            const auto& page = pages_[address / PAGE_SIZE];
+            return page ? page->entries[address % PAGE_SIZE] : nullptr;
+        }
+
+        /// \brief Notes that the interpreter entered a block at the given address.
+        /// \return true if the block is now hot enough to compile.
+        bool IsHot(uint16_t address)
+        {
+            uint8_t& heat = WritablePage(address).heat[address % PAGE_SIZE];
+            if (heat == NEVER)
+            {
+                return false;
+            }
+            return ++heat >= HOT;
+        }
+
+        /// \brief Returns true if the address holds an instruction of a compiled block.
+        bool Covers(uint16_t address) const
+        {
+            const auto& page = pages_[address / PAGE_SIZE];
+            return page && page->covered[address % PAGE_SIZE] != 0;
+        }
+
+        /// \brief Discards any compiled blocks that contain the given address.
+        /// \return true if any blocks were discarded.
+        bool Invalidate(uint16_t address)
+        {
+            if (!Covers(address))
+            {
+                return false;
+            }
+
+            uint16_t low = address;
+            uint16_t high = address;
+            auto stale = [address](const BlockInfo& b) { return b.start <= address && address <= b.end; };
+            for (const auto& b : blocks_)
+            {
+                if (stale(b))
+                {
+                    Page& page = *pages_[b.start / PAGE_SIZE];
+                    page.entries[b.start % PAGE_SIZE] = nullptr;
+                    page.heat[b.start % PAGE_SIZE] = 0;
+                    low = std::min(low, b.start);
+                    high = std::max(high, b.end);
+                }
+            }
+            blocks_.erase(std::remove_if(blocks_.begin(), blocks_.end(), stale), blocks_.end());
+
+            // Recompute coverage for the affected range from the blocks that remain.
+            SetCovered(low, high, 0);
+            for (const auto& b : blocks_)
+            {
+                if (b.start <= high && low <= b.end)
+                {
+                    SetCovered(b.start, b.end, 1);
+                }
+            }
+            return true;
+        }
+
+        /// \brief Discards all compiled blocks.
+        void Clear()
+        {
+            for (auto& page : pages_)
+            {
+                page.reset();
+            }
+            blocks_.clear();
+            used_ = 0;
+        }
+
+        /// \brief Compiles a basic block.
+        /// \param start the address of the first instruction in the block.
+        /// \param code the decoded instructions of the block.
+        /// \param count the number of instructions.
+        /// \param layout where the compiled code finds the VM state.
+        /// \return the compiled block, or nullptr if it couldn't be compiled, in which case it won't be tried again.
+        Block Compile(uint16_t start, const Decoded* code, size_t count, const Layout& layout)
+        {
+            Block block = count > 0 ? Assemble(start, code, count, layout) : nullptr;
+            if (!block)
+            {
+                WritablePage(start).heat[start % PAGE_SIZE] = NEVER;
+            }
+            return block;
+        }
+
+#if defined(LC3_JIT_X64)
+    private:
+        using Reg = X64Assembler::Reg;
+
+        struct BlockInfo
+        {
+            uint16_t start;
+            uint16_t end; // Address of the last instruction.
+        };
+
+        // Host registers for R0-R7. R0-R4 live in registers that are preserved across calls in both the System V and
+        // Windows x64 ABIs. R5-R7 and the condition flags live in volatile registers and are spilled around callbacks.
+        static constexpr Reg kLc3Regs[8] = {Reg::RBP, Reg::R12, Reg::R13, Reg::R14, Reg::R15, Reg::R8, Reg::R9, Reg::R10};
+        static constexpr Reg kCond = Reg::R11;
+        static constexpr Reg kCore = Reg::RBX;
+        static constexpr Reg kScratch = Reg::RCX;
+#if defined(_WIN32)
+        static constexpr Reg kArgs[3] = {Reg::RCX, Reg::RDX, Reg::R8};
+#else
+        static constexpr Reg kArgs[3] = {Reg::RDI, Reg::RSI, Reg::RDX};
+#endif
+
+        // Stack frame. The first 32 bytes are the Windows x64 shadow space for callbacks.
+        static constexpr int8_t kFrameSize = 56;
+        static constexpr int32_t kRetired = 32; // Instructions retired by earlier iterations of a looping block.
+        static constexpr int32_t kBudget = 36;  // The instruction budget passed in.
+        static constexpr int32_t kScratchSlot = 40;
+
+        static constexpr Reg kSaved[6] = {Reg::RBX, Reg::RBP, Reg::R12, Reg::R13, Reg::R14, Reg::R15};
+
+        struct Exit
+        {
+            size_t patch;     // The jump to patch.
+            uint32_t retired; // Instructions retired in this iteration when the exit is taken.
+            uint16_t pc;      // The address of the next instruction.
+        };
+
+        Block Assemble(uint16_t start, const Decoded* code, size_t count, const Layout& layout)
+        {
+            X64Assembler as;
+            std::vector<size_t> toEpilogue;
+            std::vector<Exit> exits;
+
+            auto host = [](uint8_t r) { return kLc3Regs[r & 7]; };
+            auto regAt = [&layout](int r) { return static_cast<int32_t>(layout.reg + 2 * r); };
+            auto pcAt = static_cast<int32_t>(layout.pc);
+            auto condAt = static_cast<int32_t>(layout.cond);
+
+            // Prologue.
+            for (auto reg : kSaved)
+            {
+                as.Push(reg);
+            }
+            as.Sub64(Reg::RSP, kFrameSize);
+            as.Mov64(kCore, kArgs[0]);
+            as.Store32(Reg::RSP, kBudget, kArgs[1]);
+            as.Store32(Reg::RSP, kRetired, 0u);
+            for (int r = 0; r < 8; ++r)
+            {
+                as.Load16(kLc3Regs[r], kCore, regAt(r));
+            }
+            as.Load32(kCond, kCore, condAt);
+            const size_t top = as.Size();
+
+            auto spill = [&]() {
+                for (int r = 5; r < 8; ++r)
+                {
+                    as.Store16(kCore, regAt(r), kLc3Regs[r]);
+                }
+                as.Store32(kCore, condAt, kCond);
+            };
+            auto reload = [&]() {
+                for (int r = 5; r < 8; ++r)
+                {
+                    as.Load16(kLc3Regs[r], kCore, regAt(r));
+                }
+                as.Load32(kCond, kCore, condAt);
+            };
+            auto call = [&](const void* fn) {
+                as.Mov64(kArgs[0], kCore);
+                as.Mov64(Reg::RAX, reinterpret_cast<uint64_t>(fn));
+                as.Call(Reg::RAX);
+            };
+            // Flags are evaluated lazily, so setting them just records the result.
+            auto flags = [&](Reg r) { as.Movzx16(kCond, r); };
+            auto exitWithPc = [&](uint32_t retired, uint16_t pc) {
+                as.Store16(kCore, pcAt, pc);
+                as.Load32(Reg::RAX, Reg::RSP, kRetired);
+                as.Add32(Reg::RAX, retired);
+                toEpilogue.push_back(as.Jmp());
+            };
+            auto exitWithPcIn = [&](uint32_t retired, Reg pc) {
+                as.Store16(kCore, pcAt, pc);
+                as.Load32(Reg::RAX, Reg::RSP, kRetired);
+                as.Add32(Reg::RAX, retired);
+                toEpilogue.push_back(as.Jmp());
+            };
+            auto jumpTo = [&](uint32_t retired, uint16_t target) {
+                if (target != start)
+                {
+                    exitWithPc(retired, target);
+                    return;
+                }
+                // Loop back to the top of the block while there is budget left.
+                as.Add32(Reg::RSP, kRetired, retired);
+                as.Load32(Reg::RAX, Reg::RSP, kRetired);
+                as.Cmp32(Reg::RAX, Reg::RSP, kBudget);
+                as.Jcc(X64Assembler::CC_B, top);
+                as.Store16(kCore, pcAt, start);
+                toEpilogue.push_back(as.Jmp());
+            };
+            auto exitIf = [&](X64Assembler::Cond cc, uint32_t retired, uint16_t pc) {
+                exits.push_back({as.Jcc(cc), retired, pc});
+            };
+            // Loads the 16-bit address reg[base] + offset into the second argument register.
+            auto addressArg = [&](uint8_t base, uint16_t offset) {
+                as.Movzx16(kArgs[1], host(base));
+                as.Add32(kArgs[1], offset);
+                as.Movzx16(kArgs[1], kArgs[1]);
+            };
+
+            bool ended = false;
+            for (size_t i = 0; i < count && !ended; ++i)
+            {
+                const Decoded& d = code[i];
+                const auto retired = static_cast<uint32_t>(i + 1);
+                const auto next = static_cast<uint16_t>(start + i + 1);
+                const Reg dst = host(d.a);
+
+                switch (d.uop)
+                {
+                case UOP_ADD_REG:
+                case UOP_AND_REG:
+                {
+                    const bool isAdd = d.uop == UOP_ADD_REG;
+                    const Reg sr1 = host(d.b);
+                    const Reg sr2 = host(d.c);
+                    const Reg other = dst == sr1 ? sr2 : dst == sr2 ? sr1 : sr2;
+                    if (dst != sr1 && dst != sr2)
+                    {
+                        as.Mov16(dst, sr1);
+                    }
+                    isAdd ? as.Add16(dst, other) : as.And16(dst, other);
+                    flags(dst);
+                    break;
+                }
+
+                case UOP_ADD_IMM:
+                case UOP_AND_IMM:
+                    if (dst != host(d.b))
+                    {
+                        as.Mov16(dst, host(d.b));
+                    }
+                    d.uop == UOP_ADD_IMM ? as.Add16(dst, d.imm) : as.And16(dst, d.imm);
+                    flags(dst);
+                    break;
+
+                case UOP_NOT:
+                    if (dst != host(d.b))
+                    {
+                        as.Mov16(dst, host(d.b));
+                    }
+                    as.Not16(dst);
+                    flags(dst);
+                    break;
+
+                case UOP_LEA:
+                    as.Mov16(dst, d.imm);
+                    flags(dst);
+                    break;
+
+                case UOP_LD:
+                case UOP_LDR:
+                    if (d.uop == UOP_LD)
+                    {
+                        as.Mov32(kArgs[1], d.imm);
+                    }
+                    else
+                    {
+                        addressArg(d.b, d.imm);
+                    }
+                    spill();
+                    call(reinterpret_cast<const void*>(layout.read));
+                    reload();
+                    as.Mov16(dst, Reg::RAX);
+                    flags(dst);
+                    as.Test32(Reg::RAX, JIT_EXIT);
+                    exitIf(X64Assembler::CC_NZ, retired, next);
+                    break;
+
+                case UOP_LDI:
+                    as.Mov32(kArgs[1], d.imm);
+                    spill();
+                    call(reinterpret_cast<const void*>(layout.read));
+                    as.Store32(Reg::RSP, kScratchSlot, Reg::RAX);
+                    as.Movzx16(kArgs[1], Reg::RAX);
+                    call(reinterpret_cast<const void*>(layout.read));
+                    as.And32(Reg::RSP, kScratchSlot, JIT_EXIT);
+                    as.Or32(Reg::RAX, Reg::RSP, kScratchSlot);
+                    reload();
+                    as.Mov16(dst, Reg::RAX);
+                    flags(dst);
+                    as.Test32(Reg::RAX, JIT_EXIT);
+                    exitIf(X64Assembler::CC_NZ, retired, next);
+                    break;
+
+                case UOP_ST:
+                case UOP_STR:
+                    if (d.uop == UOP_ST)
+                    {
+                        as.Mov32(kArgs[1], d.imm);
+                    }
+                    else
+                    {
+                        addressArg(d.b, d.imm);
+                    }
+                    spill();
+                    as.Movzx16(kArgs[2], dst);
+                    call(reinterpret_cast<const void*>(layout.write));
+                    reload();
+                    as.Test32(Reg::RAX, Reg::RAX);
+                    exitIf(X64Assembler::CC_NZ, retired, next);
+                    break;
+
+                case UOP_STI:
+                    as.Mov32(kArgs[1], d.imm);
+                    spill();
+                    call(reinterpret_cast<const void*>(layout.read));
+                    as.Store32(Reg::RSP, kScratchSlot, Reg::RAX);
+                    reload();
+                    as.Movzx16(kArgs[1], Reg::RAX);
+                    as.Movzx16(kArgs[2], dst);
+                    call(reinterpret_cast<const void*>(layout.write));
+                    as.And32(Reg::RSP, kScratchSlot, JIT_EXIT);
+                    as.Or32(Reg::RAX, Reg::RSP, kScratchSlot);
+                    reload();
+                    as.Test32(Reg::RAX, Reg::RAX);
+                    exitIf(X64Assembler::CC_NZ, retired, next);
+                    break;
+
+                case UOP_BR:
+                {
+                    // Work out N, Z and P from the last result into eax, leaving it zero if there isn't one.
+                    as.Mov32(Reg::RAX, 0u);
+                    as.Cmp32(kCond, NO_FLAGS);
+                    const size_t noFlags = as.Jcc(X64Assembler::CC_AE);
+                    as.Test16(kCond);
+                    as.Mov32(Reg::RAX, 1u); // P
+                    as.Mov32(kScratch, 4u);
+                    as.Cmov32(X64Assembler::CC_S, Reg::RAX, kScratch); // N
+                    as.Mov32(kScratch, 2u);
+                    as.Cmov32(X64Assembler::CC_Z, Reg::RAX, kScratch); // Z
+                    as.Bind(noFlags);
+                    as.Test32(Reg::RAX, static_cast<uint32_t>(d.a));
+                    const size_t notTaken = as.Jcc(X64Assembler::CC_Z);
+                    jumpTo(retired, d.imm);
+                    as.Bind(notTaken);
+                    exitWithPc(retired, next);
+                    ended = true;
+                    break;
+                }
+
+                case UOP_BRA:
+                    jumpTo(retired, d.imm);
+                    ended = true;
+                    break;
+
+                case UOP_JMP:
+                    exitWithPcIn(retired, host(d.b));
+                    ended = true;
+                    break;
+
+                case UOP_JSR:
+                    as.Mov16(host(7), next);
+                    jumpTo(retired, d.imm);
+                    ended = true;
+                    break;
+
+                case UOP_JSRR:
+                    as.Mov16(host(7), next);
+                    exitWithPcIn(retired, host(d.b));
+                    ended = true;
+                    break;
+
+                default:
+                    // Traps and anything else that the compiler doesn't handle are left to the interpreter.
+                    return nullptr;
+                }
+            }
+
+            if (!ended)
+            {
+                exitWithPc(static_cast<uint32_t>(count), static_cast<uint16_t>(start + count));
+            }
+
+            // Out of line exits taken after device accesses and writes to compiled code.
+            for (const auto& exit : exits)
+            {
+                as.Bind(exit.patch);
+                exitWithPc(exit.retired, exit.pc);
+            }
+
+            // Epilogue. Expects the number of instructions retired in RAX and PC to have been written back.
+            for (auto patch : toEpilogue)
+            {
+                as.Bind(patch);
+            }
+            for (int r = 0; r < 8; ++r)
+            {
+                as.Store16(kCore, regAt(r), kLc3Regs[r]);
+            }
+            as.Store32(kCore, condAt, kCond);
+            as.Add64(Reg::RSP, kFrameSize);
+            for (auto it = std::rbegin(kSaved); it != std::rend(kSaved); ++it)
+            {
+                as.Pop(*it);
+            }
+            as.Ret();
+
+            // Start again with an empty cache if it's full.
+            if (used_ + as.Size() > buffer_.Size())
+            {
+                Clear();
+            }
+            const uint8_t* p = buffer_.Write(used_, as.Code().data(), as.Size());
+            if (!p)
+            {
+                return nullptr;
+            }
+            used_ += (as.Size() + 15) & ~size_t{15};
+
+            const auto end = static_cast<uint16_t>(start + count - 1);
+            blocks_.push_back({start, end});
+            SetCovered(start, end, 1);
+            auto block = reinterpret_cast<Block>(const_cast<uint8_t*>(p));
+            WritablePage(start).entries[start % PAGE_SIZE] = block;
+            return block;
+        }
+
+        CodeBuffer buffer_{CODE_SIZE};
+        size_t used_{0};
+#else
+    private:
+        struct BlockInfo
+        {
+            uint16_t start;
+            uint16_t end;
+        };
+
+        Block Assemble(uint16_t, const Decoded*, size_t, const Layout&) { return nullptr; }
+
+        size_t used_{0};
+#endif
+
+        /// \brief What the JIT knows about a page of addresses.
+        struct Page
+        {
+            Block entries[PAGE_SIZE]{};   // Compiled blocks by start address.
+            uint8_t heat[PAGE_SIZE]{};    // How often the interpreter has entered a block at each address.
+            uint8_t covered[PAGE_SIZE]{}; // Non-zero for each address that holds an instruction of a compiled block.
+        };
+
+        /// \brief Returns the page that holds the given address, allocating it if it hasn't been.
+        Page& WritablePage(uint16_t address)
+        {
+            auto& page = pages_[address / PAGE_SIZE];
+            if (!page)
+            {
+                page = std::make_unique<Page>();
+            }
+            return *page;
+        }
+
+        /// \brief Marks a range of addresses as covered by compiled code or not. Uncovering allocates nothing.
+        void SetCovered(uint16_t low, uint16_t high, uint8_t covered)
+        {
+            for (uint32_t address = low; address <= high; ++address)
+            {
+                if (covered != 0 || pages_[address / PAGE_SIZE])
+                {
+                    WritablePage(static_cast<uint16_t>(address)).covered[address % PAGE_SIZE] = covered;
+                }
+            }
+        }
+
+        // The tables are only allocated a page at a time, for the pages where the interpreter enters blocks, so that a
+        // VM that runs a little code doesn't pay for tables that cover all of memory.
+        std::array<std::unique_ptr<Page>, PAGE_COUNT> pages_; // The tables, by page, each null until it is needed.
+        std::vector<BlockInfo> blocks_;                       // Compiled blocks.
+    };
+} // namespace lc3
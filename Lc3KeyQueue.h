@@ -0,0 +1,74 @@
+/// Keys on their way from the console to a VM.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace lc3
+{
+    /// \brief A lock-free queue of keys with a single producer, e.g., the thread that reads the console, and a single
+    /// consumer, the thread that is running the VM.
+    ///
+    /// Keys that arrive faster than the VM reads them wait in order instead of replacing each other. Push() and Pop()
+    /// never block, so a worker never waits for the console thread and vice versa. The indices only ever count up,
+    /// wrapping round, and each is written by one side only, on a cache line of its own.
+    class KeyQueue
+    {
+    public:
+        static constexpr size_t CAPACITY = 256; // Keys held before new ones are dropped. A power of two.
+
+        /// \brief Adds a key to the back of the queue. Only call it from the producer.
+        /// \param key the key, which must not be 0.
+        /// \return false if the queue is full, in which case the key is dropped.
+        bool Push(uint16_t key)
+        {
+            const size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) == CAPACITY)
+            {
+                return false;
+            }
+            keys_[tail % CAPACITY] = key;
+
+            // Sequentially consistent, so that a producer that goes on to look at whether the consumer is blocked
+            // can't miss it blocking, and the consumer can't block without seeing the key. See VmState::DeliverKey().
+            tail_.store(tail + 1, std::memory_order_seq_cst);
+            return true;
+        }
+
+        /// \brief Returns true if there are no keys waiting. Can be called from either side.
+        bool Empty() const { return head_.load(std::memory_order_seq_cst) == tail_.load(std::memory_order_seq_cst); }
+
+        /// \brief Returns the key at the front of the queue without removing it, or 0 if there isn't one. Only call it
+        /// from the consumer.
+        uint16_t Front() const
+        {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            return head == tail_.load(std::memory_order_acquire) ? 0 : keys_[head % CAPACITY];
+        }
+
+        /// \brief Removes the key at the front of the queue. Only call it from the consumer.
+        /// \return the key, or 0 if there isn't one.
+        uint16_t Pop()
+        {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire))
+            {
+                return 0;
+            }
+            const uint16_t key = keys_[head % CAPACITY];
+            head_.store(head + 1, std::memory_order_release);
+            return key;
+        }
+
+        /// \brief Throws away every key that is waiting. Only call it from the consumer.
+        void Clear() { head_.store(tail_.load(std::memory_order_acquire), std::memory_order_release); }
+
+    private:
+        alignas(64) std::atomic<size_t> head_{0}; // The next key to pop. Written by the consumer.
+        alignas(64) std::atomic<size_t> tail_{0}; // Where the next key is pushed. Written by the producer.
+        std::array<uint16_t, CAPACITY> keys_{};   // The keys, indexed by position modulo CAPACITY.
+    };
+} // namespace lc3
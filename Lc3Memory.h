@@ -0,0 +1,80 @@
+/// Paged, copy-on-write VM memory.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace lc3
+{
+    /// \brief 65536 words of VM memory, held as pages that are shared between copies until they are written.
+    ///
+    /// Copying a PagedMemory copies its page table, not its pages, so any number of VMs can be started from one loaded
+    /// image for the cost of a page table each. A page is copied the first time it is written while it is shared.
+    /// Pages that have never been written all share one zero page.
+    class PagedMemory
+    {
+    public:
+        static constexpr size_t PAGE_SIZE = 256;                // Words per page.
+        static constexpr size_t PAGE_COUNT = 65536 / PAGE_SIZE; // Pages in the address space.
+
+        using Page = std::array<uint16_t, PAGE_SIZE>;
+
+        /// \brief Creates memory in which every word is zero.
+        PagedMemory()
+        {
+            for (auto& page : pages_)
+            {
+                page = ZeroPage();
+            }
+        }
+
+        uint16_t Read(const uint16_t address) const { return (*pages_[address / PAGE_SIZE])[address % PAGE_SIZE]; }
+
+        void Write(const uint16_t address, const uint16_t val) { WritablePage(address / PAGE_SIZE)[address % PAGE_SIZE] = val; }
+
+        /// \brief Returns the given page for writing, copying it first if it is shared.
+        /// \param page the index of the page.
+        Page& WritablePage(const size_t page)
+        {
+            // Nobody can start sharing a page that only we hold, so if the count is one then it is safe to write to.
+            auto& p = pages_[page];
+            if (p.use_count() != 1)
+            {
+                p = std::make_shared<Page>(*p);
+            }
+            return *p;
+        }
+
+        /// \brief Returns the given page for reading.
+        /// \param page the index of the page.
+        const Page& GetPage(const size_t page) const { return *pages_[page]; }
+
+        /// \brief Replaces a page, e.g., with one that is mapped from an image file.
+        /// \param page the index of the page.
+        /// \param contents the new contents. It is shared, and copied before it is written.
+        void SetPage(const size_t page, std::shared_ptr<Page> contents) { pages_[page] = std::move(contents); }
+
+        /// \brief Returns the number of pages that aren't shared with any other memory.
+        size_t PrivatePages() const
+        {
+            size_t count = 0;
+            for (const auto& page : pages_)
+            {
+                count += page.use_count() == 1;
+            }
+            return count;
+        }
+
+    private:
+        static const std::shared_ptr<Page>& ZeroPage()
+        {
+            static const std::shared_ptr<Page> zero = std::make_shared<Page>();
+            return zero;
+        }
+
+        std::array<std::shared_ptr<Page>, PAGE_COUNT> pages_; // The page table.
+    };
+} // namespace lc3
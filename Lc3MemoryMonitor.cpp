@@ -0,0 +1,101 @@
+#include "Lc3MemoryMonitor.h"
+
+#include <atomic>
+#include <cstdio>
+#include <numeric>
+
+namespace lc3
+{
+    namespace
+    {
+        /// \brief Returns an access written as it is in a watchpoint, e.g., "rw-".
+        std::string AccessName(uint8_t access)
+        {
+            std::string name = "---";
+            name[0] = access & ACCESS_READ ? 'r' : '-';
+            name[1] = access & ACCESS_WRITE ? 'w' : '-';
+            name[2] = access & ACCESS_EXECUTE ? 'x' : '-';
+            return name;
+        }
+    } // namespace
+
+    MemoryMonitor::MemoryMonitor() : stack_(65536 / STACK_BUCKET)
+    {
+        static std::atomic<unsigned> next{0};
+        prefix_ = "lc3-memory-" + std::to_string(next++);
+    }
+
+    void MemoryMonitor::Check(uint8_t access, uint16_t pc, uint16_t address, uint16_t val)
+    {
+        for (auto& watch : watches_)
+        {
+            if ((watch.access & access) && address >= watch.start && address <= watch.end)
+            {
+                ++watch.hits;
+                if (hits_.size() < MAX_HITS)
+                {
+                    hits_.push_back({pc, address, val, access});
+                }
+            }
+        }
+    }
+
+    bool MemoryMonitor::Write() const
+    {
+        FILE* file = fopen((prefix_ + ".txt").c_str(), "w");
+        if (!file)
+        {
+            return false;
+        }
+
+        const auto total = [](const uint64_t* counts) { return std::accumulate(counts, counts + PAGE_COUNT, uint64_t{0}); };
+        const uint64_t reads = total(reads_);
+        const uint64_t writes = total(writes_);
+        const uint64_t executes = total(executes_);
+        fprintf(file, "instructions: %llu\nreads: %llu\nwrites: %llu\n", static_cast<unsigned long long>(executes),
+                static_cast<unsigned long long>(reads), static_cast<unsigned long long>(writes));
+
+        fprintf(file, "\nby page:\n  page           reads         writes       executed\n");
+        for (size_t page = 0; page < PAGE_COUNT; ++page)
+        {
+            if (reads_[page] != 0 || writes_[page] != 0 || executes_[page] != 0)
+            {
+                fprintf(file, "  x%04X %14llu %14llu %14llu\n", static_cast<unsigned>(page * PAGE_SIZE),
+                        static_cast<unsigned long long>(reads_[page]), static_cast<unsigned long long>(writes_[page]),
+                        static_cast<unsigned long long>(executes_[page]));
+            }
+        }
+
+        // Where R6 points says how deep the stack gets and how long the program spends at each depth.
+        if (executes != 0)
+        {
+            fprintf(file, "\nstack pointer: lowest x%04X, highest x%04X\n  from     to       executed\n", lowestSp_,
+                    highestSp_);
+            for (size_t bucket = 0; bucket < stack_.size(); ++bucket)
+            {
+                if (stack_[bucket] != 0)
+                {
+                    const auto start = static_cast<unsigned>(bucket * STACK_BUCKET);
+                    fprintf(file, "  x%04X  x%04X %14llu %6.2f%%\n", start, start + static_cast<unsigned>(STACK_BUCKET) - 1,
+                            static_cast<unsigned long long>(stack_[bucket]), 100.0 * stack_[bucket] / executes);
+                }
+            }
+        }
+
+        if (!watches_.empty())
+        {
+            fprintf(file, "\nwatchpoints:\n");
+            for (const auto& watch : watches_)
+            {
+                fprintf(file, "  x%04X-x%04X %s %14llu hits\n", watch.start, watch.end, AccessName(watch.access).c_str(),
+                        static_cast<unsigned long long>(watch.hits));
+            }
+            fprintf(file, "\nhits:\n  pc     addr   access  value\n");
+            for (const auto& hit : hits_)
+            {
+                fprintf(file, "  x%04X  x%04X  %s     x%04X\n", hit.pc, hit.address, AccessName(hit.access).c_str(), hit.val);
+            }
+        }
+        return fclose(file) == 0;
+    }
+} // namespace lc3
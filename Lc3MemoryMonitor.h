@@ -0,0 +1,130 @@
+/// Memory monitoring policies for Lc3Core.
+///
+/// A memory monitor is chosen by the Monitor of an Lc3Core's configuration. It is told about every read and write of
+/// memory that an instruction makes, and about every instruction that is executed along with the stack pointer at the
+/// time. NoMemoryMonitor, the default, does nothing and compiles away entirely. Instruction fetches don't count as
+/// reads.
+
+#pragma once
+
+#include "Lc3Memory.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lc3
+{
+    /// \brief The kinds of access that a watchpoint can watch for, which can be combined.
+    enum Access : uint8_t
+    {
+        ACCESS_READ = 1 << 0,
+        ACCESS_WRITE = 1 << 1,
+        ACCESS_EXECUTE = 1 << 2
+    };
+
+    /// \brief A memory monitor that does nothing.
+    struct NoMemoryMonitor
+    {
+        static constexpr bool enabled = false;
+
+        void Watch(uint16_t /*start*/, uint16_t /*end*/, uint8_t /*access*/) {}
+        void OnRead(uint16_t /*pc*/, uint16_t /*address*/, uint16_t /*val*/) {}
+        void OnWrite(uint16_t /*pc*/, uint16_t /*address*/, uint16_t /*val*/) {}
+        void OnExecute(uint16_t /*pc*/, uint16_t /*sp*/) {}
+        void OnStop() {}
+    };
+
+    /// \brief A memory monitor that counts reads, writes and instructions executed in each page of memory, keeps a
+    /// histogram of where the stack pointer, R6, points, and logs accesses to the address ranges that it watches.
+    ///
+    /// When the VM stops it writes `<prefix>.txt`, a summary of the counts and the watchpoint hits.
+    class MemoryMonitor
+    {
+    public:
+        static constexpr bool enabled = true;
+        static constexpr size_t MAX_HITS = 1000; // Watchpoint hits logged. Hits after that are only counted.
+
+        /// \brief Creates a monitor that writes to `lc3-memory-<n>`, where n counts the monitors created so far.
+        MemoryMonitor();
+
+        /// \brief Sets the prefix of the file that the summary is written to.
+        void SetOutput(std::string prefix) { prefix_ = std::move(prefix); }
+
+        /// \brief Watches a range of addresses for the given kinds of access.
+        /// \param start the first address to watch.
+        /// \param end the last address to watch, which is included so that a range can reach xFFFF.
+        /// \param access a combination of Access flags.
+        void Watch(uint16_t start, uint16_t end, uint8_t access) { watches_.push_back({start, end, access, 0}); }
+
+        void OnRead(uint16_t pc, uint16_t address, uint16_t val)
+        {
+            ++reads_[address / PAGE_SIZE];
+            if (!watches_.empty())
+            {
+                Check(ACCESS_READ, pc, address, val);
+            }
+        }
+
+        void OnWrite(uint16_t pc, uint16_t address, uint16_t val)
+        {
+            ++writes_[address / PAGE_SIZE];
+            if (!watches_.empty())
+            {
+                Check(ACCESS_WRITE, pc, address, val);
+            }
+        }
+
+        void OnExecute(uint16_t pc, uint16_t sp)
+        {
+            ++executes_[pc / PAGE_SIZE];
+            ++stack_[sp / STACK_BUCKET];
+            lowestSp_ = sp < lowestSp_ ? sp : lowestSp_;
+            highestSp_ = sp > highestSp_ ? sp : highestSp_;
+            if (!watches_.empty())
+            {
+                Check(ACCESS_EXECUTE, pc, pc, 0);
+            }
+        }
+
+        void OnStop() { Write(); }
+
+        /// \brief Writes the summary now.
+        /// \return true if it was written.
+        bool Write() const;
+
+    private:
+        static constexpr size_t PAGE_SIZE = PagedMemory::PAGE_SIZE;
+        static constexpr size_t PAGE_COUNT = PagedMemory::PAGE_COUNT;
+        static constexpr size_t STACK_BUCKET = 16; // Words per bucket of the stack pointer histogram.
+
+        struct Watchpoint
+        {
+            uint16_t start; // The first address watched.
+            uint16_t end;   // The last address watched.
+            uint8_t access; // The kinds of access watched for.
+            uint64_t hits;  // Accesses seen, including any that weren't logged.
+        };
+
+        struct Hit
+        {
+            uint16_t pc;      // The instruction that made the access.
+            uint16_t address; // The address accessed.
+            uint16_t val;     // The value read or written, or 0 for an instruction executed.
+            uint8_t access;   // The kind of access.
+        };
+
+        void Check(uint8_t access, uint16_t pc, uint16_t address, uint16_t val);
+
+        std::string prefix_;
+        uint64_t reads_[PAGE_COUNT]{};
+        uint64_t writes_[PAGE_COUNT]{};
+        uint64_t executes_[PAGE_COUNT]{};
+        std::vector<uint64_t> stack_; // Instructions executed, by where R6 pointed at the time, in STACK_BUCKETs.
+        uint16_t lowestSp_{0xffff};   // The lowest that R6 has been.
+        uint16_t highestSp_{0};       // The highest that R6 has been.
+
+        std::vector<Watchpoint> watches_;
+        std::vector<Hit> hits_; // The first MAX_HITS watchpoint hits, in order.
+    };
+} // namespace lc3
@@ -0,0 +1,115 @@
+#include "Lc3Metrics.h"
+
+#include <cstdio>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace lc3
+{
+    const char* const HostCounters::NAMES[COUNT] = {"cycles", "instructions", "branch_misses", "cache_misses"};
+
+    HostCounters::~HostCounters()
+    {
+#if defined(__linux__)
+        for (int fd : fds_)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    bool HostCounters::Open()
+    {
+#if defined(__linux__)
+        static constexpr uint64_t configs[COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                    PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+
+        // The counters form a group, so that they are scheduled onto the PMU together and read with a single call.
+        for (size_t i = 0; i < COUNT; ++i)
+        {
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            const long fd = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], 0);
+            if (fd < 0)
+            {
+                for (size_t j = 0; j < i; ++j)
+                {
+                    close(fds_[j]);
+                    fds_[j] = -1;
+                }
+                return false;
+            }
+            fds_[i] = static_cast<int>(fd);
+        }
+        ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool HostCounters::Read(uint64_t (&values)[COUNT]) const
+    {
+#if defined(__linux__)
+        // A group reads as the number of counters followed by their values, in the order that they were opened.
+        uint64_t group[1 + COUNT];
+        if (!IsOpen() || read(fds_[0], group, sizeof(group)) != static_cast<ssize_t>(sizeof(group)) ||
+            group[0] != COUNT)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < COUNT; ++i)
+        {
+            values[i] = group[1 + i];
+        }
+        return true;
+#else
+        (void)values;
+        return false;
+#endif
+    }
+
+    void MetricHeader(std::string& out, const char* name, const char* type, const char* help)
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    void MetricSample(std::string& out, const char* name, const std::string& labels, double value)
+    {
+        char number[32];
+        snprintf(number, sizeof(number), "%.15g", value);
+        out += name;
+        if (!labels.empty())
+        {
+            out += '{';
+            out += labels;
+            out += '}';
+        }
+        out += ' ';
+        out += number;
+        out += '\n';
+    }
+} // namespace lc3
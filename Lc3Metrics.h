@@ -0,0 +1,82 @@
+/// Runtime metrics: counters that are cheap to bump and safe to read from another thread, the host's hardware
+/// performance counters, and writing metrics out in the Prometheus text format.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace lc3
+{
+    /// \brief A counter that only one thread at a time adds to, but that any thread can read while it does.
+    ///
+    /// Adding is a relaxed load and store, not a read-modify-write, so it costs the same as bumping a plain integer.
+    /// Counters that many threads add to are kept one per thread, e.g., one per worker, and summed when they are read.
+    class Counter
+    {
+    public:
+        void Add(uint64_t n = 1)
+        {
+            value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        uint64_t Get() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value_{0};
+    };
+
+    /// \brief The calling thread's hardware performance counters, read through perf_event on Linux.
+    ///
+    /// The counters only count while the thread runs in user mode, so that they work wherever perf_event_paranoid
+    /// allows unprivileged use. On other hosts, or where perf_event isn't allowed, Open() fails and nothing is counted.
+    class HostCounters
+    {
+    public:
+        enum : size_t
+        {
+            CYCLES,
+            INSTRUCTIONS,
+            BRANCH_MISSES,
+            CACHE_MISSES,
+            COUNT
+        };
+
+        /// \brief The names of the counters, as they appear in metric names.
+        static const char* const NAMES[COUNT];
+
+        HostCounters() = default;
+        HostCounters(const HostCounters&) = delete;
+        HostCounters& operator=(const HostCounters&) = delete;
+        ~HostCounters();
+
+        /// \brief Starts counting for the calling thread, which is the only thread that should read the counters.
+        /// \return false if the host's counters can't be used.
+        bool Open();
+
+        bool IsOpen() const { return fds_[0] >= 0; }
+
+        /// \brief Reads the counters' totals since Open().
+        /// \param values receives the totals, indexed by CYCLES, etc.
+        /// \return false if the counters couldn't be read.
+        bool Read(uint64_t (&values)[COUNT]) const;
+
+    private:
+        int fds_[COUNT]{-1, -1, -1, -1}; // The counters' file descriptors. The first leads the group.
+    };
+
+    /// \brief Appends the HELP and TYPE lines that introduce a metric.
+    /// \param out the text to append to.
+    /// \param name the metric's name.
+    /// \param type "counter" or "gauge".
+    /// \param help what the metric measures.
+    void MetricHeader(std::string& out, const char* name, const char* type, const char* help);
+
+    /// \brief Appends a sample of a metric.
+    /// \param out the text to append to.
+    /// \param name the metric's name.
+    /// \param labels the sample's labels without the braces, e.g., `vm="0"`, or an empty string for none.
+    /// \param value the sample's value.
+    void MetricSample(std::string& out, const char* name, const std::string& labels, double value);
+} // namespace lc3
@@ -0,0 +1,63 @@
+#include "Lc3Output.h"
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace lc3
+{
+    bool OutputBuffer::Flush()
+    {
+        if (!file_)
+        {
+            // Captured output goes to a string, which can't fail or take less than it's given.
+            const size_t first = size_ < CAPACITY - head_ ? size_ : CAPACITY - head_;
+            captured_.append(data_.data() + head_, first);
+            captured_.append(data_.data(), size_ - first);
+            head_ = size_ = 0;
+            return true;
+        }
+
+        while (size_ != 0)
+        {
+            // The contents are at most two runs: from the head to the end of the array, then from the start.
+            const size_t first = size_ < CAPACITY - head_ ? size_ : CAPACITY - head_;
+            const size_t second = size_ - first;
+#if defined(_WIN32)
+            size_t written = fwrite(data_.data() + head_, 1, first, file_);
+            if (written == first && second != 0)
+            {
+                written += fwrite(data_.data(), 1, second, file_);
+            }
+            fflush(file_);
+            if (written == 0)
+            {
+                head_ = size_ = 0;
+                return false;
+            }
+#else
+            // Anything that went through stdio must come out first.
+            fflush(file_);
+            iovec iov[2] = {{data_.data() + head_, first}, {data_.data(), second}};
+            const ssize_t result = writev(fileno(file_), iov, second != 0 ? 2 : 1);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                head_ = size_ = 0;
+                return false;
+            }
+            const auto written = static_cast<size_t>(result);
+#endif
+            // A short write, e.g., to a pipe, leaves the rest for the next time round.
+            head_ = (head_ + written) % CAPACITY;
+            size_ -= written;
+        }
+        head_ = 0;
+        return true;
+    }
+} // namespace lc3
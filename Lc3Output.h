@@ -0,0 +1,89 @@
+/// Buffered console output for VMs.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+namespace lc3
+{
+    /// \brief A ring buffer of a VM's output, written to a file in batches.
+    ///
+    /// Output traps append to the buffer, and the runner flushes it when it gets full, when the oldest byte in it has
+    /// waited long enough, and before the VM waits for input. Each flush is a single writev() on POSIX hosts, so a VM
+    /// that prints a character at a time no longer costs a system call per character. Output can also be captured in
+    /// memory rather than written to a file at all.
+    class OutputBuffer
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr size_t CAPACITY = 4096;                                  // Bytes held before a write has to flush.
+        static constexpr size_t FLUSH_SIZE = CAPACITY / 2;                        // Bytes held before the runner flushes.
+        static constexpr Clock::duration LATENCY = std::chrono::milliseconds(10); // The longest that output waits.
+
+        explicit OutputBuffer(FILE* file = stdout) : file_{file} {}
+
+        /// \brief Sets the file that output goes to, flushing anything already written to the old one.
+        void SetFile(FILE* file)
+        {
+            Flush();
+            file_ = file;
+        }
+
+        FILE* File() const { return file_; }
+
+        /// \brief Captures output in memory from now on, instead of writing it to a file.
+        void Capture() { SetFile(nullptr); }
+
+        /// \brief Returns the output that has been captured so far, flushing anything that is still buffered.
+        const std::string& Captured()
+        {
+            Flush();
+            return captured_;
+        }
+
+        void Put(char c)
+        {
+            if (size_ == CAPACITY)
+            {
+                Flush();
+            }
+            if (size_ == 0)
+            {
+                oldest_ = Clock::now();
+            }
+            data_[(head_ + size_) % CAPACITY] = c;
+            ++size_;
+        }
+
+        void Write(const char* s)
+        {
+            while (*s)
+            {
+                Put(*s++);
+            }
+        }
+
+        bool Empty() const { return size_ == 0; }
+
+        /// \brief Returns true if the runner should flush the buffer, i.e., it is getting full or the oldest output has
+        /// waited for longer than LATENCY.
+        bool FlushDue(Clock::time_point now) const { return size_ >= FLUSH_SIZE || (size_ != 0 && now - oldest_ >= LATENCY); }
+
+        /// \brief Writes everything in the buffer to the file.
+        /// \return false if the file couldn't be written, in which case the output is discarded.
+        bool Flush();
+
+    private:
+        std::array<char, CAPACITY> data_;
+        size_t head_{0};             // Index of the oldest byte.
+        size_t size_{0};             // Number of bytes in the buffer.
+        Clock::time_point oldest_{}; // When the oldest byte was written.
+        FILE* file_;                 // Where output goes, or nullptr if it is captured.
+        std::string captured_;       // Output that has been captured.
+    };
+} // namespace lc3
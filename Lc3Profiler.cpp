@@ -0,0 +1,149 @@
+#include "Lc3Profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <numeric>
+
+namespace lc3
+{
+    namespace
+    {
+        const char* const opcodeNames[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                             "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+        constexpr size_t topCount = 20; // How many of the hottest addresses and branches to list.
+
+        /// \brief Returns the indices of the largest non-zero counts, largest first.
+        std::vector<uint32_t> Top(const std::vector<uint64_t>& counts, size_t n)
+        {
+            std::vector<uint32_t> indices;
+            for (uint32_t i = 0; i < counts.size(); ++i)
+            {
+                if (counts[i] != 0)
+                {
+                    indices.push_back(i);
+                }
+            }
+            n = std::min(n, indices.size());
+            std::partial_sort(indices.begin(), indices.begin() + n, indices.end(),
+                              [&counts](uint32_t a, uint32_t b) { return counts[a] > counts[b]; });
+            indices.resize(n);
+            return indices;
+        }
+    } // namespace
+
+    Profiler::Profiler()
+        : pcs_(65536), taken_(65536), notTaken_(65536), frames_{{NO_ADDRESS, 0, 0}}
+    {
+        static std::atomic<unsigned> next{0};
+        prefix_ = "lc3-profile-" + std::to_string(next++);
+    }
+
+    void Profiler::OnCall(uint16_t /*pc*/, uint16_t target)
+    {
+        const uint64_t key = (uint64_t{current_} << 16) | target;
+        auto it = children_.find(key);
+        if (it == children_.end())
+        {
+            frames_.push_back({target, current_, 0});
+            it = children_.emplace(key, static_cast<uint32_t>(frames_.size() - 1)).first;
+        }
+        current_ = it->second;
+    }
+
+    std::string Profiler::Stack(uint32_t frame) const
+    {
+        std::vector<uint32_t> path;
+        for (uint32_t f = frame;; f = frames_[f].parent)
+        {
+            path.push_back(f);
+            if (f == 0)
+            {
+                break;
+            }
+        }
+        std::string stack;
+        char name[8];
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
+        {
+            snprintf(name, sizeof(name), "x%04X", static_cast<unsigned>(frames_[*it].address & 0xffff));
+            stack += stack.empty() ? "" : ";";
+            stack += name;
+        }
+        return stack;
+    }
+
+    bool Profiler::WriteFolded(const std::string& filename) const
+    {
+        FILE* file = fopen(filename.c_str(), "w");
+        if (!file)
+        {
+            return false;
+        }
+        for (uint32_t i = 0; i < frames_.size(); ++i)
+        {
+            if (frames_[i].instructions != 0)
+            {
+                fprintf(file, "%s %llu\n", Stack(i).c_str(), static_cast<unsigned long long>(frames_[i].instructions));
+            }
+        }
+        return fclose(file) == 0;
+    }
+
+    bool Profiler::WriteSummary(const std::string& filename) const
+    {
+        FILE* file = fopen(filename.c_str(), "w");
+        if (!file)
+        {
+            return false;
+        }
+
+        const uint64_t total = std::accumulate(std::begin(opcodes_), std::end(opcodes_), uint64_t{0});
+        const auto percent = [total](uint64_t n) { return total ? 100.0 * n / total : 0.0; };
+        fprintf(file, "instructions: %llu\n\nby opcode:\n", static_cast<unsigned long long>(total));
+        for (int op = 0; op < 16; ++op)
+        {
+            if (opcodes_[op] != 0)
+            {
+                fprintf(file, "  %-5s %14llu %6.2f%%\n", opcodeNames[op], static_cast<unsigned long long>(opcodes_[op]), percent(opcodes_[op]));
+            }
+        }
+
+        fprintf(file, "\nhottest addresses:\n");
+        for (auto pc : Top(pcs_, topCount))
+        {
+            fprintf(file, "  x%04X %14llu %6.2f%%\n", pc, static_cast<unsigned long long>(pcs_[pc]), percent(pcs_[pc]));
+        }
+
+        std::vector<uint64_t> branches(65536);
+        for (size_t pc = 0; pc < branches.size(); ++pc)
+        {
+            branches[pc] = taken_[pc] + notTaken_[pc];
+        }
+        fprintf(file, "\nbusiest branches:\n  addr        executed       taken   not taken  taken%%\n");
+        for (auto pc : Top(branches, topCount))
+        {
+            fprintf(file, "  x%04X %14llu %11llu %11llu %6.2f%%\n", pc, static_cast<unsigned long long>(branches[pc]),
+                    static_cast<unsigned long long>(taken_[pc]), static_cast<unsigned long long>(notTaken_[pc]),
+                    100.0 * taken_[pc] / branches[pc]);
+        }
+
+        fprintf(file, "\ntraps:\n");
+        for (int vector = 0; vector < 256; ++vector)
+        {
+            if (traps_[vector] != 0)
+            {
+                fprintf(file, "  x%02X %14llu\n", vector, static_cast<unsigned long long>(traps_[vector]));
+            }
+        }
+        return fclose(file) == 0;
+    }
+
+    bool Profiler::Write() const
+    {
+        const bool folded = WriteFolded(prefix_ + ".folded");
+        const bool summary = WriteSummary(prefix_ + ".txt");
+        return folded && summary;
+    }
+} // namespace lc3
@@ -0,0 +1,101 @@
+/// Profiling policies for Lc3Core.
+///
+/// A profiler is chosen by the Profiler of an Lc3Core's configuration. It is told about every instruction the VM
+/// executes. NoProfiler, the default, does nothing and compiles away entirely.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lc3
+{
+    /// \brief A profiler that does nothing.
+    struct NoProfiler
+    {
+        static constexpr bool enabled = false;
+
+        void OnInstruction(uint16_t /*pc*/, uint16_t /*opcode*/) {}
+        void OnBranch(uint16_t /*pc*/, bool /*taken*/) {}
+        void OnCall(uint16_t /*pc*/, uint16_t /*target*/) {}
+        void OnReturn(uint16_t /*pc*/) {}
+        void OnTrap(uint16_t /*pc*/, uint8_t /*vector*/) {}
+        void OnStop() {}
+    };
+
+    /// \brief A profiler that counts instructions by opcode and address, branch outcomes and traps, and follows
+    /// subroutine calls so that it can attribute instructions to call stacks.
+    ///
+    /// When the VM stops it writes two files: `<prefix>.folded`, call stacks in the folded format read by
+    /// flamegraph.pl and similar tools, weighted by instructions executed; and `<prefix>.txt`, a summary of the counts.
+    class Profiler
+    {
+    public:
+        static constexpr bool enabled = true;
+
+        /// \brief Creates a profiler that writes to `lc3-profile-<n>`, where n counts the profilers created so far.
+        Profiler();
+
+        /// \brief Sets the prefix of the files that the profile is written to.
+        void SetOutput(std::string prefix) { prefix_ = std::move(prefix); }
+
+        void OnInstruction(uint16_t pc, uint16_t opcode)
+        {
+            if (frames_[current_].address == NO_ADDRESS)
+            {
+                frames_[current_].address = pc; // The entry point names the root frame.
+            }
+            ++opcodes_[opcode & 0xf];
+            ++pcs_[pc];
+            ++frames_[current_].instructions;
+        }
+
+        void OnBranch(uint16_t pc, bool taken) { ++(taken ? taken_ : notTaken_)[pc]; }
+
+        void OnCall(uint16_t pc, uint16_t target);
+
+        void OnReturn(uint16_t /*pc*/)
+        {
+            // Returns that don't match a call, e.g., a JMP R7 used as a plain jump, can't go above the root.
+            if (current_ != 0)
+            {
+                current_ = frames_[current_].parent;
+            }
+        }
+
+        void OnTrap(uint16_t /*pc*/, uint8_t vector) { ++traps_[vector]; }
+
+        void OnStop() { Write(); }
+
+        /// \brief Writes the profile now.
+        /// \return true if both files were written.
+        bool Write() const;
+
+    private:
+        static constexpr uint32_t NO_ADDRESS = 0x10000;
+
+        struct Frame
+        {
+            uint32_t address;      // The subroutine's entry point.
+            uint32_t parent;       // Index of the caller's frame.
+            uint64_t instructions; // Instructions executed in this frame, not in its callees.
+        };
+
+        std::string Stack(uint32_t frame) const;
+        bool WriteFolded(const std::string& filename) const;
+        bool WriteSummary(const std::string& filename) const;
+
+        std::string prefix_;
+        uint64_t opcodes_[16]{};
+        uint64_t traps_[256]{};
+        std::vector<uint64_t> pcs_;
+        std::vector<uint64_t> taken_;
+        std::vector<uint64_t> notTaken_;
+
+        std::vector<Frame> frames_;                         // The call tree, with the root frame first.
+        std::unordered_map<uint64_t, uint32_t> children_;   // Frames by caller frame and subroutine address.
+        uint32_t current_{0};                               // The frame that is executing.
+    };
+} // namespace lc3
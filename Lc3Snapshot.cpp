@@ -0,0 +1,185 @@
+#include "Lc3Snapshot.h"
+#include "Lc3Image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace lc3
+{
+    namespace
+    {
+        enum : uint16_t
+        {
+            SNAPSHOT_STOPPED = 0,
+            SNAPSHOT_RUNNING = 1,
+            SNAPSHOT_TRAPPED = 2
+        };
+
+        bool IsZero(const PagedMemory::Page& page)
+        {
+            return std::all_of(page.begin(), page.end(), [](uint16_t word) { return word == 0; });
+        }
+
+        /// \brief Fills in the header of a snapshot and gathers the pages that follow it.
+        std::vector<uint16_t> Pack(const Snapshot& snapshot, SnapshotHeader& header)
+        {
+            header = SnapshotHeader{};
+            header.magic = SNAPSHOT_MAGIC;
+            header.version = SNAPSHOT_VERSION;
+            std::copy(std::begin(snapshot.regs.reg), std::end(snapshot.regs.reg), std::begin(header.reg));
+            header.pc = snapshot.regs.pc;
+            header.cond = snapshot.regs.cond;
+            if (const auto trapped = std::get_if<Trapped>(&snapshot.state))
+            {
+                header.state = SNAPSHOT_TRAPPED;
+                header.trap = static_cast<uint16_t>(trapped->trap);
+            }
+            else
+            {
+                header.state = std::holds_alternative<Stopped>(snapshot.state) ? SNAPSHOT_STOPPED : SNAPSHOT_RUNNING;
+            }
+            header.key = snapshot.key;
+
+            // Pages of zeros are left out. Most of memory is never touched, so that is most of it.
+            std::vector<uint16_t> data;
+            for (size_t page = 0; page < PagedMemory::PAGE_COUNT; ++page)
+            {
+                const auto& contents = snapshot.mem.GetPage(page);
+                if (!IsZero(contents))
+                {
+                    header.pages[page / 8] |= static_cast<uint8_t>(1 << (page % 8));
+                    ++header.pageCount;
+                    data.insert(data.end(), contents.begin(), contents.end());
+                }
+            }
+            header.dataHash = Fnv1a(data.data(), data.size() * sizeof(uint16_t));
+            return data;
+        }
+
+        /// \brief Returns true if a header could start a snapshot.
+        bool IsValid(const SnapshotHeader& header)
+        {
+            return header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION && header.state <= SNAPSHOT_TRAPPED;
+        }
+
+        /// \brief Builds a snapshot from its header and the pages that followed it, which have already been checked
+        /// against the header's hash.
+        bool Unpack(const SnapshotHeader& header, const std::vector<uint16_t>& data, Snapshot& snapshot)
+        {
+            Snapshot result;
+            std::copy(std::begin(header.reg), std::end(header.reg), std::begin(result.regs.reg));
+            result.regs.pc = header.pc;
+            result.regs.cond = header.cond;
+            switch (header.state)
+            {
+            case SNAPSHOT_STOPPED:
+                result.state = Stopped();
+                break;
+            case SNAPSHOT_RUNNING:
+                result.state = Running();
+                break;
+            default:
+                result.state = Trapped{header.trap};
+                break;
+            }
+            result.key = header.key;
+
+            size_t next = 0;
+            for (size_t page = 0; page < PagedMemory::PAGE_COUNT; ++page)
+            {
+                if (header.pages[page / 8] & (1 << (page % 8)))
+                {
+                    if (next == header.pageCount)
+                    {
+                        return false;
+                    }
+                    auto& contents = result.mem.WritablePage(page);
+                    std::copy_n(data.begin() + next * PagedMemory::PAGE_SIZE, PagedMemory::PAGE_SIZE, contents.begin());
+                    ++next;
+                }
+            }
+            if (next != header.pageCount)
+            {
+                return false;
+            }
+
+            snapshot = std::move(result);
+            return true;
+        }
+    } // namespace
+
+    bool WriteSnapshot(const Snapshot& snapshot, const char* filename)
+    {
+        SnapshotHeader header;
+        const std::vector<uint16_t> data = Pack(snapshot, header);
+
+        FILE* file = fopen(filename, "wb");
+        if (!file)
+        {
+            return false;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && fwrite(data.data(), sizeof(uint16_t), data.size(), file) == data.size();
+        ok = fclose(file) == 0 && ok;
+        return ok;
+    }
+
+    bool ReadSnapshot(const char* filename, Snapshot& snapshot)
+    {
+        std::unique_ptr<FILE, int (*)(FILE*)> file{fopen(filename, "rb"), &fclose};
+        if (!file)
+        {
+            return false;
+        }
+
+        SnapshotHeader header;
+        if (fread(&header, sizeof(header), 1, file.get()) != 1 || !IsValid(header))
+        {
+            return false;
+        }
+        std::vector<uint16_t> data(header.pageCount * PagedMemory::PAGE_SIZE);
+        if (fread(data.data(), sizeof(uint16_t), data.size(), file.get()) != data.size() || fgetc(file.get()) != EOF
+            || Fnv1a(data.data(), data.size() * sizeof(uint16_t)) != header.dataHash)
+        {
+            return false;
+        }
+
+        // Only touch the snapshot once the whole file is known to be good.
+        return Unpack(header, data, snapshot);
+    }
+
+    std::string EncodeSnapshot(const Snapshot& snapshot)
+    {
+        SnapshotHeader header;
+        const std::vector<uint16_t> data = Pack(snapshot, header);
+        std::string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(uint16_t));
+        return bytes;
+    }
+
+    bool DecodeSnapshot(const void* bytes, size_t size, Snapshot& snapshot)
+    {
+        SnapshotHeader header;
+        if (size < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, bytes, sizeof(header));
+        if (!IsValid(header) || size != sizeof(header) + header.pageCount * PagedMemory::PAGE_SIZE * sizeof(uint16_t))
+        {
+            return false;
+        }
+
+        // The buffer needn't be aligned for words, e.g., when it is part of a network message, so copy the pages out.
+        std::vector<uint16_t> data(header.pageCount * PagedMemory::PAGE_SIZE);
+        memcpy(data.data(), static_cast<const char*>(bytes) + sizeof(header), data.size() * sizeof(uint16_t));
+        if (Fnv1a(data.data(), data.size() * sizeof(uint16_t)) != header.dataHash)
+        {
+            return false;
+        }
+        return Unpack(header, data, snapshot);
+    }
+} // namespace lc3
@@ -0,0 +1,75 @@
+/// Snapshots of the complete state of a console VM.
+///
+/// A snapshot holds a VM's registers, run state, pending key and memory. Its memory is a PagedMemory, so taking a
+/// snapshot and starting VMs from it copies page tables rather than pages: a VM restored from a snapshot shares every
+/// page with it until the VM writes to that page. Boot a VM once, snapshot it, and any number of VMs can be started
+/// from where it left off without running the boot code again.
+
+#pragma once
+
+#include "LC3.h"
+#include "Lc3Memory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace lc3
+{
+    constexpr uint32_t SNAPSHOT_MAGIC = 0x5333434C; // "LC3S" when written by a little-endian host.
+    constexpr uint16_t SNAPSHOT_VERSION = 1;
+
+    /// \brief The complete state of a console VM. By default, that of a VM with DefaultConfig that has been reset with
+    /// empty memory. Lc3C::ReadImage() makes one that starts where the console VM's own configuration does.
+    struct Snapshot
+    {
+        Registers regs{{0}, DefaultConfig::pcStart, 0}; // Registers, including the condition flags.
+        State state{Running()};                         // Whether the VM is running, stopped or waiting for a trap.
+        uint16_t key{0};                                // The key waiting to be read, or 0 if there isn't one.
+        PagedMemory mem;                                // Memory, shared page by page with the VM it was taken from.
+    };
+
+    /// \brief The header at the start of a snapshot file.
+    ///
+    /// The pages that aren't all zeros follow the header in ascending order, each as PAGE_SIZE words. Everything is in
+    /// host byte order, like an image cache.
+    struct SnapshotHeader
+    {
+        uint32_t magic;                             // SNAPSHOT_MAGIC.
+        uint16_t version;                           // SNAPSHOT_VERSION.
+        uint16_t pageCount;                         // The number of pages held in the file.
+        uint16_t reg[8];                            // General registers.
+        uint16_t pc;                                // Program counter.
+        uint16_t cond;                              // Condition flags.
+        uint16_t state;                             // 0 if stopped, 1 if running, 2 if trapped.
+        uint16_t trap;                              // The trap instruction, if trapped.
+        uint16_t key;                               // The key waiting to be read.
+        uint16_t reserved[3];                       // Zero, and pads dataHash to eight bytes.
+        uint64_t dataHash;                          // FNV-1a hash of the page data, to tell whether it is intact.
+        uint8_t pages[PagedMemory::PAGE_COUNT / 8]; // Bit n is set if page n is held in the file.
+    };
+
+    /// \brief Writes a snapshot to a file.
+    /// \param snapshot the snapshot to write.
+    /// \param filename the name of the file to write.
+    /// \return true if the file was written.
+    bool WriteSnapshot(const Snapshot& snapshot, const char* filename);
+
+    /// \brief Reads a snapshot from a file.
+    /// \param filename the name of the file to read.
+    /// \param snapshot receives the snapshot.
+    /// \return true if the file was read, false if it couldn't be read or isn't a valid snapshot.
+    bool ReadSnapshot(const char* filename, Snapshot& snapshot);
+
+    /// \brief Encodes a snapshot exactly as WriteSnapshot() would write it, e.g., to send it to another host.
+    /// \param snapshot the snapshot to encode.
+    /// \return the bytes of the snapshot file.
+    std::string EncodeSnapshot(const Snapshot& snapshot);
+
+    /// \brief Decodes a snapshot from the bytes of a snapshot file.
+    /// \param bytes the bytes. They needn't be aligned.
+    /// \param size the number of bytes, which must be exactly the size of the snapshot.
+    /// \param snapshot receives the snapshot.
+    /// \return true if the bytes are a valid snapshot.
+    bool DecodeSnapshot(const void* bytes, size_t size, Snapshot& snapshot);
+} // namespace lc3
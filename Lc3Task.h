@@ -0,0 +1,59 @@
+/// A minimal C++20 coroutine type for running VMs. Only used when building with LC3_COROUTINES.
+
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace lc3
+{
+    /// \brief A coroutine that does nothing until it is resumed, and runs until it next suspends each time it is.
+    ///
+    /// Nothing resumes it but its owner, so it never runs on two threads at once, and never runs while its owner isn't
+    /// looking. The coroutine's frame is destroyed along with the task.
+    class Task
+    {
+    public:
+        struct promise_type
+        {
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        Task() = default;
+        Task(Task&& other) noexcept : handle_{std::exchange(other.handle_, nullptr)} {}
+        Task& operator=(Task&& other) noexcept
+        {
+            std::swap(handle_, other.handle_);
+            return *this;
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task()
+        {
+            if (handle_)
+            {
+                handle_.destroy();
+            }
+        }
+
+        explicit operator bool() const { return static_cast<bool>(handle_); }
+
+        /// \brief Runs the coroutine until it next suspends or finishes.
+        /// \return false if it has finished.
+        bool Resume()
+        {
+            handle_.resume();
+            return !handle_.done();
+        }
+
+    private:
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle_{handle} {}
+
+        std::coroutine_handle<promise_type> handle_{nullptr};
+    };
+} // namespace lc3
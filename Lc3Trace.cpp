@@ -0,0 +1,310 @@
+#include "Lc3Trace.h"
+#include "Lc3Image.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace lc3
+{
+    uint64_t HashState(const Snapshot& snapshot)
+    {
+        // Hash the hashes of the registers and of each page, so that nothing has to be copied into one buffer.
+        uint16_t regs[12]{};
+        std::copy(std::begin(snapshot.regs.reg), std::end(snapshot.regs.reg), regs);
+        regs[8] = snapshot.regs.pc;
+        regs[9] = snapshot.regs.cond;
+        regs[10] = static_cast<uint16_t>(snapshot.state.index());
+        if (const auto trapped = std::get_if<Trapped>(&snapshot.state))
+        {
+            regs[11] = static_cast<uint16_t>(trapped->trap);
+        }
+
+        std::vector<uint64_t> hashes;
+        hashes.push_back(Fnv1a(regs, sizeof(regs)));
+        for (size_t page = 0; page < PagedMemory::PAGE_COUNT; ++page)
+        {
+            const auto& contents = snapshot.mem.GetPage(page);
+            hashes.push_back(Fnv1a(contents.data(), contents.size() * sizeof(uint16_t)));
+        }
+        return Fnv1a(hashes.data(), hashes.size() * sizeof(uint64_t));
+    }
+
+    /// \brief The thread that writes out every trace's records, in the order that their buffers were handed over.
+    class TraceWriter::Thread
+    {
+    public:
+        /// \brief Returns the process's writer thread, starting it the first time.
+        static Thread& Get()
+        {
+            static Thread thread;
+            return thread;
+        }
+
+        Thread(const Thread&) = delete;
+        Thread& operator=(const Thread&) = delete;
+
+        std::mutex mutex;                // Guards the fields below, and the fields of each trace that it writes for.
+        std::condition_variable ready;   // Signalled when a trace is queued, or when the thread should finish.
+        std::condition_variable drained; // Signalled when a trace has nothing left to write.
+        std::deque<TraceWriter*> queue;  // Traces with records to write, each at most once.
+
+    private:
+        Thread() : thread_{&Thread::Run, this} {}
+
+        ~Thread()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping_ = true;
+            }
+            ready.notify_one();
+            thread_.join();
+        }
+
+        void Run()
+        {
+            std::vector<uint8_t> data;
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;)
+            {
+                ready.wait(lock, [this] { return stopping_ || !queue.empty(); });
+                if (queue.empty())
+                {
+                    return;
+                }
+
+                // The trace can't be closed while it is queued, so its file stays open while the lock isn't held.
+                TraceWriter* trace = queue.front();
+                queue.pop_front();
+                data.swap(trace->full_);
+                lock.unlock();
+                const bool ok = fwrite(data.data(), 1, data.size(), trace->file_) == data.size();
+                data.clear();
+                lock.lock();
+
+                trace->failed_ = trace->failed_ || !ok;
+                if (trace->full_.empty())
+                {
+                    trace->queued_ = false;
+                    drained.notify_all();
+                }
+                else
+                {
+                    // More was handed over while this was being written, so it goes behind the other traces.
+                    queue.push_back(trace);
+                }
+            }
+        }
+
+        bool stopping_{false}; // True once the thread should finish.
+        std::thread thread_;   // Declared last, as it uses the rest.
+    };
+
+    bool TraceWriter::Open(const char* filename, uint64_t startHash)
+    {
+        Stop();
+        file_ = fopen(filename, "wb");
+        if (!file_)
+        {
+            return false;
+        }
+        const TraceHeader header{TRACE_MAGIC, TRACE_VERSION, 0, startHash};
+        if (fwrite(&header, sizeof(header), 1, file_) != 1)
+        {
+            fclose(file_);
+            file_ = nullptr;
+            return false;
+        }
+        quiet_ = 0;
+        buffer_.clear();
+        buffer_.reserve(BUFFER_SIZE + 32);
+        failed_ = false;
+        Thread::Get();
+        return true;
+    }
+
+    void TraceWriter::Record(TraceEvent event, uint64_t value)
+    {
+        PutVarint(quiet_);
+        PutVarint(value << 2 | static_cast<uint64_t>(event));
+        quiet_ = 0;
+        if (buffer_.size() >= BUFFER_SIZE)
+        {
+            HandOver();
+        }
+    }
+
+    bool TraceWriter::Close(uint64_t retired, uint64_t endHash)
+    {
+        if (!file_)
+        {
+            return false;
+        }
+        Record(TraceEvent::END, retired);
+        PutVarint(endHash);
+        return Stop();
+    }
+
+    void TraceWriter::PutVarint(uint64_t value)
+    {
+        // LEB128: seven bits at a time, least significant first, with the top bit set on every byte but the last.
+        while (value >= 0x80)
+        {
+            buffer_.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        buffer_.push_back(static_cast<uint8_t>(value));
+    }
+
+    void TraceWriter::HandOver()
+    {
+        if (buffer_.empty())
+        {
+            return;
+        }
+        Thread& thread = Thread::Get();
+        {
+            // If the writer thread hasn't got to the last buffer yet then this one goes on the end of it.
+            std::lock_guard<std::mutex> lock(thread.mutex);
+            if (full_.empty())
+            {
+                full_.swap(buffer_);
+            }
+            else
+            {
+                full_.insert(full_.end(), buffer_.begin(), buffer_.end());
+            }
+            if (!queued_)
+            {
+                queued_ = true;
+                thread.queue.push_back(this);
+            }
+        }
+        thread.ready.notify_one();
+        buffer_.clear();
+    }
+
+    bool TraceWriter::Stop()
+    {
+        if (!file_)
+        {
+            return false;
+        }
+        HandOver();
+        bool failed;
+        {
+            Thread& thread = Thread::Get();
+            std::unique_lock<std::mutex> lock(thread.mutex);
+            thread.drained.wait(lock, [this] { return !queued_; });
+            failed = failed_;
+        }
+        const bool ok = fclose(file_) == 0 && !failed;
+        file_ = nullptr;
+        return ok;
+    }
+
+    bool TraceReader::Open(const char* filename)
+    {
+        std::unique_ptr<FILE, int (*)(FILE*)> file{fopen(filename, "rb"), &fclose};
+        if (!file)
+        {
+            return false;
+        }
+        if (fread(&header_, sizeof(header_), 1, file.get()) != 1 || header_.magic != TRACE_MAGIC
+            || header_.version != TRACE_VERSION)
+        {
+            return false;
+        }
+        data_.clear();
+        uint8_t buffer[4096];
+        for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file.get())) != 0;)
+        {
+            data_.insert(data_.end(), buffer, buffer + n);
+        }
+        if (ferror(file.get()))
+        {
+            return false;
+        }
+        pos_ = 0;
+        truncated_ = diverged_ = false;
+        Advance();
+        return true;
+    }
+
+    bool TraceReader::HaltDue(uint64_t& retired) const
+    {
+        if (next_.event != TraceEvent::HALT || truncated_)
+        {
+            return false;
+        }
+        retired = next_.value;
+        return true;
+    }
+
+    bool TraceReader::AtEnd(uint64_t& retired, uint64_t& endHash) const
+    {
+        if (next_.quiet != 0 || next_.event != TraceEvent::END || truncated_)
+        {
+            return false;
+        }
+        retired = next_.value;
+        endHash = endHash_;
+        return true;
+    }
+
+    bool TraceReader::Answer(TraceEvent event, uint64_t& value)
+    {
+        if (next_.quiet != 0)
+        {
+            --next_.quiet;
+            return false;
+        }
+        if (next_.event != event || truncated_)
+        {
+            // The recorded run got a different answer, or none at all because it had already been halted or ended.
+            diverged_ = true;
+            return false;
+        }
+        value = next_.value;
+        Advance();
+        return true;
+    }
+
+    void TraceReader::Advance()
+    {
+        uint64_t quiet;
+        uint64_t event;
+        const auto isEnd = [&event] { return static_cast<TraceEvent>(event & 3) == TraceEvent::END; };
+        if (!GetVarint(quiet) || !GetVarint(event) || (isEnd() && !GetVarint(endHash_)))
+        {
+            // The trace stops short, e.g., because the VM that was recording it was killed, so the replay runs until
+            // it asks something that the trace can't answer.
+            next_ = TraceRecord{};
+            truncated_ = true;
+            return;
+        }
+        next_.quiet = quiet;
+        next_.event = static_cast<TraceEvent>(event & 3);
+        next_.value = event >> 2;
+    }
+
+    bool TraceReader::GetVarint(uint64_t& value)
+    {
+        value = 0;
+        for (int shift = 0; pos_ < data_.size() && shift < 64; shift += 7)
+        {
+            const uint8_t byte = data_[pos_++];
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+} // namespace lc3
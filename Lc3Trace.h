@@ -0,0 +1,169 @@
+/// Traces of the nondeterministic input to a console VM, for replaying what it did.
+///
+/// Given the same starting state, a VM does exactly the same thing every time it runs, except where it asks the world
+/// for something: whether a key is waiting, whether the timer has expired, or being halted from outside because its
+/// input has run out. A trace records the answers to those questions and nothing else, so it stays small, and
+/// replaying it against the same starting state repeats the run exactly.
+///
+/// A trace file is a TraceHeader followed by records. Each record is the number of questions since the previous
+/// record whose answer was "nothing", e.g., a poll of KBSR with no key waiting, followed by the event itself, both as
+/// LEB128 varints. The event is its value shifted left by two, ORed with its TraceEvent. The last record is an END
+/// whose value is the number of instructions retired, followed by a varint hash of the VM's final state.
+
+#pragma once
+
+#include "Lc3Snapshot.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace lc3
+{
+    constexpr uint32_t TRACE_MAGIC = 0x5433434C; // "LC3T" when written by a little-endian host.
+    constexpr uint16_t TRACE_VERSION = 1;
+
+    /// \brief The header at the start of a trace file. Everything is in host byte order, like a snapshot.
+    struct TraceHeader
+    {
+        uint32_t magic;     // TRACE_MAGIC.
+        uint16_t version;   // TRACE_VERSION.
+        uint16_t reserved;  // Zero.
+        uint64_t startHash; // HashState() of the VM when the trace started.
+    };
+
+    enum class TraceEvent : uint8_t
+    {
+        KEY = 0,   // A key was read. The value is the key.
+        TIMER = 1, // The timer was found to have expired.
+        HALT = 2,  // The VM was halted from outside. The value is the number of instructions retired by then.
+        END = 3    // The trace ended. The value is the number of instructions retired by then.
+    };
+
+    /// \brief A record from a trace.
+    struct TraceRecord
+    {
+        uint64_t quiet{0};                 // Questions answered with "nothing" before this one.
+        TraceEvent event{TraceEvent::END}; // What happened.
+        uint64_t value{0};                 // Depends on the event.
+    };
+
+    /// \brief Returns a hash of a VM's registers, run state and memory, to tell whether two VMs are the same. Keys that
+    /// are waiting are left out, as a replay never has any.
+    uint64_t HashState(const Snapshot& snapshot);
+
+    /// \brief Writes a trace, handing the encoded records to a background thread to write out.
+    ///
+    /// Recording costs the VM a counter increment for each question answered with "nothing" and a few bytes of
+    /// buffer for anything else. Full buffers are handed over under a lock, which happens once every BUFFER_SIZE bytes
+    /// at most, and the writer never holds the lock while it writes. One writer thread serves every trace in the
+    /// process, so tracing thousands of VMs doesn't take thousands of threads that are mostly idle.
+    class TraceWriter
+    {
+    public:
+        static constexpr size_t BUFFER_SIZE = 4096; // Bytes encoded before they are handed to the writer thread.
+
+        TraceWriter() = default;
+        TraceWriter(const TraceWriter&) = delete;
+        TraceWriter& operator=(const TraceWriter&) = delete;
+        ~TraceWriter() { Stop(); }
+
+        /// \brief Creates a trace file, starting the writer thread if no trace has yet.
+        /// \param filename the name of the file to write.
+        /// \param startHash HashState() of the VM as the trace starts.
+        /// \return false if the file couldn't be created.
+        bool Open(const char* filename, uint64_t startHash);
+
+        /// \brief Records a question answered with "nothing".
+        void Quiet() { ++quiet_; }
+
+        /// \brief Records an event.
+        void Record(TraceEvent event, uint64_t value);
+
+        /// \brief Ends the trace, waiting for everything to be written. A trace that is never closed, e.g., because its
+        /// VM is destroyed while it is still running, can still be replayed as far as it goes.
+        /// \param retired the number of instructions retired since the trace started.
+        /// \param endHash HashState() of the VM as the trace ends.
+        /// \return false if any of the trace couldn't be written.
+        bool Close(uint64_t retired, uint64_t endHash);
+
+        bool IsOpen() const { return file_ != nullptr; }
+
+    private:
+        class Thread;
+
+        void PutVarint(uint64_t value);
+        void HandOver();
+        bool Stop();
+
+        FILE* file_{nullptr};         // The trace file, while it is open.
+        uint64_t quiet_{0};           // Questions answered with "nothing" since the last record.
+        std::vector<uint8_t> buffer_; // Records encoded by the VM's thread.
+
+        // Guarded by the writer thread's lock.
+        std::vector<uint8_t> full_; // Records handed over to the writer thread.
+        bool queued_{false};        // True while the writer thread has records of this trace to write.
+        bool failed_{false};        // True if a write failed.
+    };
+
+    /// \brief Reads a trace for a replay, answering the VM's questions from it.
+    class TraceReader
+    {
+    public:
+        /// \brief Reads a whole trace file.
+        /// \param filename the name of the file to read.
+        /// \return false if the file couldn't be read or isn't a trace.
+        bool Open(const char* filename);
+
+        uint64_t StartHash() const { return header_.startHash; }
+
+        /// \brief Answers the question of whether there is a key.
+        /// \return the key, or 0 if there wasn't one.
+        uint16_t Key()
+        {
+            uint64_t key = 0;
+            return Answer(TraceEvent::KEY, key) ? static_cast<uint16_t>(key) : 0;
+        }
+
+        /// \brief Answers the question of whether the timer has expired.
+        bool Timer()
+        {
+            uint64_t unused;
+            return Answer(TraceEvent::TIMER, unused);
+        }
+
+        /// \brief Finds whether the VM is next halted from outside, rather than getting an answer other than "nothing".
+        /// \param retired receives the number of instructions retired by the time it was halted. The replay should
+        /// run no further than that.
+        bool HaltDue(uint64_t& retired) const;
+
+        /// \brief Moves past a halt once it has been replayed.
+        void Halted() { Advance(); }
+
+        /// \brief Finds whether the trace has reached its end.
+        /// \param retired receives the number of instructions retired by the end.
+        /// \param endHash receives HashState() of the VM at the end.
+        /// \return true if the end has been reached, and the trace was closed with the VM's final state.
+        bool AtEnd(uint64_t& retired, uint64_t& endHash) const;
+
+        /// \brief Returns true if the trace stops short, without its END record.
+        bool Truncated() const { return truncated_; }
+
+        /// \brief Returns true if the VM asked a question that the trace can't answer, i.e., the replay has gone
+        /// differently from the run that was recorded.
+        bool Diverged() const { return diverged_; }
+
+    private:
+        bool Answer(TraceEvent event, uint64_t& value);
+        void Advance();
+        bool GetVarint(uint64_t& value);
+
+        TraceHeader header_{};
+        std::vector<uint8_t> data_; // The records.
+        size_t pos_{0};             // The next byte of data_ to decode.
+        TraceRecord next_;          // The next record, which is partly used up while its quiet count counts down.
+        uint64_t endHash_{0};       // The hash after the END record.
+        bool truncated_{false};     // True if the records stop short of an END.
+        bool diverged_{false};      // True if the replay has gone differently from the recording.
+    };
+} // namespace lc3
@@ -0,0 +1,446 @@
+#include "Scheduler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+
+void Scheduler::RunQueue::Push(size_t vm)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(vm);
+}
+
+void Scheduler::RunQueue::PushFront(size_t vm)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_front(vm);
+}
+
+bool Scheduler::RunQueue::Pop(size_t& vm)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.empty())
+    {
+        return false;
+    }
+    vm = queue_.front();
+    queue_.pop_front();
+    return true;
+}
+
+bool Scheduler::RunQueue::Steal(size_t& vm)
+{
+    // Steal from the opposite end to the owner so that the two rarely contend for the same VM.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.empty())
+    {
+        return false;
+    }
+    vm = queue_.back();
+    queue_.pop_back();
+    return true;
+}
+
+int Scheduler::HeadlessConsole::WaitForKey()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait(lock, [this]() { return interrupted_; });
+    return -1;
+}
+
+void Scheduler::HeadlessConsole::Interrupt()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        interrupted_ = true;
+    }
+    wake_.notify_all();
+}
+
+Scheduler::Scheduler(VmPool&& vms, size_t workers, const SliceLimits& limits)
+    : vms_{std::move(vms)}, limits_{limits}, running_{vms_.Size()}, parked_(vms_.Size(), false)
+{
+    if (workers == 0)
+    {
+        workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    workers = std::max<size_t>(1, std::min(workers, vms_.Size()));
+    for (size_t i = 0; i < workers; ++i)
+    {
+        queues_.push_back(std::make_unique<RunQueue>());
+    }
+    workerMetrics_ = std::make_unique<WorkerMetrics[]>(workers);
+
+    if (vms_.Size() != 0)
+    {
+        vms_[consoleOwner_].SetConsoleOwner(true);
+    }
+
+    // Deal the VMs out between the workers.
+    for (size_t vm = 0; vm < vms_.Size(); ++vm)
+    {
+        Enqueue(vm % workers, vm);
+    }
+}
+
+void Scheduler::Run(Console& console)
+{
+    console_ = &console;
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < queues_.size(); ++i)
+    {
+        workers.emplace_back(&Scheduler::Work, this, i);
+    }
+    std::thread timers(&Scheduler::RunTimers, this);
+
+    // This thread becomes the I/O thread. The worker that stops the last VM interrupts the wait.
+    while (running_.load(std::memory_order_acquire) > 0)
+    {
+        if (const int key = console.WaitForKey(); key >= 0)
+        {
+            HandleKey(static_cast<uint16_t>(key));
+        }
+    }
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    timers.join();
+    console_ = nullptr;
+}
+
+bool Scheduler::EnableHostCounters()
+{
+    // Each worker opens counters for its own thread, so check that this thread can before relying on them.
+    lc3::HostCounters probe;
+    hostCounters_ = probe.Open();
+    return hostCounters_;
+}
+
+void Scheduler::Work(size_t self)
+{
+    WorkerMetrics& metrics = workerMetrics_[self];
+    lc3::HostCounters host;
+    if (hostCounters_)
+    {
+        host.Open();
+    }
+
+    while (running_.load(std::memory_order_acquire) > 0)
+    {
+        size_t vm;
+        if (!FindWork(self, vm))
+        {
+            // Everything is either blocked or being run by another worker.
+            metrics.idles.Add();
+            WaitForWork();
+            continue;
+        }
+
+        uint64_t before[lc3::HostCounters::COUNT];
+        const bool counting = host.IsOpen() && host.Read(before);
+        const bool running = vms_[vm].Run(limits_);
+        metrics.slices.Add();
+        if (uint64_t counts[lc3::HostCounters::COUNT]; counting && host.Read(counts))
+        {
+            for (size_t i = 0; i < lc3::HostCounters::COUNT; ++i)
+            {
+                counts[i] -= before[i];
+                metrics.hostCounts[i].Add(counts[i]);
+            }
+            vms_[vm].AddHostCounts(counts);
+        }
+
+        if (!running)
+        {
+            // The VM just stopped, so it never goes back on a run queue. If it was the last one then wake everything
+            // up so that it can see that there's nothing left to do.
+            if (running_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(idleMutex_);
+                }
+                workAvailable_.notify_all();
+                {
+                    std::lock_guard<std::mutex> lock(parkMutex_);
+                }
+                timersChanged_.notify_all();
+                console_->Interrupt();
+            }
+            continue;
+        }
+
+        Reschedule(self, vm);
+    }
+}
+
+void Scheduler::Enqueue(size_t queue, size_t vm, bool wake, bool front)
+{
+    if (front)
+    {
+        queues_[queue]->PushFront(vm);
+    }
+    else
+    {
+        queues_[queue]->Push(vm);
+    }
+    queued_.fetch_add(1);
+
+    // Only take the lock if there's somebody to wake. A worker going idle increments idle_ before it checks queued_,
+    // so between them, the two threads can't both miss each other.
+    if (wake && idle_.load() > 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex_);
+        }
+        workAvailable_.notify_one();
+    }
+}
+
+void Scheduler::WaitForWork()
+{
+    std::unique_lock<std::mutex> lock(idleMutex_);
+    idle_.fetch_add(1);
+    workAvailable_.wait(lock, [this]() { return queued_.load() > 0 || running_.load() == 0; });
+    idle_.fetch_sub(1);
+}
+
+bool Scheduler::FindWork(size_t self, size_t& vm)
+{
+    if (queues_[self]->Pop(vm))
+    {
+        queued_.fetch_sub(1);
+        return true;
+    }
+    for (size_t i = 1; i < queues_.size(); ++i)
+    {
+        if (queues_[(self + i) % queues_.size()]->Steal(vm))
+        {
+            queued_.fetch_sub(1);
+            workerMetrics_[self].steals.Add();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::Reschedule(size_t self, size_t vm)
+{
+    {
+        // Decide whether to park the VM while holding the lock, so that the I/O thread can't unblock it in between
+        // the check and the VM being marked as parked.
+        std::lock_guard<std::mutex> lock(parkMutex_);
+
+        // The console owner VM can't be blocked on output.
+        VmState& state = vms_[vm];
+        if (vm == consoleOwner_)
+        {
+            state.ClearBlocked(VmState::isBlockedOnOutput);
+        }
+
+        // A key that arrived while the VM was running would otherwise be left waiting for the next one.
+        if (state.HasPendingKey())
+        {
+            state.ClearBlocked(VmState::isBlockedOnInput | VmState::isWaiting);
+        }
+
+        if (state.IsBlocked())
+        {
+            parked_[vm] = true;
+            Lc3C::Clock::time_point when;
+            if (state.IsBlockedOn(VmState::isWaiting) && state.WakeTime(when))
+            {
+                const bool sooner = timers_.empty() || when < timers_.top().when;
+                timers_.push({when, vm});
+                if (sooner)
+                {
+                    timersChanged_.notify_one();
+                }
+            }
+            return;
+        }
+    }
+
+    // If nothing else is queued then this worker will pick the VM straight back up, so don't wake anybody to steal it.
+    Enqueue(self, vm, queued_.load() > 0);
+}
+
+void Scheduler::HandleKey(uint16_t key)
+{
+    // Pass anything but [Esc] to the console owner. Only this thread changes the owner, so that needs no lock, and the
+    // lock is only taken to wake the owner if it is waiting, so keys for a VM that is busy don't hold up the workers.
+    if (key != '\x1b')
+    {
+        // If the owner falls behind, e.g., because input is being pasted or piped in, hold back the console until it
+        // has read some of its keys rather than drop them. An owner that reads nothing for a while, e.g., because it
+        // has halted, loses keys instead, so that [Esc] still gets through.
+        VmState& owner = vms_[consoleOwner_];
+        const auto giveUp = Lc3C::Clock::now() + KEY_TIMEOUT;
+        while (!owner.DeliverKey(key))
+        {
+            if (Lc3C::Clock::now() >= giveUp)
+            {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        if (owner.IsWaitingForKey())
+        {
+            std::lock_guard<std::mutex> lock(parkMutex_);
+            owner.ClearBlocked(VmState::isBlockedOnInput | VmState::isWaiting);
+            Unpark(consoleOwner_);
+        }
+        return;
+    }
+
+    // Cycle console ownership to the next VM.
+    std::lock_guard<std::mutex> lock(parkMutex_);
+    vms_[consoleOwner_].SetConsoleOwner(false);
+    consoleOwner_ = (consoleOwner_ + 1) % vms_.Size();
+    fprintf(stderr, "\nConsole owner: %zd\n", consoleOwner_);
+    vms_[consoleOwner_].SetConsoleOwner(true);
+    vms_[consoleOwner_].ClearBlocked(VmState::isBlockedOnOutput);
+    Unpark(consoleOwner_);
+}
+
+void Scheduler::Unpark(size_t vm)
+{
+    // Called with parkMutex_ held.
+    if (parked_[vm] && !vms_[vm].IsBlocked())
+    {
+        // The VM has been waiting for something that has now happened, so let it respond before anything else runs.
+        parked_[vm] = false;
+        Enqueue(nextQueue_, vm, true, true);
+        nextQueue_ = (nextQueue_ + 1) % queues_.size();
+    }
+}
+
+void Scheduler::RunTimers()
+{
+    std::unique_lock<std::mutex> lock(parkMutex_);
+    while (running_.load(std::memory_order_acquire) > 0)
+    {
+        const auto now = Lc3C::Clock::now();
+        while (!timers_.empty() && timers_.top().when <= now)
+        {
+            const size_t vm = timers_.top().vm;
+            timers_.pop();
+
+            // A parked VM isn't running, so it is safe to look at its timer.
+            Lc3C::Clock::time_point when;
+            if (parked_[vm] && vms_[vm].IsBlockedOn(VmState::isWaiting) && vms_[vm].WakeTime(when) && when <= now)
+            {
+                vms_[vm].ClearBlocked(VmState::isWaiting);
+                Unpark(vm);
+            }
+        }
+
+        if (timers_.empty())
+        {
+            timersChanged_.wait(lock);
+        }
+        else
+        {
+            timersChanged_.wait_until(lock, timers_.top().when);
+        }
+    }
+}
+
+void Scheduler::WriteMetrics(std::string& out) const
+{
+    using lc3::MetricHeader;
+    using lc3::MetricSample;
+
+    // A metric's samples all follow its header, so each metric is written for every VM, or worker, in turn.
+    std::vector<std::string> vmLabels;
+    for (size_t vm = 0; vm < vms_.Size(); ++vm)
+    {
+        vmLabels.push_back("vm=\"" + std::to_string(vm) + "\"");
+    }
+    const auto forEachVm = [&](const char* name, const char* type, const char* help, const auto& value)
+    {
+        MetricHeader(out, name, type, help);
+        for (size_t vm = 0; vm < vms_.Size(); ++vm)
+        {
+            MetricSample(out, name, vmLabels[vm], value(vms_[vm]));
+        }
+    };
+
+    MetricHeader(out, "lc3_vms", "gauge", "VMs being run.");
+    MetricSample(out, "lc3_vms", "", static_cast<double>(vms_.Size()));
+    MetricHeader(out, "lc3_vms_running", "gauge", "VMs that haven't stopped.");
+    MetricSample(out, "lc3_vms_running", "", static_cast<double>(running_.load(std::memory_order_relaxed)));
+
+    forEachVm("lc3_vm_instructions_total", "counter", "Instructions executed by the VM.",
+              [](const VmState& vm) { return static_cast<double>(vm.Metrics().retired.Get()); });
+    forEachVm("lc3_vm_slices_total", "counter", "Time slices run by the VM.",
+              [](const VmState& vm) { return static_cast<double>(vm.Metrics().slices.Get()); });
+    forEachVm("lc3_vm_run_seconds_total", "counter", "Time spent running the VM's slices.",
+              [](const VmState& vm) { return vm.Metrics().runNanoseconds.Get() / 1e9; });
+    forEachVm("lc3_vm_mips", "gauge", "Millions of instructions executed per second of the VM's slices.",
+              [](const VmState& vm)
+              {
+                  const uint64_t nanoseconds = vm.Metrics().runNanoseconds.Get();
+                  return nanoseconds == 0 ? 0.0 : vm.Metrics().retired.Get() * 1e3 / nanoseconds;
+              });
+
+    static const char* const blockedOn[VmMetrics::BLOCKED_KINDS] = {"input", "output", "event"};
+    MetricHeader(out, "lc3_vm_blocked_seconds_total", "counter",
+                 "Time from the VM blocking until its next slice, by what it was blocked on.");
+    for (size_t vm = 0; vm < vms_.Size(); ++vm)
+    {
+        for (size_t kind = 0; kind < VmMetrics::BLOCKED_KINDS; ++kind)
+        {
+            MetricSample(out, "lc3_vm_blocked_seconds_total", vmLabels[vm] + ",on=\"" + blockedOn[kind] + "\"",
+                         vms_[vm].Metrics().blockedNanoseconds[kind].Get() / 1e9);
+        }
+    }
+
+    MetricHeader(out, "lc3_vm_traps_total", "counter", "Traps fulfilled for the VM, by vector.");
+    for (size_t vm = 0; vm < vms_.Size(); ++vm)
+    {
+        for (size_t kind = 0; kind < Lc3C::TRAP_KINDS; ++kind)
+        {
+            MetricSample(out, "lc3_vm_traps_total", vmLabels[vm] + ",trap=\"" + Lc3C::TrapName(kind) + "\"",
+                         static_cast<double>(vms_[vm].TrapCount(kind)));
+        }
+    }
+
+    const auto forEachWorker = [&](const char* name, const char* help, const auto& value)
+    {
+        MetricHeader(out, name, "counter", help);
+        for (size_t worker = 0; worker < queues_.size(); ++worker)
+        {
+            MetricSample(out, name, "worker=\"" + std::to_string(worker) + "\"",
+                         static_cast<double>(value(workerMetrics_[worker])));
+        }
+    };
+    forEachWorker("lc3_worker_slices_total", "Time slices run by the worker.",
+                  [](const WorkerMetrics& worker) { return worker.slices.Get(); });
+    forEachWorker("lc3_worker_steals_total", "VMs that the worker took from other workers' run queues.",
+                  [](const WorkerMetrics& worker) { return worker.steals.Get(); });
+    forEachWorker("lc3_worker_idles_total", "Times that the worker slept for want of a VM to run.",
+                  [](const WorkerMetrics& worker) { return worker.idles.Get(); });
+
+    if (!hostCounters_)
+    {
+        return;
+    }
+    for (size_t i = 0; i < lc3::HostCounters::COUNT; ++i)
+    {
+        const std::string counter = lc3::HostCounters::NAMES[i];
+        const std::string vmName = "lc3_vm_host_" + counter + "_total";
+        const std::string vmHelp = "The host's " + counter + " counter over the VM's slices, in user mode.";
+        forEachVm(vmName.c_str(), "counter", vmHelp.c_str(),
+                  [i](const VmState& vm) { return static_cast<double>(vm.Metrics().hostCounts[i].Get()); });
+        const std::string workerName = "lc3_worker_host_" + counter + "_total";
+        const std::string workerHelp = "The host's " + counter + " counter over the worker's slices, in user mode.";
+        forEachWorker(workerName.c_str(), workerHelp.c_str(),
+                      [i](const WorkerMetrics& worker) { return worker.hostCounts[i].Get(); });
+    }
+}
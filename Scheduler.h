@@ -0,0 +1,153 @@
+#pragma once
+
+#include "Lc3Metrics.h"
+#include "VmPool.h"
+#include "VmState.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+/// \brief Runs a collection of VMs to completion on a pool of worker threads.
+///
+/// Each worker has its own run queue of VMs. A worker takes VMs from the front of its own queue, runs them for a time
+/// slice, then puts them on the back. A worker whose queue is empty steals from the back of another worker's queue.
+/// VMs that are blocked are parked, i.e., taken out of the run queues altogether, until whatever they are waiting
+/// for happens. A VM that is unparked goes on the front of a queue, so that a VM woken by a key runs as soon as the
+/// slice in front of it ends, and slices are kept short enough to meet the latency in SliceLimits. A separate I/O
+/// thread reads the console and decides which VM owns it, and a timer thread wakes VMs that are waiting for their
+/// timers. Keys go to the console owner through a lock-free queue of its own, so none are lost however fast they are
+/// typed, and the I/O thread only takes a lock to wake the owner if it is waiting for one.
+///
+/// Each VM counts what it does as it runs, e.g., how long it spends blocked, and each worker counts what it does in
+/// counters of its own, so that nothing is shared between workers just for the sake of metrics. WriteMetrics() merges
+/// them when they are read.
+///
+/// Nothing polls. Workers with nothing to run sleep until a VM is queued, the I/O thread sleeps in the console until a
+/// key is pressed, and the timer thread sleeps until the next timer is due, so an idle scheduler uses no CPU.
+class Scheduler
+{
+public:
+    /// \brief The console, as seen by the I/O thread.
+    class Console
+    {
+    public:
+        virtual ~Console() = default;
+
+        /// \brief Blocks until a key is pressed or until Interrupt() is called.
+        /// \return the key that was pressed, or a negative value if the wait was interrupted.
+        virtual int WaitForKey() = 0;
+
+        /// \brief Makes the current or next call to WaitForKey() return. Can be called from any thread.
+        virtual void Interrupt() = 0;
+    };
+
+    /// \brief A console without a keyboard, for VMs that get their input from elsewhere. WaitForKey() just sleeps
+    /// until it is interrupted.
+    class HeadlessConsole : public Console
+    {
+    public:
+        int WaitForKey() override;
+        void Interrupt() override;
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        bool interrupted_{false};
+    };
+
+    /// \brief Creates a scheduler for the given VMs.
+    /// \param vms the VMs to run.
+    /// \param workers the number of worker threads, or 0 to use one per hardware thread.
+    /// \param limits how long the VMs' time slices can be.
+    explicit Scheduler(VmPool&& vms, size_t workers = 0, const SliceLimits& limits = SliceLimits());
+
+    /// \brief Runs all of the VMs until they stop.
+    /// \param console the console to read keys from. Only used by the I/O thread, apart from Interrupt().
+    void Run(Console& console);
+
+    /// \brief Counts the host's hardware events, e.g., cycles and cache misses, over every slice. Call it before Run().
+    /// \return false if the host's counters can't be used, in which case nothing is counted.
+    bool EnableHostCounters();
+
+    /// \brief Appends the VMs' and workers' metrics in the Prometheus text format. Can be called from any thread,
+    /// including while Run() is running.
+    /// \param out the text to append to.
+    void WriteMetrics(std::string& out) const;
+
+private:
+    // How long the I/O thread waits for the console owner to make room for a key before dropping it.
+    static constexpr Lc3C::Clock::duration KEY_TIMEOUT = std::chrono::seconds(1);
+
+    /// \brief A worker's run queue of VMs, given as indices into vms_.
+    class RunQueue
+    {
+    public:
+        void Push(size_t vm);
+        void PushFront(size_t vm);
+        bool Pop(size_t& vm);
+        bool Steal(size_t& vm);
+
+    private:
+        std::mutex mutex_;
+        std::deque<size_t> queue_;
+    };
+
+    /// \brief A VM waiting for its timer.
+    struct Timer
+    {
+        Lc3C::Clock::time_point when; // When to wake the VM.
+        size_t vm;                    // The VM to wake.
+
+        bool operator>(const Timer& other) const { return when > other.when; }
+    };
+
+    /// \brief What a worker has done. It takes a cache line of its own, so that workers don't contend for counters.
+    struct alignas(64) WorkerMetrics
+    {
+        lc3::Counter slices;                               // Time slices run.
+        lc3::Counter steals;                               // VMs taken from other workers' run queues.
+        lc3::Counter idles;                                // Times that the worker went to sleep for want of a VM.
+        lc3::Counter hostCounts[lc3::HostCounters::COUNT]; // The host's hardware counters over the worker's slices.
+    };
+
+    void Work(size_t self);
+    void RunTimers();
+    void Enqueue(size_t queue, size_t vm, bool wake = true, bool front = false);
+    void WaitForWork();
+    bool FindWork(size_t self, size_t& vm);
+    void Reschedule(size_t self, size_t vm);
+    void HandleKey(uint16_t key);
+    void Unpark(size_t vm);
+
+    VmPool vms_;                                     // The VMs being run.
+    std::vector<std::unique_ptr<RunQueue>> queues_;  // One run queue per worker.
+    SliceLimits limits_;                             // How long the VMs' time slices can be.
+    std::atomic<size_t> running_;                    // The number of VMs that haven't stopped.
+    std::atomic<size_t> queued_{0};                  // The number of VMs in the run queues.
+    std::atomic<size_t> idle_{0};                    // The number of workers waiting for a VM to be queued.
+    Console* console_{nullptr};                      // The console, while running.
+    std::unique_ptr<WorkerMetrics[]> workerMetrics_; // One set of metrics per worker.
+    bool hostCounters_{false};                       // True if the host's hardware counters are read around slices.
+
+    std::mutex idleMutex_;                  // Guards idle workers going to sleep.
+    std::condition_variable workAvailable_; // Signalled when a VM is queued while workers are idle.
+
+    std::mutex parkMutex_;     // Guards the fields below, and the decision to park or unpark a VM.
+    std::vector<bool> parked_; // True for each VM that is parked because it is blocked.
+    size_t consoleOwner_{0};   // The VM that currently owns the console.
+    size_t nextQueue_{0};      // The run queue that the next unparked VM goes into.
+
+    // Timers of parked VMs, soonest first. Guarded by parkMutex_. An entry can outlive the wait that it was for, so it
+    // only wakes its VM if the VM is still parked and its timer is due.
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers_;
+    std::condition_variable timersChanged_; // Signalled when a sooner timer is added, or when everything has stopped.
+};
@@ -0,0 +1,52 @@
+#include "VmPool.h"
+
+#include <new>
+#include <utility>
+
+VmPool::VmPool(size_t capacity)
+    : scheduling_{std::make_unique<SchedulingState[]>(capacity)},
+      vms_{static_cast<VmState*>(::operator new(capacity * sizeof(VmState), std::align_val_t{alignof(VmState)}))},
+      capacity_{capacity}
+{
+}
+
+VmPool::VmPool(VmPool&& other) noexcept
+    : scheduling_{std::move(other.scheduling_)}, vms_{std::move(other.vms_)},
+      capacity_{std::exchange(other.capacity_, 0)}, size_{std::exchange(other.size_, 0)}
+{
+}
+
+VmPool& VmPool::operator=(VmPool&& other) noexcept
+{
+    if (this != &other)
+    {
+        Clear();
+        scheduling_ = std::move(other.scheduling_);
+        vms_ = std::move(other.vms_);
+        capacity_ = std::exchange(other.capacity_, 0);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+VmState& VmPool::Emplace()
+{
+    // A slot can be reused after Clear(), so its scheduling state starts afresh too.
+    SchedulingState* scheduling = new (&scheduling_[size_]) SchedulingState();
+    VmState* vm = new (vms_.get() + size_) VmState(*scheduling);
+    ++size_;
+    return *vm;
+}
+
+void VmPool::Clear()
+{
+    while (size_ != 0)
+    {
+        vms_.get()[--size_].~VmState();
+    }
+}
+
+void VmPool::FreeArena::operator()(VmState* vms) const
+{
+    ::operator delete(vms, std::align_val_t{alignof(VmState)});
+}
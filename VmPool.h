@@ -0,0 +1,52 @@
+#pragma once
+
+#include "VmState.h"
+
+#include <cstddef>
+#include <memory>
+
+/// \brief A fixed number of VMs, constructed in place one after another in a single arena.
+///
+/// VMs are made where they will stay, so the VMs themselves take one allocation for the lot rather than one each, and
+/// none is ever copied or moved. Their SchedulingState is packed into an array of its own, a cache line per VM, so
+/// the scheduler deciding what to run touches one line per VM rather than reaching into VMs that are several
+/// kilobytes each. What a VM uses as it runs lives elsewhere and is allocated as it is needed: memory, in pages that
+/// the VMs share until they write to them, and the predecoded instructions and compiled code of the pages it runs.
+///
+/// A pool can be moved, e.g., into a Scheduler, without moving the VMs in it, so pointers to them stay valid.
+class VmPool
+{
+public:
+    /// \brief Creates an empty pool.
+    /// \param capacity the most VMs that the pool can hold.
+    explicit VmPool(size_t capacity);
+    VmPool(VmPool&& other) noexcept;
+    VmPool& operator=(VmPool&& other) noexcept;
+    ~VmPool() { Clear(); }
+
+    /// \brief Constructs a new VM at the end of the pool. The pool mustn't be full.
+    /// \return the VM.
+    VmState& Emplace();
+
+    /// \brief Destroys every VM in the pool, last first.
+    void Clear();
+
+    size_t Size() const { return size_; }
+    size_t Capacity() const { return capacity_; }
+    bool Empty() const { return size_ == 0; }
+
+    VmState& operator[](size_t vm) { return vms_.get()[vm]; }
+    const VmState& operator[](size_t vm) const { return vms_.get()[vm]; }
+
+private:
+    /// \brief Frees the arena without destroying anything in it, which Clear() has already done.
+    struct FreeArena
+    {
+        void operator()(VmState* vms) const;
+    };
+
+    std::unique_ptr<SchedulingState[]> scheduling_; // The VMs' scheduling state, indexed like the VMs.
+    std::unique_ptr<VmState, FreeArena> vms_;       // Room for capacity_ VMs, of which the first size_ exist.
+    size_t capacity_{0};                            // The most VMs that the pool can hold.
+    size_t size_{0};                                // The number of VMs in the pool.
+};
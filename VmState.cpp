@@ -0,0 +1,342 @@
+#include "VmState.h"
+
+#include <algorithm>
+
+bool VmState::Run(const SliceLimits& limits)
+{
+#if defined(LC3_COROUTINES)
+    // The coroutine picks up from wherever it left off, e.g., fulfilling the trap that it was waiting on.
+    limits_ = &limits;
+    if (!task_)
+    {
+        task_ = Execute();
+    }
+    return task_.Resume();
+#else
+    lc3::Status status = lc3_.GetStatus();
+    if (status.IsStopped())
+    {
+        // The VM stopped before it got here, e.g., it was restored from a snapshot of a VM that had already stopped.
+        return false;
+    }
+
+    // Run until the VM stops, blocks or uses up its ticks. A trap that doesn't block is fulfilled straight away rather
+    // than costing a trip through the scheduler, unless the slice has already taken as long as it should.
+    BeginSlice();
+    while (!status.IsStopped() && !IsBlocked())
+    {
+        if (status.IsTrapped())
+        {
+            status = lc3_.Trap(status.GetTrap());
+            continue;
+        }
+
+        status = lc3_.Run(SliceTicks());
+        if (status.IsTrapped())
+        {
+            status = BlockOnTrap(status.GetTrap());
+        }
+        else if (status.IsRunning())
+        {
+            if (lc3_.IsIdle())
+            {
+                // The VM is spinning until a device has something for it, so treat it as if it had trapped to WAIT.
+                WaitForEvent();
+                status = lc3_.GetStatus();
+            }
+            else
+            {
+                usedSlice_ = true;
+            }
+            break;
+        }
+
+        if (Lc3C::Clock::now() - sliceStart_ >= limits.latency)
+        {
+            break;
+        }
+    }
+    EndSlice(limits, status);
+    return !status.IsStopped();
+#endif
+}
+
+#if defined(LC3_COROUTINES)
+/// \brief Ends the VM's slice and suspends it until the scheduler runs it again, then starts a new slice.
+struct VmState::NextSlice
+{
+    VmState& vm;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<>) const { vm.EndSlice(*vm.limits_, vm.lc3_.GetStatus()); }
+    void await_resume() const { vm.BeginSlice(); }
+};
+
+lc3::Task VmState::Execute()
+{
+    // The same as Run() without coroutines, except that a trap that has to wait suspends the VM where it is, and the
+    // VM carries on from there when it is resumed, rather than working out what it was doing all over again.
+    BeginSlice();
+    for (lc3::Status status = lc3_.GetStatus(); !status.IsStopped();)
+    {
+        if (status.IsTrapped())
+        {
+            // A trap that doesn't block is fulfilled straight away, unless the slice has already taken as long as it
+            // should, in which case it is fulfilled at the start of the next one.
+            const uint16_t trap = status.GetTrap();
+            if (const uint32_t flags = TrapWaitsFor(trap); flags != 0)
+            {
+                SetBlocked(flags);
+                co_await NextSlice{*this};
+            }
+            else if (Lc3C::Clock::now() - sliceStart_ >= limits_->latency)
+            {
+                co_await NextSlice{*this};
+            }
+            status = lc3_.GetStatus().IsStopped() ? lc3_.GetStatus() : lc3_.Trap(trap);
+            continue;
+        }
+
+        status = lc3_.Run(SliceTicks());
+        if (status.IsRunning())
+        {
+            if (lc3_.IsIdle())
+            {
+                // The VM is spinning until a device has something for it, so treat it as if it had trapped to WAIT.
+                WaitForEvent();
+            }
+            else
+            {
+                usedSlice_ = true;
+            }
+            if (!lc3_.GetStatus().IsStopped())
+            {
+                co_await NextSlice{*this};
+            }
+            status = lc3_.GetStatus();
+        }
+    }
+
+    // However the VM stopped, finish off its last slice.
+    EndSlice(*limits_, lc3_.GetStatus());
+}
+#endif
+
+void VmState::BeginSlice()
+{
+    FeedKey();
+    lc3_.ClearIdle();
+
+    // Output written while the VM still owned the console goes out before the display stops being ready.
+    const bool displayReady = hasOwnOutput_ || ownsConsole_.load(std::memory_order_acquire);
+    if (!displayReady && lc3_.DisplayReady())
+    {
+        lc3_.Output().Flush();
+    }
+    lc3_.SetDisplayReady(displayReady);
+
+    sliceStart_ = Lc3C::Clock::now();
+    sliceRetired_ = lc3_.Retired();
+    usedSlice_ = false;
+
+    // Blocking on several things at once, e.g., on input while not owning the console, counts as the first of them.
+    if (blockedOn_ != 0)
+    {
+        const size_t kind = (blockedOn_ & isBlockedOnInput)    ? VmMetrics::BLOCKED_ON_INPUT
+                            : (blockedOn_ & isBlockedOnOutput) ? VmMetrics::BLOCKED_ON_OUTPUT
+                                                               : VmMetrics::BLOCKED_ON_EVENT;
+        metrics_.blockedNanoseconds[kind].Add(Nanoseconds(sliceStart_ - blockedSince_));
+        blockedOn_ = 0;
+    }
+}
+
+void VmState::EndSlice(const SliceLimits& limits, lc3::Status status)
+{
+    // A VM that used the display while it wasn't ready waits to own the console, as it would for an output trap.
+    if (lc3_.IsWaitingForDisplay() && !status.IsStopped())
+    {
+        SetBlocked(isBlockedOnOutput);
+    }
+
+    const auto now = Lc3C::Clock::now();
+    AdaptQuantum(limits, usedSlice_, now - sliceStart_);
+    metrics_.slices.Add();
+    metrics_.retired.Add(lc3_.Retired() - sliceRetired_);
+    metrics_.runNanoseconds.Add(Nanoseconds(now - sliceStart_));
+    blockedOn_ = scheduling_.blocked.load(std::memory_order_acquire);
+    blockedSince_ = now;
+    if (status.IsStopped())
+    {
+        lc3_.EndTrace();
+    }
+
+    // Flush output in batches, but always before the VM waits for anything or stops, so that nothing it has written
+    // is left sitting in the buffer. Output written while the display wasn't ready waits until the VM owns the console.
+    auto& output = lc3_.Output();
+    if (!output.Empty() && (status.IsStopped() || (lc3_.DisplayReady() && (IsBlocked() || output.FlushDue(now)))))
+    {
+        output.Flush();
+    }
+}
+
+void VmState::AdaptQuantum(const SliceLimits& limits, bool usedSlice, Lc3C::Clock::duration elapsed)
+{
+    if (usedSlice)
+    {
+        // The VM is compute-bound, so reschedule it less often, as long as its slices stay short enough.
+        if (elapsed > limits.latency)
+        {
+            scheduling_.quantum = std::max(scheduling_.quantum / 2, limits.minTicks);
+        }
+        else if (elapsed * 2 <= limits.latency)
+        {
+            scheduling_.quantum = std::min(scheduling_.quantum * 2, limits.maxTicks);
+        }
+    }
+    else if (IsBlocked())
+    {
+        // The VM is interactive, so start it off with a short slice when it wakes.
+        scheduling_.quantum = limits.minTicks;
+    }
+}
+
+lc3::Status VmState::BlockOnTrap(uint16_t trap)
+{
+    if (const uint32_t flags = TrapWaitsFor(trap); flags != 0)
+    {
+        SetBlocked(flags);
+    }
+    return lc3_.GetStatus();
+}
+
+uint32_t VmState::TrapWaitsFor(uint16_t trap)
+{
+    // The VM has become trapped, so find out what it needs to fulfil the trap, e.g., input, and so what it has to be
+    // blocked on until that condition is fulfilled.
+    switch (static_cast<Lc3C::Traps>(trap & 0xff))
+    {
+    case Lc3C::Traps::TRAP_GETC:
+    case Lc3C::Traps::TRAP_IN:
+        if (!hasOwnInput_)
+        {
+            return isBlockedOnInput;
+        }
+        if (!FeedKey())
+        {
+            // Nothing will ever fulfil the trap, so there's no point in waiting.
+            lc3_.Halt();
+            starved_ = true;
+        }
+        return 0;
+
+    case Lc3C::Traps::TRAP_WAIT:
+        return EventWaitsFor();
+
+    case Lc3C::Traps::TRAP_OUT:
+    case Lc3C::Traps::TRAP_PUTS:
+    case Lc3C::Traps::TRAP_PUTSP:
+        // Only output to the console has to wait for the VM to own it.
+        return hasOwnOutput_ ? 0u : static_cast<uint32_t>(isBlockedOnOutput);
+
+    default:
+        return 0;
+    }
+}
+
+void VmState::WaitForEvent()
+{
+    // A VM spinning on DSR is waiting for the console rather than for a key or the timer.
+    if (const uint32_t flags = lc3_.IsWaitingForDisplay() ? isBlockedOnOutput : EventWaitsFor(); flags != 0)
+    {
+        SetBlocked(flags);
+    }
+}
+
+uint32_t VmState::EventWaitsFor()
+{
+    // There's no need to wait if there's a key or the timer has already expired.
+    if (FeedKey() || lc3_.TimerExpired(Lc3C::Clock::now()))
+    {
+        return 0;
+    }
+    if (!hasOwnInput_ || lc3_.TimerRunning())
+    {
+        return isWaiting;
+    }
+
+    // The VM's input has run out and there's no timer, so it would wait forever.
+    lc3_.Halt();
+    starved_ = true;
+    return 0;
+}
+
+bool VmState::WakeTime(Lc3C::Clock::time_point& when) const
+{
+    if (!lc3_.TimerRunning())
+    {
+        return false;
+    }
+    when = lc3_.TimerDeadline();
+    return true;
+}
+
+void VmState::Restore(const lc3::Snapshot& snapshot)
+{
+    lc3_.Restore(snapshot);
+    scheduling_.blocked.store(0, std::memory_order_release);
+    starved_ = false;
+#if defined(LC3_COROUTINES)
+    task_ = lc3::Task();
+#endif
+
+    // A snapshot taken while the VM was waiting for a trap, e.g., for input, carries on waiting.
+    if (const auto status = lc3_.GetStatus(); status.IsTrapped())
+    {
+        BlockOnTrap(status.GetTrap());
+    }
+}
+
+VmState::~VmState()
+{
+    lc3_.Output().Flush();
+}
+
+bool VmState::OpenOutput(const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+    {
+        return false;
+    }
+    lc3_.Output().SetFile(file);
+    outputFile_.reset(file);
+    hasOwnOutput_ = true;
+    lc3_.SetInlineOutput(true);
+    return true;
+}
+
+void VmState::CaptureOutput()
+{
+    lc3_.Output().Capture();
+    outputFile_.reset();
+    hasOwnOutput_ = true;
+    lc3_.SetInlineOutput(true);
+}
+
+void VmState::SetInput(std::string input)
+{
+    input_ = std::move(input);
+    inputPos_ = 0;
+    hasOwnInput_ = true;
+}
+
+bool VmState::FeedKey()
+{
+    // Hand the VM its next key as soon as it has read the last one, whether it reads them with traps or by polling
+    // the keyboard registers.
+    if (hasOwnInput_ && !lc3_.HasKey() && inputPos_ < input_.size())
+    {
+        lc3_.SetKey(static_cast<uint8_t>(input_[inputPos_++]));
+    }
+    return lc3_.HasKey();
+}
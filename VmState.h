@@ -0,0 +1,247 @@
+#pragma once
+
+#include "Lc3C.h"
+#include "Lc3Metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#if defined(LC3_COROUTINES)
+#include "Lc3Task.h"
+#endif
+
+/// \brief Limits on how long a VM's time slices are.
+///
+/// A slice starts out as a number of ticks between minTicks and maxTicks, scaled by the VM's priority. A VM that
+/// runs for the whole of its slice without waiting for anything gets twice as many ticks next time, and a VM that
+/// blocks goes back to minTicks, so compute-bound VMs are rescheduled rarely and interactive VMs give their worker
+/// back quickly. Slices are also kept to about latency: a VM whose slice took longer gets half as many ticks next
+/// time, and a slice stops fulfilling traps once it has taken that long. That bounds how long a VM that has just been
+/// woken, e.g., by a key, waits for a worker.
+struct SliceLimits
+{
+    int minTicks{256};                                            // The fewest ticks in a slice, at priority 0.
+    int maxTicks{32768};                                          // The most ticks in a slice, at priority 0.
+    Lc3C::Clock::duration latency{std::chrono::milliseconds(2)}; // The longest that a slice should take.
+};
+
+/// \brief The part of a VM's state that the scheduler looks at to decide whether to run it and for how long.
+///
+/// It is kept apart from the VM so that a VmPool can pack it densely, and it takes a cache line of its own so that
+/// workers updating the flags of VMs side by side don't contend for the same line.
+struct alignas(64) SchedulingState
+{
+    std::atomic<uint32_t> blocked{0}; // Bitfields that indicate why the VM is blocked.
+    int quantum{1024};                // Ticks in the next slice, before scaling by priority.
+    int priority{0};                  // Scales the length of the VM's slices.
+};
+
+/// \brief What a VM has done, counted as it runs. Only the worker running the VM adds to the counts, but they can be
+/// read from any thread at any time, e.g., to export them while the VM runs.
+struct VmMetrics
+{
+    enum : size_t
+    {
+        BLOCKED_ON_INPUT,  // Waiting for a key.
+        BLOCKED_ON_OUTPUT, // Waiting to own the console.
+        BLOCKED_ON_EVENT,  // Waiting for a key or for the VM's timer to expire.
+        BLOCKED_KINDS
+    };
+
+    lc3::Counter slices;                               // Time slices run.
+    lc3::Counter retired;                              // Instructions executed, as of the end of the last slice.
+    lc3::Counter runNanoseconds;                       // Time spent running slices.
+    lc3::Counter blockedNanoseconds[BLOCKED_KINDS];    // Time from blocking until the next slice, by what it was for.
+    lc3::Counter hostCounts[lc3::HostCounters::COUNT]; // The host's hardware counters over the VM's slices.
+};
+
+/// \brief A console VM together with the reasons why it can't currently make progress.
+///
+/// A VmState is shared between the scheduler's worker threads and its I/O thread, so it is neither copyable nor
+/// movable. Only one worker runs a given VM at a time, but keys and blocked flags may be changed from the I/O thread.
+/// VMs are made by a VmPool, which keeps their SchedulingState for them.
+class VmState
+{
+public:
+    enum : uint32_t
+    {
+        isBlockedOnInput = 0x01,  // Waiting for a key.
+        isBlockedOnOutput = 0x02, // Waiting to own the console.
+        isWaiting = 0x04          // Waiting for a key or for the VM's timer to expire.
+    };
+
+    static constexpr int MIN_PRIORITY = -4;
+    static constexpr int MAX_PRIORITY = 4;
+
+    explicit VmState(SchedulingState& scheduling) : scheduling_{scheduling} {}
+    VmState(const VmState&) = delete;
+    VmState& operator=(const VmState&) = delete;
+    ~VmState();
+
+    /// \brief Runs the VM for one time slice, fulfilling its pending trap first if it is no longer blocked.
+    /// \param limits how long the slice can be.
+    /// \return false if the VM has stopped, true otherwise.
+    ///
+    /// Traps that don't have to wait for anything, such as output to a file of the VM's own, are fulfilled within the
+    /// slice rather than ending it. When built with LC3_COROUTINES, the VM runs as a coroutine that suspends wherever
+    /// it has to wait, e.g., in a trap that is waiting for a key, and this resumes it from there.
+    bool Run(const SliceLimits& limits = SliceLimits());
+
+    /// \brief Sets the VM's priority, from MIN_PRIORITY to MAX_PRIORITY. Each step up doubles the length of the VM's
+    /// slices, and so roughly doubles its share of a worker when it is competing with other compute-bound VMs.
+    void SetPriority(int priority)
+    {
+        scheduling_.priority = priority < MIN_PRIORITY ? MIN_PRIORITY : priority > MAX_PRIORITY ? MAX_PRIORITY : priority;
+    }
+
+    int Priority() const { return scheduling_.priority; }
+
+    /// \brief Queues a key for the VM, behind any that it hasn't read yet. Lock-free, and can be called while the VM
+    /// runs, but only ever from one thread, e.g., the scheduler's I/O thread.
+    /// \param key the key.
+    /// \return false if the VM has too many keys waiting already, and the key wasn't queued.
+    bool DeliverKey(uint16_t key) { return lc3_.QueueKey(key); }
+
+    /// \brief Returns true if the VM may be waiting for a key, and so needs waking after one is delivered by clearing
+    /// its blocked flags and unparking it.
+    ///
+    /// Both this and SetBlocked() are sequentially consistent, as is queueing a key, so either the thread that
+    /// delivered the key sees the VM blocking, or the VM's worker sees the key when it checks HasPendingKey() before
+    /// parking the VM.
+    bool IsWaitingForKey() const
+    {
+        return (scheduling_.blocked.load(std::memory_order_seq_cst) & (isBlockedOnInput | isWaiting)) != 0;
+    }
+
+    /// \brief Returns true if a key has been delivered that the VM hasn't read yet. Can be called from any thread.
+    bool HasPendingKey() const { return lc3_.HasQueuedKey(); }
+
+    /// \brief Returns when a VM that is waiting should be woken even if no key arrives.
+    /// \param when receives the time.
+    /// \return false if only a key can wake it. Only call it while the VM isn't running.
+    bool WakeTime(Lc3C::Clock::time_point& when) const;
+
+    bool IsBlocked() const { return scheduling_.blocked.load(std::memory_order_acquire) != 0; }
+    bool IsBlockedOn(uint32_t flags) const { return (scheduling_.blocked.load(std::memory_order_acquire) & flags) != 0; }
+    void SetBlocked(uint32_t flags) { scheduling_.blocked.fetch_or(flags, std::memory_order_seq_cst); }
+    void ClearBlocked(uint32_t flags) { scheduling_.blocked.fetch_and(~flags, std::memory_order_acq_rel); }
+
+    bool ReadImage(const char* filename) { return lc3_.ReadImage(filename); }
+    void SetImage(const lc3::PagedMemory& image) { lc3_.SetImage(image); }
+    void Prepare(const lc3::Analysis& analysis) { lc3_.Prepare(analysis); }
+
+    /// \brief Watches a range of addresses for the given kinds of access. See lc3::MemoryMonitor::Watch().
+    void Watch(uint16_t start, uint16_t end, uint8_t access) { lc3_.GetMonitor().Watch(start, end, access); }
+
+    /// \brief Returns the number of instructions that the VM has executed.
+    uint64_t Retired() const { return lc3_.Retired(); }
+
+    /// \brief Returns the VM's metrics. Can be called from any thread.
+    const VmMetrics& Metrics() const { return metrics_; }
+
+    /// \brief Returns the number of traps of the given kind that the VM has fulfilled. See Lc3C::TrapCount().
+    uint64_t TrapCount(size_t kind) const { return lc3_.TrapCount(kind); }
+
+    /// \brief Adds the host's hardware counts over one of the VM's slices to its metrics. Only call it from the worker
+    /// that ran the slice.
+    /// \param counts how much each counter went up by, indexed by lc3::HostCounters::CYCLES, etc.
+    void AddHostCounts(const uint64_t (&counts)[lc3::HostCounters::COUNT])
+    {
+        for (size_t i = 0; i < lc3::HostCounters::COUNT; ++i)
+        {
+            metrics_.hostCounts[i].Add(counts[i]);
+        }
+    }
+
+    /// \brief Returns true if the VM was halted because it waited for input after its own input had run out, rather
+    /// than halting of its own accord.
+    bool Starved() const { return starved_; }
+
+    /// \brief Takes a snapshot of the VM. See Lc3C::Save().
+    lc3::Snapshot Save() const { return lc3_.Save(); }
+
+    /// \brief Restores the VM from a snapshot, waiting for whatever the snapshot was waiting for. See Lc3C::Restore().
+    /// Only call it while the VM isn't being scheduled, and after setting up its input and output.
+    void Restore(const lc3::Snapshot& snapshot);
+
+    /// \brief Tells the VM whether it owns the console. A VM whose output goes to the console finds the display ready
+    /// only while it owns it, from the start of its next slice. Can be called from any thread, e.g., the I/O thread.
+    void SetConsoleOwner(bool owner) { ownsConsole_.store(owner, std::memory_order_release); }
+
+    /// \brief Sends the VM's output to a file of its own instead of the console. The VM then never has to wait for
+    /// the console to write output.
+    /// \param filename the file to write to. It can be a named pipe.
+    /// \return false if the file couldn't be opened.
+    bool OpenOutput(const char* filename);
+
+    /// \brief Captures the VM's output in memory instead of writing it to the console.
+    void CaptureOutput();
+
+    /// \brief Returns the output captured since CaptureOutput() was called. Only call it once the VM has stopped.
+    const std::string& CapturedOutput() { return lc3_.Output().Captured(); }
+
+    /// \brief Records a trace of the VM's nondeterministic input from its current state, so that the run can be
+    /// replayed. The trace is closed when the VM stops. Call it after Restore(), before the VM is scheduled.
+    /// \param filename the name of the trace file to write.
+    /// \return false if the file couldn't be created.
+    bool StartTrace(const char* filename) { return lc3_.StartTrace(filename); }
+
+    /// \brief Feeds the VM's keyboard from the given input instead of the console, so that the VM never waits for a
+    /// key. A VM that asks for a key once the input has run out is halted.
+    /// \param input the keys, in the order that the VM reads them.
+    void SetInput(std::string input);
+
+private:
+    int SliceTicks() const
+    {
+        const int quantum = scheduling_.quantum;
+        const int priority = scheduling_.priority;
+        return priority >= 0 ? quantum << priority : quantum >> -priority;
+    }
+    static uint64_t Nanoseconds(Lc3C::Clock::duration duration)
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+    void BeginSlice();
+    void EndSlice(const SliceLimits& limits, lc3::Status status);
+    void AdaptQuantum(const SliceLimits& limits, bool usedSlice, Lc3C::Clock::duration elapsed);
+
+    lc3::Status BlockOnTrap(uint16_t trap);
+    uint32_t TrapWaitsFor(uint16_t trap);
+    void WaitForEvent();
+    uint32_t EventWaitsFor();
+    bool FeedKey();
+
+#if defined(LC3_COROUTINES)
+    struct NextSlice;
+    lc3::Task Execute();
+
+    lc3::Task task_;                     // The coroutine running the VM, started by the first Run().
+    const SliceLimits* limits_{nullptr}; // The limits passed to the Run() that resumed the coroutine.
+#endif
+
+    // The VM's own output file, if it has one. Declared first so that it outlives the VM's output buffer.
+    std::unique_ptr<FILE, int (*)(FILE*)> outputFile_{nullptr, &fclose};
+
+    SchedulingState& scheduling_;          // Whether the VM is blocked and how long its slices are, kept by its pool.
+    Lc3C lc3_;                             // The VM itself, which holds the keys delivered to it.
+    bool hasOwnOutput_{false};             // True if output goes to a file or to memory rather than the console.
+    bool hasOwnInput_{false};              // True if keys come from input_ rather than the console.
+    bool starved_{false};                  // True if the VM was halted for want of input.
+    std::atomic<bool> ownsConsole_{false}; // True if the VM owns the console. Set by the scheduler.
+    std::string input_;                    // The VM's own input.
+    size_t inputPos_{0};                   // The next key in input_.
+    bool usedSlice_{false};                // True if the VM ran for the whole of its current slice.
+
+    Lc3C::Clock::time_point sliceStart_{}; // When the current slice started.
+    uint64_t sliceRetired_{0};             // Retired() when the current slice started.
+
+    VmMetrics metrics_;                      // What the VM has done.
+    uint32_t blockedOn_{0};                  // The blocked flags that the last slice ended with.
+    Lc3C::Clock::time_point blockedSince_{}; // When the last slice ended, if it ended blocked.
+};
@@ -1,15 +1,37 @@
-#include "LC3.h"
-#include "Lc3C.h"
+#include "Cluster.h"
+#include "Lc3Analysis.h"
+#include "Lc3Image.h"
+#include "Lc3Snapshot.h"
+#include "Scheduler.h"
+#include "VmPool.h"
+#include "VmState.h"
 
-#include <Windows.h>
-#include <conio.h>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
 namespace
 {
+#if defined(_WIN32)
     HANDLE hStdin = INVALID_HANDLE_VALUE;
     DWORD oldMode;
 
@@ -33,150 +55,809 @@ namespace
         SetConsoleMode(hStdin, oldMode);
     }
 
-    void HandleInterrupt(int signal)
+    /// \brief The Windows console. Waits on the console input handle rather than polling it.
+    class WindowsConsole : public Scheduler::Console
+    {
+    public:
+        WindowsConsole() : interrupt_{CreateEvent(nullptr, TRUE, FALSE, nullptr)} {}
+        ~WindowsConsole() override { CloseHandle(interrupt_); }
+
+        int WaitForKey() override
+        {
+            const HANDLE handles[] = {hStdin, interrupt_};
+            for (;;)
+            {
+                // The input handle is signalled for any input event, so throw away everything that isn't a keypress.
+                INPUT_RECORD record;
+                DWORD count = 0;
+                while (PeekConsoleInput(hStdin, &record, 1, &count) && count == 1)
+                {
+                    ReadConsoleInput(hStdin, &record, 1, &count);
+                    if (record.EventType == KEY_EVENT && record.Event.KeyEvent.bKeyDown && record.Event.KeyEvent.uChar.AsciiChar != 0)
+                    {
+                        return static_cast<uint8_t>(record.Event.KeyEvent.uChar.AsciiChar);
+                    }
+                }
+
+                if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+                {
+                    return -1;
+                }
+            }
+        }
+
+        void Interrupt() override { SetEvent(interrupt_); }
+
+    private:
+        HANDLE interrupt_; // Signalled to interrupt WaitForKey().
+    };
+
+    using PlatformConsole = WindowsConsole;
+#else
+    termios oldAttributes;
+    bool restoreAttributes = false;
+
+    void DisableInputBuffering()
+    {
+        // Save the old terminal attributes. Input that isn't a terminal, e.g., a pipe, has nothing to change.
+        if (tcgetattr(STDIN_FILENO, &oldAttributes) != 0)
+        {
+            return;
+        }
+        restoreAttributes = true;
+
+        // Disable echo and line input.
+        termios newAttributes = oldAttributes;
+        newAttributes.c_lflag &= ~(ICANON | ECHO);
+        newAttributes.c_cc[VMIN] = 1;
+        newAttributes.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &newAttributes);
+    }
+
+    void RestoreInputBuffering()
+    {
+        if (restoreAttributes)
+        {
+            tcsetattr(STDIN_FILENO, TCSANOW, &oldAttributes);
+        }
+    }
+
+    /// \brief The terminal on POSIX hosts. Waits in poll() on standard input and on a pipe that is written to
+    /// interrupt the wait.
+    class PosixConsole : public Scheduler::Console
+    {
+    public:
+        PosixConsole()
+        {
+            if (pipe(interrupt_) != 0)
+            {
+                perror("pipe");
+                exit(1);
+            }
+        }
+
+        ~PosixConsole() override
+        {
+            close(interrupt_[0]);
+            close(interrupt_[1]);
+        }
+
+        int WaitForKey() override
+        {
+            for (;;)
+            {
+                // Once standard input is at its end, e.g., a file that has been read, only wait to be interrupted.
+                pollfd fds[] = {{interrupt_[0], POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+                if (poll(fds, endOfInput_ ? 1 : 2, -1) < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    return -1;
+                }
+
+                // The pipe is never drained, so once interrupted, every wait returns straight away.
+                if (fds[0].revents != 0)
+                {
+                    return -1;
+                }
+
+                unsigned char c;
+                const ssize_t result = read(STDIN_FILENO, &c, 1);
+                if (result == 1)
+                {
+                    return c;
+                }
+                if (result == 0 || errno != EINTR)
+                {
+                    endOfInput_ = true;
+                }
+            }
+        }
+
+        void Interrupt() override
+        {
+            const char c = 0;
+            while (write(interrupt_[1], &c, 1) < 0 && errno == EINTR)
+            {
+            }
+        }
+
+    private:
+        int interrupt_[2]{-1, -1}; // A pipe that is written to interrupt WaitForKey().
+        bool endOfInput_{false};   // True once standard input has nothing left to read.
+    };
+
+    using PlatformConsole = PosixConsole;
+#endif
+
+    void HandleInterrupt(int /*signal*/)
     {
         RestoreInputBuffering();
         printf("\n");
         exit(-2);
     }
-} // namespace
 
-class VmState
-{
-public:
-    enum : uint32_t
+    /// \brief Reads a whole file.
+    /// \param filename the name of the file to read.
+    /// \param contents receives the contents of the file.
+    /// \return false if the file couldn't be read.
+    bool ReadFile(const std::string& filename, std::string& contents)
     {
-        isBlockedOnInput = 0x01,
-        isBlockedOnOutput = 0x02
-    };
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (!file)
+        {
+            return false;
+        }
+        contents.clear();
+        char buffer[4096];
+        for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) != 0;)
+        {
+            contents.append(buffer, n);
+        }
+        const bool ok = !ferror(file);
+        fclose(file);
+        return ok;
+    }
 
-    bool Run();
-    void SetKey(uint16_t key) { lc3_.SetKey(key); }
+    /// \brief Writes a scheduler's metrics to a file every so often while it runs, and once more when it has finished.
+    ///
+    /// The file is replaced rather than rewritten, so that whatever reads it, e.g., the textfile collector of a
+    /// Prometheus node exporter, never sees half of one dump and half of another.
+    class MetricsWriter
+    {
+    public:
+        /// \brief Starts writing metrics.
+        /// \param scheduler the scheduler whose metrics to write.
+        /// \param filename the file to write them to.
+        /// \param interval how long to wait between writes.
+        MetricsWriter(const Scheduler& scheduler, std::string filename, std::chrono::milliseconds interval)
+            : scheduler_{scheduler}, filename_{std::move(filename)}, interval_{interval},
+              thread_{&MetricsWriter::Run, this}
+        {
+        }
 
-    bool IsBlocked() const { return blocked_ != 0; }
-    void SetBlocked(uint32_t flags) { blocked_ |= flags; }
-    void ClearBlocked(uint32_t flags) { blocked_ &= ~flags; }
+        ~MetricsWriter()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            stop_.notify_one();
+            thread_.join();
+            Write();
+        }
+
+    private:
+        void Run()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_.wait_for(lock, interval_, [this]() { return stopping_; }))
+            {
+                Write();
+            }
+        }
 
-    bool ReadImage(const char* filename) { return lc3_.ReadImage(filename); }
+        void Write() const
+        {
+            std::string text;
+            scheduler_.WriteMetrics(text);
+            const std::string temporary = filename_ + ".tmp";
+            FILE* file = fopen(temporary.c_str(), "wb");
+            bool ok = file && fwrite(text.data(), 1, text.size(), file) == text.size();
+            ok = file && fclose(file) == 0 && ok;
+#if defined(_WIN32)
+            // Windows won't rename over a file that exists.
+            remove(filename_.c_str());
+#endif
+            if (!ok || rename(temporary.c_str(), filename_.c_str()) != 0)
+            {
+                fprintf(stderr, "failed to write metrics: %s\n", filename_.c_str());
+            }
+        }
 
-private:
-    static bool IsRunning(const lc3::State& state) { return std::holds_alternative<lc3::Running>(state); };
-    static bool IsStopped(const lc3::State& state) { return std::holds_alternative<lc3::Stopped>(state); };
-    static bool IsTrapped(const lc3::State& state) { return std::holds_alternative<lc3::Trapped>(state); };
+        const Scheduler& scheduler_;               // The scheduler whose metrics are written.
+        const std::string filename_;               // The file to write them to.
+        const std::chrono::milliseconds interval_; // How long to wait between writes.
+        std::mutex mutex_;                         // Guards stopping_.
+        std::condition_variable stop_;             // Signalled when stopping_ is set.
+        bool stopping_{false};                     // True once the scheduler has finished.
+        std::thread thread_;                       // Writes the metrics periodically. Declared last, as it uses the rest.
+    };
 
-    Lc3C lc3_;            // The VM itself.
-    uint32_t blocked_{0}; // Bitfields that indicate why the VM is blocked.
-};
+    /// \brief Runs a scheduler until all of its VMs stop, writing its metrics as it goes if asked to.
+    /// \param scheduler the scheduler.
+    /// \param console the console to read keys from.
+    /// \param metrics the file to write metrics to, or nullptr for none.
+    /// \param metricsInterval how many seconds to wait between writing metrics.
+    /// \param hostCounters true to include the host's hardware counters in the metrics.
+    void RunScheduler(Scheduler& scheduler, Scheduler::Console& console, const char* metrics, double metricsInterval,
+                      bool hostCounters)
+    {
+        if (hostCounters && !scheduler.EnableHostCounters())
+        {
+            fprintf(stderr, "the host's hardware counters aren't available, so the metrics won't include them\n");
+        }
+        std::unique_ptr<MetricsWriter> writer;
+        if (metrics)
+        {
+            const auto interval = std::chrono::duration<double>(metricsInterval);
+            writer = std::make_unique<MetricsWriter>(scheduler, metrics,
+                                                     std::chrono::duration_cast<std::chrono::milliseconds>(interval));
+        }
+        scheduler.Run(console);
+    }
 
-bool VmState::Run()
-{
-    if (lc3::State state = lc3_.GetState(); !IsStopped(state))
+    /// \brief Boots an image until it first waits for input, stops, or has executed the given number of instructions,
+    /// then writes a snapshot of it. Any output is written to stdout.
+    /// \return true if the snapshot was written.
+    bool MakeSnapshot(const char* imageFilename, const char* snapshotFilename, long long maxInstructions)
     {
-        // If the VM is trapped and it isn't blocked then execute the trap.
-        if (IsTrapped(state) && !IsBlocked())
+        lc3::Snapshot image;
+        if (!Lc3C::ReadImage(imageFilename, image))
         {
-            state = lc3_.Trap(std::get<lc3::Trapped>(state).trap);
+            return false;
         }
 
-        // If the VM can run then run it.
-        if (IsRunning(state))
+        // The VM is far too big for the stack.
+        auto vm = std::make_unique<Lc3C>();
+        vm->Restore(image);
+        // Run() returns at every trap, so count the instructions that it actually retired rather than the ticks asked for.
+        constexpr int slice = 1 << 20;
+        const uint64_t start = vm->Retired();
+        for (;;)
         {
-            constexpr size_t maxTicks = 1000;
-            state = lc3_.Run(maxTicks);
-            if (IsTrapped(state))
+            const auto executed = static_cast<long long>(vm->Retired() - start);
+            if (maxInstructions >= 0 && executed >= maxInstructions)
+            {
+                break;
+            }
+            const int ticks = maxInstructions < 0 ? slice : static_cast<int>(std::min<long long>(slice, maxInstructions - executed));
+            lc3::Status status = vm->Run(ticks);
+            if (status.IsTrapped())
             {
-                // The VM has become trapped, so find out what it needs to fulfil the trap, e.g., input, and block it
-                // until that condition is fulfilled.
-                auto& trapped = std::get<lc3::Trapped>(state);
-                switch (static_cast<Lc3C::Traps>(trapped.trap & 0xff))
+                const auto trap = static_cast<Lc3C::Traps>(status.GetTrap() & 0xff);
+                if (trap == Lc3C::Traps::TRAP_GETC || trap == Lc3C::Traps::TRAP_IN)
                 {
-                case Lc3C::Traps::TRAP_GETC:
-                case Lc3C::Traps::TRAP_IN:
-                    SetBlocked(isBlockedOnInput);
                     break;
+                }
+                status = vm->Trap(status.GetTrap());
+            }
+            if (status.IsStopped())
+            {
+                break;
+            }
+        }
+        vm->Output().Flush();
+        return lc3::WriteSnapshot(vm->Save(), snapshotFilename);
+    }
 
-                case Lc3C::Traps::TRAP_OUT:
-                case Lc3C::Traps::TRAP_PUTS:
-                case Lc3C::Traps::TRAP_PUTSP:
-                    SetBlocked(isBlockedOnOutput);
-                    break;
+    /// \brief Replays a trace against the image or snapshot that it was recorded from. Any output is written to stdout.
+    /// \return true if the replay ended in the same state as the run that was recorded, or got as far as the trace
+    /// goes if it was never closed.
+    bool Replay(const char* imageFilename, const char* traceFilename)
+    {
+        lc3::Snapshot image;
+        if (!lc3::ReadSnapshot(imageFilename, image) && !Lc3C::ReadImage(imageFilename, image))
+        {
+            fprintf(stderr, "failed to load image: %s\n", imageFilename);
+            return false;
+        }
 
-                default:
-                    break;
-                }
+        auto vm = std::make_unique<Lc3C>();
+        vm->Restore(image);
+        if (!vm->StartReplay(traceFilename))
+        {
+            fprintf(stderr, "failed to read trace, or it was recorded from a different image: %s\n", traceFilename);
+            return false;
+        }
+
+        // There is nothing to wait for, as the trace says what the devices gave, so traps are fulfilled straight away.
+        lc3::TraceReader& trace = *vm->Replay();
+        constexpr uint64_t slice = 1 << 20;
+        lc3::Status status = vm->GetStatus();
+        while (!status.IsStopped() && !trace.Diverged())
+        {
+            // Halt the VM at the same instruction that it was halted at when it was recorded.
+            uint64_t haltAt = 0;
+            const bool haltDue = trace.HaltDue(haltAt);
+            if (haltDue && vm->TraceRetired() >= haltAt)
+            {
+                vm->Halt();
+                trace.Halted();
+                break;
+            }
+            if (status.IsTrapped())
+            {
+                status = vm->Trap(status.GetTrap());
+                continue;
             }
+            const uint64_t ticks = haltDue ? std::min(slice, haltAt - vm->TraceRetired()) : slice;
+            status = vm->Run(static_cast<int>(ticks));
         }
+        vm->Output().Flush();
 
-        return !IsStopped(state);
+        const auto retired = static_cast<unsigned long long>(vm->TraceRetired());
+        uint64_t endRetired;
+        uint64_t endHash;
+        if (trace.Diverged())
+        {
+            fprintf(stderr, "replay diverged from the trace after %llu instructions\n", retired);
+            return false;
+        }
+        if (trace.Truncated())
+        {
+            fprintf(stderr, "replayed %llu instructions, as far as the trace goes\n", retired);
+            return true;
+        }
+        if (!trace.AtEnd(endRetired, endHash) || endRetired != vm->TraceRetired() || endHash != lc3::HashState(vm->Save()))
+        {
+            fprintf(stderr, "replay ended differently from the recorded run, after %llu instructions\n", retired);
+            return false;
+        }
+        fprintf(stderr, "replayed %llu instructions, ending in the recorded state\n", retired);
+        return true;
     }
 
-    return true;
-}
+    /// \brief Splits a comma-separated list.
+    std::vector<std::string> SplitList(const char* list)
+    {
+        std::vector<std::string> items;
+        for (const char* start = list;; ++start)
+        {
+            const char* end = strchr(start, ',');
+            const size_t length = end ? static_cast<size_t>(end - start) : strlen(start);
+            if (length != 0)
+            {
+                items.emplace_back(start, length);
+            }
+            if (!end)
+            {
+                return items;
+            }
+            start = end;
+        }
+    }
 
-void Run(std::vector<VmState>&& vms)
-{
-    size_t consoleOwner = 0;
-    size_t running = vms.size();
-    while (running > 0)
+    /// \brief Runs each image as a job on a cluster, giving it its own input like --headless does, and prints or writes
+    /// the jobs' output once they have all finished. How each job ended is printed to stderr.
+    /// \return the process's exit status, which is 1 if any job couldn't be run.
+    int RunOnCluster(const std::vector<std::string>& nodes, const char* const* images, size_t imageCount,
+                     const std::string& sharedInput, const char* inputDir, const char* outputDir)
     {
-        if (_kbhit())
+        std::map<std::string, lc3::Snapshot> snapshots;
+        std::vector<ClusterJob> jobs;
+        for (size_t i = 0; i < imageCount; ++i)
+        {
+            auto snapshot = snapshots.find(images[i]);
+            if (snapshot == snapshots.end())
+            {
+                lc3::Snapshot loaded;
+                if (!lc3::ReadSnapshot(images[i], loaded) && !Lc3C::ReadImage(images[i], loaded))
+                {
+                    printf("failed to load image: %s\n", images[i]);
+                    return 1;
+                }
+                snapshot = snapshots.emplace(images[i], std::move(loaded)).first;
+            }
+
+            ClusterJob job{snapshot->second, sharedInput};
+            if (inputDir)
+            {
+                const std::string filename = std::string(inputDir) + "/" + std::to_string(i) + ".in";
+                if (!ReadFile(filename, job.input))
+                {
+                    printf("failed to read input: %s\n", filename.c_str());
+                    return 1;
+                }
+            }
+            jobs.push_back(std::move(job));
+        }
+
+        const std::vector<ClusterResult> results = RunJobs(nodes, jobs);
+
+        int exitStatus = 0;
+        for (size_t i = 0; i < results.size(); ++i)
         {
-            uint16_t key = _getch();
-            // If the user pressed [Esc] then cycle console ownership to the next VM.
-            if (key == '\x1b')
+            const ClusterResult& result = results[i];
+            if (outputDir)
             {
-                consoleOwner = (consoleOwner + 1) % vms.size();
-                fprintf(stderr, "\nConsole owner: %zd\n", consoleOwner);
+                const std::string filename = std::string(outputDir) + "/" + std::to_string(i) + ".out";
+                FILE* file = fopen(filename.c_str(), "wb");
+                if (!file || fwrite(result.output.data(), 1, result.output.size(), file) != result.output.size())
+                {
+                    printf("failed to write output: %s\n", filename.c_str());
+                    exitStatus = 1;
+                }
+                if (file)
+                {
+                    fclose(file);
+                }
             }
-            // Otherwise pass the key to the console owner and unblock it.
             else
             {
-                vms[consoleOwner].SetKey(key);
-                vms[consoleOwner].ClearBlocked(VmState::isBlockedOnInput);
+                if (results.size() > 1)
+                {
+                    printf("%s==> %zu: %s <==\n", i == 0 ? "" : "\n", i, images[i]);
+                }
+                fwrite(result.output.data(), 1, result.output.size(), stdout);
             }
         }
+        fflush(stdout);
 
-        // The console owner VM can't be blocked on output.
-        vms[consoleOwner].ClearBlocked(VmState::isBlockedOnOutput);
-
-        for (auto& vm : vms)
+        static const char* const statusNames[] = {"halted", "halted for want of input", "bad image", "not run"};
+        for (size_t i = 0; i < results.size(); ++i)
         {
-            if (!vm.Run())
+            const ClusterResult& result = results[i];
+            const char* status = result.status <= JOB_NOT_RUN ? statusNames[result.status] : "unknown status";
+            if (result.status == JOB_HALTED || result.status == JOB_STARVED)
             {
-                // The VM just stopped.
-                running--;
+                fprintf(stderr, "%zu: %s: %s after %llu instructions on %s\n", i, images[i], status,
+                        static_cast<unsigned long long>(result.retired), result.node.c_str());
+            }
+            else
+            {
+                fprintf(stderr, "%zu: %s: %s\n", i, images[i], status);
+                exitStatus = 1;
             }
         }
+        return exitStatus;
     }
-}
+
+    void Usage(const char* program)
+    {
+        printf("%s [options] [image-file1] ...\n", program);
+        printf("%s --make-cache [image-file] [cache-file]\n", program);
+        printf("%s --make-snapshot [image-file] [snapshot-file] [max-instructions]\n", program);
+        printf("%s --replay [image-file] [trace-file]\n", program);
+        printf("%s --serve [port] [workers]\n", program);
+        printf("\nAn image file can be an object file, an image cache or a snapshot. The code in each image is analysed when\n");
+        printf("it is loaded, so that it can be decoded before it runs, and the analysis is cached in image-file%s.\n", lc3::ANALYSIS_EXTENSION);
+        printf("\noptions:\n");
+        printf("  --headless        run without a console. Output is printed once every VM has halted, and a VM that\n");
+        printf("                    has no input of its own is halted when it reads a key\n");
+        printf("  --input file      feed every VM's keyboard from the given file\n");
+        printf("  --input-dir dir   feed VM n's keyboard from dir/n.in\n");
+        printf("  --output-dir dir  write VM n's output to dir/n.out\n");
+        printf("  --trace-dir dir   record VM n's keys, timer expiries and halts to dir/n.trace, to --replay later\n");
+        printf("  --priority n:p    run VM n at priority p, from %d to %d. Each step up doubles its time slices\n", VmState::MIN_PRIORITY, VmState::MAX_PRIORITY);
+        printf("  --watch a-b:rwx   log every VM's reads (r), writes (w) and execution (x) of hex addresses a to b. The\n");
+        printf("                    default is rw. Needs a build with LC3_MEMORY_STATS\n");
+        printf("  --cluster nodes   run the VMs on the comma-separated nodes, each a host:port running --serve, rather\n");
+        printf("                    than here. Implies --headless. Snapshots are sent as they are, so VMs carry on\n");
+        printf("                    from where they were snapshotted\n");
+        printf("  --metrics file    write the VMs' and workers' metrics to file in the Prometheus text format while they\n");
+        printf("                    run, replacing it each time, and when they have all stopped\n");
+        printf("  --metrics-interval s\n");
+        printf("                    write metrics every s seconds. The default is 10\n");
+        printf("  --host-counters   include the host's hardware counters, e.g., cycles and cache misses, in the metrics.\n");
+        printf("                    Needs Linux and perf_event\n");
+        printf("  --latency ms      keep time slices to about ms milliseconds, so that a VM woken by a key waits no\n");
+        printf("                    longer than that for its turn. The default is 2\n");
+    }
+} // namespace
 
 int main(int argc, const char* argv[])
 {
     if (argc < 2)
     {
-        printf("%s [image-file1] ...\n", argv[0]);
+        Usage(argv[0]);
         exit(2);
     }
 
-    std::vector<VmState> vms;
+    // Convert an image file into an image cache, which can be given in place of the image file and loads faster.
+    if (strcmp(argv[1], "--make-cache") == 0)
+    {
+        if (argc != 4 || !lc3::WriteImageCache(argv[2], argv[3]))
+        {
+            printf("failed to write image cache\n");
+            exit(1);
+        }
+        return 0;
+    }
+
+    // Boot an image until it first asks for input, and snapshot it. VMs started from the snapshot pick up from there.
+    if (strcmp(argv[1], "--make-snapshot") == 0)
+    {
+        if (argc < 4 || argc > 5 || !MakeSnapshot(argv[2], argv[3], argc == 5 ? atoll(argv[4]) : -1))
+        {
+            printf("failed to write snapshot\n");
+            exit(1);
+        }
+        return 0;
+    }
 
-    for (int i = 1; i < argc; ++i)
+    // Re-run a VM exactly as it ran when its trace was recorded.
+    if (strcmp(argv[1], "--replay") == 0)
     {
-        VmState vmState;
+        if (argc != 4 || !Replay(argv[2], argv[3]))
+        {
+            exit(1);
+        }
+        return 0;
+    }
 
-        if (!vmState.ReadImage(argv[i]))
+    // Run jobs sent by other hosts, each an image or snapshot and its input, until killed.
+    if (strcmp(argv[1], "--serve") == 0)
+    {
+        if (argc < 3 || argc > 4 || !ServeJobs(argv[2], argc == 4 ? static_cast<size_t>(atoi(argv[3])) : 0, SliceLimits()))
         {
-            printf("failed to load image: %s\n", argv[i]);
+            printf("failed to serve jobs\n");
             exit(1);
         }
+        return 0;
+    }
+
+    // Options come before the images. VMs are numbered by their image's position amongst the images, from 0.
+    bool headless = false;
+    const char* input = nullptr;
+    const char* inputDir = nullptr;
+    const char* outputDir = nullptr;
+    const char* traceDir = nullptr;
+    std::map<size_t, int> priorities;
+    struct Watch
+    {
+        unsigned start;
+        unsigned end;
+        uint8_t access;
+    };
+    std::vector<Watch> watches;
+    std::vector<std::string> nodes;
+    const char* metrics = nullptr;
+    double metricsInterval = 10;
+    bool hostCounters = false;
+    SliceLimits limits;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; ++first)
+    {
+        const bool hasValue = first + 1 < argc;
+        if (strcmp(argv[first], "--headless") == 0)
+        {
+            headless = true;
+        }
+        else if (strcmp(argv[first], "--input") == 0 && hasValue)
+        {
+            input = argv[++first];
+        }
+        else if (strcmp(argv[first], "--input-dir") == 0 && hasValue)
+        {
+            inputDir = argv[++first];
+        }
+        else if (strcmp(argv[first], "--output-dir") == 0 && hasValue)
+        {
+            outputDir = argv[++first];
+        }
+        else if (strcmp(argv[first], "--trace-dir") == 0 && hasValue)
+        {
+            traceDir = argv[++first];
+        }
+        else if (strcmp(argv[first], "--priority") == 0 && hasValue)
+        {
+            size_t vm;
+            int priority;
+            if (sscanf(argv[++first], "%zu:%d", &vm, &priority) != 2)
+            {
+                Usage(argv[0]);
+                exit(2);
+            }
+            priorities[vm] = priority;
+        }
+        else if (strcmp(argv[first], "--watch") == 0 && hasValue)
+        {
+            Watch watch{};
+            char access[4] = "rw";
+            // Addresses can be written the way LC-3 assembly writes them, e.g., x3000-x30FF, or as bare hex.
+            const char* range = argv[++first];
+            int fields = sscanf(range, "x%x-x%x:%3[rwx]", &watch.start, &watch.end, access);
+            if (fields < 2)
+            {
+                fields = sscanf(range, "%x-%x:%3[rwx]", &watch.start, &watch.end, access);
+            }
+            if (!Lc3C::Monitor::enabled)
+            {
+                printf("--watch needs a build with LC3_MEMORY_STATS\n");
+                exit(2);
+            }
+            if (fields < 2 || watch.start > watch.end || watch.end > 0xffff)
+            {
+                Usage(argv[0]);
+                exit(2);
+            }
+            for (const char* c = access; *c; ++c)
+            {
+                watch.access |= *c == 'r' ? lc3::ACCESS_READ : *c == 'w' ? lc3::ACCESS_WRITE : lc3::ACCESS_EXECUTE;
+            }
+            watches.push_back(watch);
+        }
+        else if (strcmp(argv[first], "--cluster") == 0 && hasValue)
+        {
+            nodes = SplitList(argv[++first]);
+            if (nodes.empty())
+            {
+                Usage(argv[0]);
+                exit(2);
+            }
+        }
+        else if (strcmp(argv[first], "--metrics") == 0 && hasValue)
+        {
+            metrics = argv[++first];
+        }
+        else if (strcmp(argv[first], "--metrics-interval") == 0 && hasValue)
+        {
+            metricsInterval = atof(argv[++first]);
+            if (metricsInterval <= 0)
+            {
+                Usage(argv[0]);
+                exit(2);
+            }
+        }
+        else if (strcmp(argv[first], "--host-counters") == 0)
+        {
+            hostCounters = true;
+        }
+        else if (strcmp(argv[first], "--latency") == 0 && hasValue)
+        {
+            const double ms = atof(argv[++first]);
+            if (ms <= 0)
+            {
+                Usage(argv[0]);
+                exit(2);
+            }
+            limits.latency = std::chrono::duration_cast<Lc3C::Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+        }
+        else
+        {
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+
+    // Every VM that is fed from the same input file gets its own copy of it.
+    std::string sharedInput;
+    if (input && !ReadFile(input, sharedInput))
+    {
+        printf("failed to read input: %s\n", input);
+        exit(1);
+    }
+
+    if (!nodes.empty())
+    {
+        if (traceDir || !priorities.empty() || !watches.empty() || metrics)
+        {
+            printf("--trace-dir, --priority, --watch and --metrics can't be used with --cluster\n");
+            exit(2);
+        }
+        return RunOnCluster(nodes, argv + first, static_cast<size_t>(argc - first), sharedInput, inputDir, outputDir);
+    }
+
+    VmPool vms(static_cast<size_t>(argc - first));
+    std::vector<VmState*> captured; // The VMs whose output is captured, in order.
+
+    // Each image is loaded and analysed once, and the VMs that run it share its pages until they write to them. An
+    // image that isn't a snapshot starts from a reset VM.
+    struct Image
+    {
+        lc3::Snapshot snapshot;
+        lc3::Analysis analysis;
+    };
+    std::map<std::string, Image> images;
+
+    for (int i = first; i < argc; ++i)
+    {
+        auto image = images.find(argv[i]);
+        if (image == images.end())
+        {
+            lc3::Snapshot snapshot;
+            if (!lc3::ReadSnapshot(argv[i], snapshot) && !Lc3C::ReadImage(argv[i], snapshot))
+            {
+                printf("failed to load image: %s\n", argv[i]);
+                exit(1);
+            }
+            auto analysis = lc3::AnalyseImage(argv[i], snapshot.mem, snapshot.regs.pc);
+            image = images.emplace(argv[i], Image{std::move(snapshot), std::move(analysis)}).first;
+        }
+
+        const size_t vm = vms.Size();
+        VmState& vmState = vms.Emplace();
+        const std::string name = std::to_string(vm);
+        if (inputDir)
+        {
+            const std::string filename = std::string(inputDir) + "/" + name + ".in";
+            std::string keys;
+            if (!ReadFile(filename, keys))
+            {
+                printf("failed to read input: %s\n", filename.c_str());
+                exit(1);
+            }
+            vmState.SetInput(std::move(keys));
+        }
+        else if (input || headless)
+        {
+            vmState.SetInput(sharedInput);
+        }
+        if (outputDir)
+        {
+            const std::string filename = std::string(outputDir) + "/" + name + ".out";
+            if (!vmState.OpenOutput(filename.c_str()))
+            {
+                printf("failed to open output: %s\n", filename.c_str());
+                exit(1);
+            }
+        }
+        else if (headless)
+        {
+            vmState.CaptureOutput();
+            captured.push_back(&vmState);
+        }
+        for (const auto& watch : watches)
+        {
+            vmState.Watch(static_cast<uint16_t>(watch.start), static_cast<uint16_t>(watch.end), watch.access);
+        }
+        if (const auto priority = priorities.find(vm); priority != priorities.end())
+        {
+            vmState.SetPriority(priority->second);
+        }
+        vmState.Restore(image->second.snapshot);
+        vmState.Prepare(image->second.analysis);
+        if (traceDir)
+        {
+            const std::string filename = std::string(traceDir) + "/" + name + ".trace";
+            if (!vmState.StartTrace(filename.c_str()))
+            {
+                printf("failed to open trace: %s\n", filename.c_str());
+                exit(1);
+            }
+        }
+    }
+
+    if (headless)
+    {
+        // Nothing reads the keyboard, so the VMs run flat out until they have all halted.
+        Scheduler::HeadlessConsole console;
+        Scheduler scheduler(std::move(vms), 0, limits);
+        RunScheduler(scheduler, console, metrics, metricsInterval, hostCounters);
 
-        vms.push_back(vmState);
+        // Print the output a VM at a time, so that VMs running side by side don't interleave it.
+        for (size_t i = 0; i < captured.size(); ++i)
+        {
+            const std::string& output = captured[i]->CapturedOutput();
+            if (captured.size() > 1)
+            {
+                printf("%s==> %zu: %s <==\n", i == 0 ? "" : "\n", i, argv[first + i]);
+            }
+            fwrite(output.data(), 1, output.size(), stdout);
+        }
+        fflush(stdout);
+        return 0;
     }
 
     signal(SIGINT, HandleInterrupt);
     DisableInputBuffering();
 
-    Run(std::move(vms));
+    PlatformConsole console;
+    Scheduler scheduler(std::move(vms), 0, limits);
+    RunScheduler(scheduler, console, metrics, metricsInterval, hostCounters);
 
     RestoreInputBuffering();
 }